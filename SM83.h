@@ -9,8 +9,82 @@ extern "C" {
 #include <stddef.h>
 
 typedef struct SM83Instruction SM83Instruction; // Forward declaration
+typedef struct SM83 SM83;
 
-typedef struct {
+// Pending events at once, per instance
+#ifndef SM83_MAX_EVENTS
+#define SM83_MAX_EVENTS 16
+#endif
+
+// The JIT only targets x86-64 Linux, and compiles blocks from the block cache
+#if defined(SM83_JIT) && !(defined(__x86_64__) && defined(__linux__))
+#undef SM83_JIT
+#endif
+
+#if defined(SM83_JIT) && !defined(SM83_BLOCK_CACHE)
+#define SM83_BLOCK_CACHE
+#endif
+
+#ifdef SM83_BLOCK_CACHE
+// Decoded blocks kept per instance (in sets of two, so an even count), host pages tracked
+// for the code on them, and instructions per block
+#ifndef SM83_BLOCKS
+#define SM83_BLOCKS 4096
+#endif
+#ifndef SM83_CODE_PAGES
+#define SM83_CODE_PAGES 1024
+#endif
+#define SM83_BLOCK_OPS 16
+
+typedef struct SM83BlockOp {
+  void (*exec)(SM83 *);
+  const SM83Instruction *instruction;
+  uint8_t ticks;
+  uint8_t size; // Opcode bytes, 2 after a CB prefix
+  uint8_t operands[2];
+  uint8_t memory; // Touches memory, where IE, IF, the block itself or the bank may change
+} SM83BlockOp;
+
+typedef struct SM83Block {
+  const uint8_t *page; // read_map page it was decoded from, NULL when unused
+#ifdef SM83_JIT
+  uint64_t (*native)(SM83 *, uint64_t); // Compiled block, runs for up to the given T-cycles
+  uint16_t hits;
+#endif
+  uint16_t pc;
+  uint16_t ticks; // The most it can take, with its branch taken
+  uint8_t count;
+  uint8_t length; // Bytes
+  SM83BlockOp ops[SM83_BLOCK_OPS];
+} SM83Block;
+
+// Host page some blocks were decoded from, and the bytes of it they cover
+typedef struct SM83CodePage {
+  const uint8_t *page; // NULL when unused
+  uint8_t bytes[0x20]; // One bit per byte, byte N is bit N & 7 of bytes[N >> 3]
+} SM83CodePage;
+#endif
+
+typedef struct SM83Event {
+  uint64_t when; // Absolute T-cycle
+  void (*callback)(SM83 *, void *, uint64_t); // (cpu, data, when)
+  void *data;
+} SM83Event;
+
+// One instruction about to run, as SM83_trace hands them over. Fixed-size, no pointers,
+// so that they can be written out as they are (in host byte order)
+typedef struct SM83TraceRecord {
+  uint64_t cycles; // SM83::cycles as it starts
+  uint16_t pc, sp;
+  uint16_t af, bc, de, hl;
+  uint8_t opcode[3]; // As many bytes as the instruction has, zeros after. Zeros if not mapped
+  uint8_t ime;
+  uint8_t ie, if_;
+  uint8_t halted;
+  uint8_t reserved[5];
+} SM83TraceRecord;
+
+struct SM83 {
   // Registers
   union {
     struct { uint8_t f, a; };
@@ -35,15 +109,87 @@ typedef struct {
   uint16_t sp;
   uint16_t pc;
 
-  // Read/Write functions
-  uint8_t (*read)(uint16_t);
-  void (*write)(uint16_t, uint8_t);
-
   // Internals
   uint8_t t;
 
   const SM83Instruction *instruction; // Debug
-} SM83;
+
+  // Last ALU operation when flags are evaluated lazily (SM83_LAZY_FLAGS),
+  // F is only built from it once something reads it
+  uint8_t flags_op;
+  uint8_t flags_x, flags_y;
+  uint16_t flags_result;
+
+  // Interrupts
+  uint8_t ime;
+  uint8_t ime_delay; // EI enables interrupts only after the next instruction
+  uint8_t halted;
+
+#ifdef SM83_BLOCK_CACHE
+  const uint8_t *operands; // Immediates of the instruction running from a block
+#endif
+
+  // Everything above is private to the instance and may be worked on from a copy
+  // while SM83_run is going. Everything below is shared with the host and is always
+  // reached through `bus` (the instance itself, unless this is that copy)
+  struct SM83 *bus;
+
+  // Read/Write functions, `userdata` is passed as their first argument
+  uint8_t (*read)(void *, uint16_t);
+  void (*write)(void *, uint16_t, uint8_t);
+  void *userdata;
+
+  // Context-free functions given to SM83_init
+  uint8_t (*legacy_read)(uint16_t);
+  void (*legacy_write)(uint16_t, uint8_t);
+
+  // Memory map, one entry per 256 byte page pointing straight at host memory.
+  // NULL entries go through read/write instead
+  const uint8_t *read_map[0x100];
+  uint8_t *write_map[0x100];
+
+  // Interrupt enable (0xFFFF) and interrupt flag (0xFF0F) registers. The host decides
+  // how they show up in memory, and raises interrupts with SM83_interrupt
+  uint8_t ie;
+  uint8_t if_;
+
+  // T-cycles run since SM83_init, and the events scheduled against it (a min-heap on `when`)
+  uint64_t cycles;
+  SM83Event events[SM83_MAX_EVENTS];
+  unsigned event_count;
+
+#ifdef SM83_BLOCK_CACHE
+  // Both hashed on host addresses (of the first byte, of the page), so that writes through
+  // any mapping of the same memory find them. Blocks go in 2-way sets, pages in slots
+  SM83Block blocks[SM83_BLOCKS];
+  uint8_t block_recent[SM83_BLOCKS / 2]; // Way hit last in each set, the other one goes first
+  SM83CodePage code[SM83_CODE_PAGES];
+#endif
+
+#ifdef SM83_DIRTY_PAGES
+  uint8_t dirty[0x20]; // One bit per 256 byte page the CPU wrote to, page N is bit N & 7 of byte N >> 3
+#endif
+
+#ifdef SM83_PROFILE
+  struct SM83Profile *profile; // Running guest profiler, NULL if none
+#endif
+
+#ifdef SM83_TRACE
+  void (*trace)(void *, const SM83TraceRecord *); // Given every instruction, NULL if not tracing
+  void *trace_data;
+#endif
+
+#ifdef SM83_OPCODE_COUNTS
+  // Runs of every entry of instructions[] then cb_instructions[], by M-cycles taken (0-6)
+  uint64_t opcode_runs[0x200][7];
+#endif
+
+#ifdef SM83_JIT
+  uint8_t *jit_code; // Executable memory, mapped on the first compile
+  size_t jit_used;
+  int jit_disabled; // Mapping it failed
+#endif
+};
 
 struct SM83Instruction {
   const char *mnemonic;
@@ -54,206 +200,1046 @@ struct SM83Instruction {
 
 void SM83_init(SM83 *cpu, uint8_t (*read)(uint16_t), void (*write)(uint16_t, uint8_t));
 
+// Same as SM83_init, but `userdata` is passed to every read/write call so that
+// each instance can own its memory
+void SM83_init_userdata(SM83 *cpu, uint8_t (*read)(void *, uint16_t),
+                        void (*write)(void *, uint16_t, uint8_t), void *userdata);
+
+// Maps [addr, addr + size) straight to host memory, skipping the read/write functions.
+// Both `addr` and `size` must be multiples of 256. Either pointer may be NULL to keep
+// (or go back to) using the functions for that direction
+void SM83_map(SM83 *cpu, uint16_t addr, size_t size, const uint8_t *read, uint8_t *write);
+
 void SM83_reset(SM83 *cpu);
 
+// Interrupt sources, as in IE/IF
+#define SM83_INT_VBLANK 0x01
+#define SM83_INT_STAT 0x02
+#define SM83_INT_TIMER 0x04
+#define SM83_INT_SERIAL 0x08
+#define SM83_INT_JOYPAD 0x10
+
+// Requests the given interrupts (sets them in IF)
+void SM83_interrupt(SM83 *cpu, uint8_t mask);
+
+// Calls `callback(cpu, data, when)` once `cpu->cycles` reaches `when`. Callbacks run between
+// instructions, so they may be late by part of one, and may schedule further events.
+// Returns 0, or -1 if SM83_MAX_EVENTS are already pending
+int SM83_schedule(SM83 *cpu, uint64_t when, void (*callback)(SM83 *, void *, uint64_t), void *data);
+
+// Drops every pending event with the given callback and data
+void SM83_cancel(SM83 *cpu, void (*callback)(SM83 *, void *, uint64_t), const void *data);
+
+// Tells the core that [addr, addr + size) changed without going through the CPU (e.g. the
+// host wrote to mapped memory itself), so no stale code runs from it. Only needed with
+// SM83_BLOCK_CACHE, a no-op otherwise
+void SM83_invalidate(SM83 *cpu, uint16_t addr, size_t size);
+
+// Releases what the core allocated for the instance (the JIT's code), a no-op otherwise
+void SM83_free(SM83 *cpu);
+
+// Copies into `pages` which 256 byte pages the CPU wrote to since the last call (as in
+// SM83::dirty) and starts over. Only tracked with SM83_DIRTY_PAGES, everything is dirty otherwise
+void SM83_dirty_pages(SM83 *cpu, uint8_t pages[0x20]);
+
+// Calls `callback(data, record)` before every instruction `cpu` runs (NULL stops), see
+// SM83_trace.h for writing them to a file. Interrupt dispatch isn't an instruction, it shows
+// as PC landing on the vector. Blocks aren't compiled by the JIT and batches run lane by lane
+// while tracing. Returns 0, or -1 if the core was built without SM83_TRACE
+int SM83_trace(SM83 *cpu, void (*callback)(void *, const SM83TraceRecord *), void *data);
+
+// Runs and T-cycles of one opcode, as counted with SM83_OPCODE_COUNTS
+typedef struct SM83OpcodeCount {
+  uint16_t opcode; // 0x00-0xFF, or 0xCB00-0xCBFF
+  const char *mnemonic;
+  uint64_t runs, cycles;
+  uint64_t histogram[7]; // Runs by M-cycles taken, conditional instructions take two lengths
+} SM83OpcodeCount;
+
+// Writes every opcode that ran since the last SM83_clear_opcode_counts (or SM83_init) into
+// `counts`, the one most T-cycles went to first, and returns how many. Only counted with
+// SM83_OPCODE_COUNTS, always 0 otherwise
+size_t SM83_opcode_counts(const SM83 *cpu, SM83OpcodeCount counts[0x200]);
+void SM83_clear_opcode_counts(SM83 *cpu);
+
+// Guest profiler, sizes
+#ifndef SM83_PROFILE_NODES
+#define SM83_PROFILE_NODES 4096 // Distinct call paths (and functions)
+#endif
+#ifndef SM83_PROFILE_DEPTH
+#define SM83_PROFILE_DEPTH 64 // Nested calls followed
+#endif
+#ifndef SM83_PROFILE_SYMBOLS
+#define SM83_PROFILE_SYMBOLS 16384
+#endif
+
+// Functions are told apart by (bank << 16 | address), the bank being 0 outside 0x4000-0x7FFF
+typedef struct SM83ProfileNode {
+  uint32_t key; // Function called
+  uint16_t function; // Index in SM83Profile::functions
+  uint16_t parent, child, sibling; // Node indices, 0 for none (node 0 is the root)
+  uint64_t samples; // Taken in the function itself, not in a callee
+} SM83ProfileNode;
+
+typedef struct SM83ProfileSymbol {
+  uint32_t key;
+  uint16_t length;
+  const char *name; // Not terminated, points into the text given to SM83_profile_symbols
+} SM83ProfileSymbol;
+
+// Call tree of the guest code, sampled every `interval` T-cycles. CALL, RST, interrupts,
+// RET and RETI keep a shadow call stack, a return drops every frame SP went back past, so
+// code that plays with the stack only throws it off until the next return further up
+typedef struct SM83Profile {
+  uint32_t interval;
+  uint16_t bank; // ROM bank at 0x4000-0x7FFF, kept up to date by the host (1 otherwise)
+
+  SM83ProfileNode nodes[SM83_PROFILE_NODES];
+  unsigned node_count;
+  uint32_t functions[SM83_PROFILE_NODES]; // Keys, the root first
+  unsigned function_count;
+
+  // Shadow call stack: the node before each call, and SP right after it
+  uint16_t node;
+  uint16_t stack_node[SM83_PROFILE_DEPTH];
+  uint16_t stack_sp[SM83_PROFILE_DEPTH];
+  unsigned depth;
+
+  SM83ProfileSymbol symbols[SM83_PROFILE_SYMBOLS]; // By key
+  unsigned symbol_count;
+} SM83Profile;
+
+typedef struct SM83ProfileFunction {
+  uint32_t key;
+  char name[64]; // Symbol, or BB:AAAA
+  uint64_t inclusive, exclusive; // T-cycles, with and without callees
+} SM83ProfileFunction;
+
+// Clears `profile` (symbols included) for a sample every `interval` T-cycles
+void SM83_profile_init(SM83Profile *profile, uint32_t interval);
+
+// Adds the symbols of a .sym file (RGBDS, BGB: "BB:AAAA name" per line, ';' comments).
+// `text` must outlive the profile. Returns the symbols added
+unsigned SM83_profile_symbols(SM83Profile *profile, const char *text, size_t size);
+
+// Starts and stops profiling `cpu` (the sampling takes one event). Profiles add up across
+// runs. Returns 0, or -1 if no event can be scheduled or the core was built without SM83_PROFILE
+int SM83_profile_start(SM83 *cpu, SM83Profile *profile);
+void SM83_profile_stop(SM83 *cpu);
+
+// Writes the samples as folded stacks ("root;caller;callee T-cycles" per line, as
+// flamegraph.pl and most flame graph tools read them), like snprintf: returns the length
+// of the whole text, of which at most `size` - 1 bytes are written and terminated
+size_t SM83_profile_folded(const SM83Profile *profile, char *out, size_t size);
+
+// Writes every function sampled into `functions`, the one most T-cycles went to (callees
+// included) first, and returns how many
+size_t SM83_profile_functions(const SM83Profile *profile, SM83ProfileFunction functions[SM83_PROFILE_NODES]);
+
+// Disassembly, opcodes are 0x00-0xFF or 0xCB00-0xCBFF, and this for a byte that doesn't make
+// a whole instruction (one cut short at the end of the buffer)
+#define SM83_DISASSEMBLY_DATA 0xFFFF
+
+typedef struct SM83Disassembly {
+  size_t offset; // In the buffer
+  uint16_t addr; // Where the CPU sees it
+  uint16_t opcode;
+  uint16_t operand; // Immediate (n, nn or e), 0 if none
+  uint8_t length; // Bytes, 1 for invalid opcodes
+  char text[24]; // The mnemonic with its operand, e.g. "LD BC, 0x1234"
+} SM83Disassembly;
+
+// Compact form for indexing a whole ROM, without the text
+typedef struct SM83IndexEntry {
+  uint32_t offset;
+  uint16_t opcode;
+  uint16_t operand;
+} SM83IndexEntry;
+
+// Decodes `buffer` from the start as a straight run of instructions (`buffer[0]` being at
+// `base` for the CPU) and calls `callback(data, instruction)` with each. `instruction` is
+// only valid during the call, nothing is allocated
+void SM83_disassemble(const uint8_t *buffer, size_t size, uint16_t base,
+                      void (*callback)(void *, const SM83Disassembly *), void *data);
+
+// Same, without formatting anything: writes an entry per instruction into `index`, which
+// must have room for `size` of them (one per byte at worst), and returns how many
+size_t SM83_disassemble_index(const uint8_t *buffer, size_t size, SM83IndexEntry *index);
+
+// Save states
+#define SM83_STATE_MAGIC 0x33384D53 // "SM83" in a little-endian file
+#define SM83_STATE_VERSION 1 // Bumped whenever SM83State changes
+
+// Everything about an instance that outlives SM83_run, as plain fixed-width fields with no
+// pointers, so that it can be copied around or written out as is (in host byte order).
+// Pending events aren't part of it since they point at host code: the host reschedules them
+typedef struct SM83State {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; // sizeof(SM83State)
+  uint32_t memory; // Bytes of host memory following it in the buffer
+
+  uint16_t af, bc, de, hl, sp, pc;
+  uint8_t t;
+  uint8_t ime, ime_delay, halted;
+  uint8_t ie, if_;
+  uint8_t reserved[2];
+
+  uint64_t cycles;
+} SM83State;
+
+// Host memory (WRAM, VRAM, cartridge RAM...) stored right after the state, in the order given
+typedef struct SM83Region {
+  void *data;
+  size_t size;
+} SM83Region;
+
+// Bytes SM83_save_state needs for the state and the given regions
+size_t SM83_state_size(const SM83Region *regions, size_t count);
+
+// Writes the state followed by every region into `buffer`, in one go.
+// Returns the bytes written, or 0 if `size` is too small for them
+size_t SM83_save_state(const SM83 *cpu, void *buffer, size_t size, const SM83Region *regions, size_t count);
+
+// Restores what SM83_save_state wrote, given the same regions. Returns 0, or -1 without
+// touching anything if `buffer` isn't a state of this version or doesn't fit the regions
+int SM83_load_state(SM83 *cpu, const void *buffer, size_t size, const SM83Region *regions, size_t count);
+
+// Rewind, frames kept at most (the memory given to SM83_rewind_init usually runs out first)
+#ifndef SM83_REWIND_FRAMES
+#define SM83_REWIND_FRAMES 1024
+#endif
+
+typedef struct SM83RewindFrame {
+  size_t offset, size; // Encoded bytes in SM83Rewind::data
+  uint8_t key; // Whole state rather than the changes from the frame before
+} SM83RewindFrame;
+
+// History of save states (the CPU plus the regions) in a fixed amount of memory, each
+// frame stored as the XOR with the one before, run-length encoded, with a whole state
+// every `interval` frames. Drops the oldest frames once it runs out of room
+typedef struct SM83Rewind {
+  const SM83Region *regions;
+  size_t count;
+  size_t state_size;
+  uint8_t *current, *next; // Newest frame decoded, and where the one after it is saved
+
+  uint8_t *data; // Encoded frames, as a ring
+  size_t capacity, head;
+
+  SM83RewindFrame frames[SM83_REWIND_FRAMES]; // A ring too, from `first`
+  unsigned first, length;
+  unsigned interval, since_key;
+} SM83Rewind;
+
+// Sets `rewind` up inside `memory`, which must outlive it, as must `regions`.
+// Returns 0, or -1 if `size` can't even hold two states
+int SM83_rewind_init(SM83Rewind *rewind, void *memory, size_t size,
+                     const SM83Region *regions, size_t count, unsigned interval);
+
+// Records the current state as the newest frame. Returns 0, or -1 if it doesn't fit at all
+int SM83_rewind_push(SM83Rewind *rewind, const SM83 *cpu);
+
+// Drops the newest `frames` frames (all but the oldest at most) and loads the one left newest,
+// so 0 goes back to the last SM83_rewind_push. Returns the frames dropped
+unsigned SM83_rewind(SM83Rewind *rewind, SM83 *cpu, unsigned frames);
+
+// Executes one whole instruction and returns the T-cycles it took
+uint8_t SM83_step(SM83 *cpu);
+
+// Executes whole instructions until at least `cycles` T-cycles have elapsed, stopping
+// on the way for every event that comes due.
+// Returns the T-cycles actually consumed (it may overshoot by the last instruction)
+uint64_t SM83_run(SM83 *cpu, uint64_t cycles);
+
+// Advances a single T-cycle (compatibility wrapper around SM83_step)
 void SM83_tick(SM83 *cpu);
 
+// Batches, lanes at most. Batched instructions loop over all of them: a multiple of 32 vectorizes best
+#ifndef SM83_BATCH_LANES
+#define SM83_BATCH_LANES 64
+#endif
+// T-cycles lanes that went separate ways run on their own before trying to get back together
+#ifndef SM83_BATCH_SLICE
+#define SM83_BATCH_SLICE 64
+#endif
+
+// Many instances (usually running the same ROM) stepped in lockstep. Their registers live
+// here, one array per register, so that an instruction every lane is at runs across all of
+// them at once. `cpus` keeps everything else (bus, interrupts, cycles, events), and runs
+// the lanes one by one whenever they don't agree
+typedef struct SM83Batch {
+  SM83 *cpus;
+  unsigned lanes;
+
+  uint8_t r[8][SM83_BATCH_LANES]; // B, C, D, E, H, L, F, A: as opcodes number them, F in place of (HL)
+  uint16_t sp[SM83_BATCH_LANES];
+  uint16_t pc[SM83_BATCH_LANES];
+} SM83Batch;
+
+// Takes over the registers of `cpus[0..lanes)` (initialized as usual), they are only up to
+// date again after SM83_batch_sync
+void SM83_batch_init(SM83Batch *batch, SM83 *cpus, unsigned lanes);
+
+// Copies the registers back to `cpus`
+void SM83_batch_sync(SM83Batch *batch);
+
+// Runs every lane for at least `cycles` T-cycles, as SM83_run would
+void SM83_batch_run(SM83Batch *batch, uint64_t cycles);
+
 #ifdef __cplusplus
 }
 #endif
 
 #endif // SM83_H_
 
-#ifdef SM83_IMPLEMENTATION
+// Headers built on this one include it again, only the first inclusion with
+// SM83_IMPLEMENTATION defined gets the implementation
+#if defined(SM83_IMPLEMENTATION) && !defined(SM83_IMPLEMENTATION_H_)
+#define SM83_IMPLEMENTATION_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef SM83_FLAG_TABLES
+#include <stdatomic.h>
+#endif
+
+#ifdef SM83_JIT
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20 // Hidden by strict -std modes
+#endif
+
+#ifndef SM83_JIT_THRESHOLD
+#define SM83_JIT_THRESHOLD 16 // Runs before a block gets compiled
+#endif
+#ifndef SM83_JIT_SIZE
+#define SM83_JIT_SIZE (1 << 20) // Executable memory per instance, flushed once full
+#endif
+#endif
+
+#if defined(SM83_BLOCK_CACHE) && (defined(SM83_DISPATCH_SWITCH) || defined(SM83_DISPATCH_GOTO))
+#error "SM83_BLOCK_CACHE replaces the SM83_run loop, it can't be combined with SM83_DISPATCH_*"
+#endif
+
+#if defined(SM83_LAZY_FLAGS) && defined(SM83_FLAG_TABLES)
+#error "SM83_LAZY_FLAGS and SM83_FLAG_TABLES are mutually exclusive"
+#endif
+
+// Lazy flags operations, for FLAGS_ADD/FLAGS_SUB flags_result keeps the borrow/carry in
+// bit 8 and flags_x/flags_y the operands. For FLAGS_INC/FLAGS_DEC flags_x is the carry
+#define FLAGS_NONE 0 // F is up to date
+#define FLAGS_ADD 1
+#define FLAGS_SUB 2
+#define FLAGS_AND 3
+#define FLAGS_LOGIC 4 // XOR, OR
+#define FLAGS_INC 5
+#define FLAGS_DEC 6
+
+#ifdef SM83_FLAG_TABLES
+static void flag_tables_init(void);
+#endif
+
+static uint8_t legacy_read(void *userdata, uint16_t addr) {
+  const SM83 *cpu = (const SM83 *)userdata;
+  return cpu->legacy_read(addr);
+}
+
+static void legacy_write(void *userdata, uint16_t addr, uint8_t value) {
+  const SM83 *cpu = (const SM83 *)userdata;
+  cpu->legacy_write(addr, value);
+}
 
 void SM83_init(SM83 *cpu, uint8_t (*read)(uint16_t), void (*write)(uint16_t, uint8_t)) {
+  SM83_init_userdata(cpu, legacy_read, legacy_write, cpu);
+  cpu->legacy_read = read;
+  cpu->legacy_write = write;
+}
+
+void SM83_init_userdata(SM83 *cpu, uint8_t (*read)(void *, uint16_t),
+                        void (*write)(void *, uint16_t, uint8_t), void *userdata) {
+  cpu->bus = cpu;
   cpu->read = read;
   cpu->write = write;
-}
+  cpu->userdata = userdata;
+  cpu->legacy_read = NULL;
+  cpu->legacy_write = NULL;
 
-void SM83_reset(SM83 *cpu) {
-  // TODO
-  cpu->t = 0;
-}
+  cpu->flags_op = FLAGS_NONE; // get_flag trusts it over F
 
-// Flags helpers
-#define FLAG_Z 7
-#define FLAG_N 6
-#define FLAG_H 5
-#define FLAG_C 4
+  memset(cpu->read_map, 0, sizeof(cpu->read_map));
+  memset(cpu->write_map, 0, sizeof(cpu->write_map));
 
-static inline
-void set_flag(uint8_t *flags, uint8_t flag, uint8_t value) {
-  if (value) {
-    *flags |= (uint8_t)(1 << flag);
-  } else {
-    *flags &= (uint8_t)~(1 << flag);
-  }
-}
+  cpu->ie = 0;
+  cpu->if_ = 0;
 
-static inline
-uint8_t get_flag(uint8_t *flags, uint8_t flag) {
-  return (*flags >> flag) & 1;
+  cpu->cycles = 0;
+  cpu->event_count = 0;
+
+#ifdef SM83_BLOCK_CACHE
+  cpu->operands = NULL;
+  memset(cpu->blocks, 0, sizeof(cpu->blocks));
+  memset(cpu->block_recent, 0, sizeof(cpu->block_recent));
+  memset(cpu->code, 0, sizeof(cpu->code));
+#endif
+
+#ifdef SM83_DIRTY_PAGES
+  memset(cpu->dirty, 0, sizeof(cpu->dirty));
+#endif
+
+#ifdef SM83_PROFILE
+  cpu->profile = NULL;
+#endif
+
+#ifdef SM83_TRACE
+  cpu->trace = NULL;
+  cpu->trace_data = NULL;
+#endif
+
+#ifdef SM83_OPCODE_COUNTS
+  memset(cpu->opcode_runs, 0, sizeof(cpu->opcode_runs));
+#endif
+
+#ifdef SM83_JIT
+  cpu->jit_code = NULL;
+  cpu->jit_used = 0;
+  cpu->jit_disabled = 0;
+#endif
+
+#ifdef SM83_FLAG_TABLES
+  flag_tables_init();
+#endif
 }
 
-// Instructions
-// ----------------
-static void nop(SM83 *cpu) { (void)cpu; }
-static void stop(SM83 *cpu) { (void)cpu; } // TODO
-static void halt(SM83 *cpu) { (void)cpu; } // TODO
+void SM83_free(SM83 *cpu) {
+#ifdef SM83_JIT
+  SM83 *bus = cpu->bus;
+  if (bus->jit_code) munmap(bus->jit_code, SM83_JIT_SIZE);
+  bus->jit_code = NULL;
+  for (unsigned i = 0; i < SM83_BLOCKS; i++) bus->blocks[i].native = NULL;
+#else
+  (void)cpu;
+#endif
+}
 
-static void invalid(SM83 *cpu) {
+void SM83_dirty_pages(SM83 *cpu, uint8_t pages[0x20]) {
+#ifdef SM83_DIRTY_PAGES
+  SM83 *bus = cpu->bus;
+  memcpy(pages, bus->dirty, sizeof(bus->dirty));
+  memset(bus->dirty, 0, sizeof(bus->dirty));
+#else
   (void)cpu;
-  // TODO: Decide what to do
+  memset(pages, 0xFF, 0x20);
+#endif
 }
 
-static void di(SM83 *cpu) { (void)cpu; } // TODO
-static void ei(SM83 *cpu) { (void)cpu; } // TODO
+void SM83_map(SM83 *cpu, uint16_t addr, size_t size, const uint8_t *read, uint8_t *write) {
+  const size_t first = addr >> 8;
+  const size_t count = size >> 8;
 
-// ** 8-bit load instructions **
-static void ld_b_b(SM83 *cpu) { cpu->b = cpu->b; }
-static void ld_b_c(SM83 *cpu) { cpu->b = cpu->c; }
-static void ld_b_d(SM83 *cpu) { cpu->b = cpu->d; }
-static void ld_b_e(SM83 *cpu) { cpu->b = cpu->e; }
-static void ld_b_h(SM83 *cpu) { cpu->b = cpu->h; }
-static void ld_b_l(SM83 *cpu) { cpu->b = cpu->l; }
-static void ld_b_a(SM83 *cpu) { cpu->b = cpu->a; }
-static void ld_c_b(SM83 *cpu) { cpu->c = cpu->b; }
-static void ld_c_c(SM83 *cpu) { cpu->c = cpu->c; }
-static void ld_c_d(SM83 *cpu) { cpu->c = cpu->d; }
-static void ld_c_e(SM83 *cpu) { cpu->c = cpu->e; }
-static void ld_c_h(SM83 *cpu) { cpu->c = cpu->h; }
-static void ld_c_l(SM83 *cpu) { cpu->c = cpu->l; }
-static void ld_c_a(SM83 *cpu) { cpu->c = cpu->a; }
-static void ld_d_b(SM83 *cpu) { cpu->d = cpu->b; }
-static void ld_d_c(SM83 *cpu) { cpu->d = cpu->c; }
-static void ld_d_d(SM83 *cpu) { cpu->d = cpu->d; }
-static void ld_d_e(SM83 *cpu) { cpu->d = cpu->e; }
-static void ld_d_h(SM83 *cpu) { cpu->d = cpu->h; }
-static void ld_d_l(SM83 *cpu) { cpu->d = cpu->l; }
-static void ld_d_a(SM83 *cpu) { cpu->d = cpu->a; }
-static void ld_e_b(SM83 *cpu) { cpu->e = cpu->b; }
-static void ld_e_c(SM83 *cpu) { cpu->e = cpu->c; }
-static void ld_e_d(SM83 *cpu) { cpu->e = cpu->d; }
-static void ld_e_e(SM83 *cpu) { cpu->e = cpu->e; }
-static void ld_e_h(SM83 *cpu) { cpu->e = cpu->h; }
-static void ld_e_l(SM83 *cpu) { cpu->e = cpu->l; }
-static void ld_e_a(SM83 *cpu) { cpu->e = cpu->a; }
-static void ld_h_b(SM83 *cpu) { cpu->h = cpu->b; }
-static void ld_h_c(SM83 *cpu) { cpu->h = cpu->c; }
-static void ld_h_d(SM83 *cpu) { cpu->h = cpu->d; }
-static void ld_h_e(SM83 *cpu) { cpu->h = cpu->e; }
-static void ld_h_h(SM83 *cpu) { cpu->h = cpu->h; }
-static void ld_h_l(SM83 *cpu) { cpu->h = cpu->l; }
-static void ld_h_a(SM83 *cpu) { cpu->h = cpu->a; }
-static void ld_l_b(SM83 *cpu) { cpu->l = cpu->b; }
-static void ld_l_c(SM83 *cpu) { cpu->l = cpu->c; }
-static void ld_l_d(SM83 *cpu) { cpu->l = cpu->d; }
-static void ld_l_e(SM83 *cpu) { cpu->l = cpu->e; }
-static void ld_l_h(SM83 *cpu) { cpu->l = cpu->h; }
-static void ld_l_l(SM83 *cpu) { cpu->l = cpu->l; }
-static void ld_l_a(SM83 *cpu) { cpu->l = cpu->a; }
-static void ld_a_b(SM83 *cpu) { cpu->a = cpu->b; }
-static void ld_a_c(SM83 *cpu) { cpu->a = cpu->c; }
-static void ld_a_d(SM83 *cpu) { cpu->a = cpu->d; }
-static void ld_a_e(SM83 *cpu) { cpu->a = cpu->e; }
-static void ld_a_h(SM83 *cpu) { cpu->a = cpu->h; }
-static void ld_a_l(SM83 *cpu) { cpu->a = cpu->l; }
-static void ld_a_a(SM83 *cpu) { cpu->a = cpu->a; }
+  for (size_t i = 0; i < count && first + i < 0x100; i++) {
+    cpu->read_map[first + i] = read ? read + (i << 8) : NULL;
+    cpu->write_map[first + i] = write ? write + (i << 8) : NULL;
+  }
+}
 
-static void ld_b_n(SM83 *cpu) { cpu->b = cpu->read(cpu->pc++); }
-static void ld_c_n(SM83 *cpu) { cpu->c = cpu->read(cpu->pc++); }
-static void ld_d_n(SM83 *cpu) { cpu->d = cpu->read(cpu->pc++); }
-static void ld_e_n(SM83 *cpu) { cpu->e = cpu->read(cpu->pc++); }
-static void ld_h_n(SM83 *cpu) { cpu->h = cpu->read(cpu->pc++); }
-static void ld_l_n(SM83 *cpu) { cpu->l = cpu->read(cpu->pc++); }
-static void ld_a_n(SM83 *cpu) { cpu->a = cpu->read(cpu->pc++); }
-
-static void ld_b_hl(SM83 *cpu) { cpu->b = cpu->read(cpu->hl); }
-static void ld_c_hl(SM83 *cpu) { cpu->c = cpu->read(cpu->hl); }
-static void ld_d_hl(SM83 *cpu) { cpu->d = cpu->read(cpu->hl); }
-static void ld_e_hl(SM83 *cpu) { cpu->e = cpu->read(cpu->hl); }
-static void ld_h_hl(SM83 *cpu) { cpu->h = cpu->read(cpu->hl); }
-static void ld_l_hl(SM83 *cpu) { cpu->l = cpu->read(cpu->hl); }
-static void ld_a_hl(SM83 *cpu) { cpu->a = cpu->read(cpu->hl); }
-static void ld_a_hlp(SM83 *cpu) { cpu->a = cpu->read(cpu->hl++); }
-static void ld_a_hlm(SM83 *cpu) { cpu->a = cpu->read(cpu->hl--); }
-
-static void ldi_bc_a(SM83 *cpu) { cpu->write(cpu->bc, cpu->a); }
-static void ldi_de_a(SM83 *cpu) { cpu->write(cpu->de, cpu->a); }
-static void ldi_hlp_a(SM83 *cpu) { cpu->write(cpu->hl++, cpu->a); }
-static void ldi_hlm_a(SM83 *cpu) { cpu->write(cpu->hl--, cpu->a); }
-static void ldi_hl_b(SM83 *cpu) { cpu->write(cpu->hl, cpu->b); }
-static void ldi_hl_c(SM83 *cpu) { cpu->write(cpu->hl, cpu->c); }
-static void ldi_hl_d(SM83 *cpu) { cpu->write(cpu->hl, cpu->d); }
-static void ldi_hl_e(SM83 *cpu) { cpu->write(cpu->hl, cpu->e); }
-static void ldi_hl_h(SM83 *cpu) { cpu->write(cpu->hl, cpu->h); }
-static void ldi_hl_l(SM83 *cpu) { cpu->write(cpu->hl, cpu->l); }
-static void ldi_hl_a(SM83 *cpu) { cpu->write(cpu->hl, cpu->a); }
-static void ldi_hl_n(SM83 *cpu) { cpu->write(cpu->hl, cpu->read(cpu->pc++)); }
-static void ldi_a_bc(SM83 *cpu) { cpu->a = cpu->read(cpu->bc); }
-static void ldi_a_de(SM83 *cpu) { cpu->a = cpu->read(cpu->de); }
+void SM83_reset(SM83 *cpu) {
+  cpu->t = 0;
+  cpu->flags_op = FLAGS_NONE;
+#ifdef SM83_BLOCK_CACHE
+  cpu->operands = NULL; // fetch() reads from it whenever it's set
+#endif
 
-static void ldh_n_a(SM83 *cpu) {
-  uint16_t n = cpu->read(cpu->pc++);
-  cpu->write(0xFF00 | n, cpu->a);
+  cpu->ime = 0;
+  cpu->ime_delay = 0;
+  cpu->halted = 0;
 }
-static void ldh_c_a(SM83 *cpu) { cpu->write((uint16_t)(0xFF00 | cpu->c), cpu->a); }
-static void ldh_a_c(SM83 *cpu) { cpu->a = cpu->read((uint16_t)(0xFF00 | cpu->c)); }
-static void ldh_a_n(SM83 *cpu) {
-  uint16_t n = cpu->read(cpu->pc++);
-  cpu->a = cpu->read(0xFF00 | n);
+
+void SM83_interrupt(SM83 *cpu, uint8_t mask) {
+  cpu->bus->if_ |= mask;
 }
 
-static void ld_a_nn(SM83 *cpu) {
-  uint16_t low = cpu->read(cpu->pc++);
-  uint16_t high = cpu->read(cpu->pc++);
-  uint16_t nn = (uint16_t)(high << 8) | low;
-  cpu->a = cpu->read(nn);
+// Event heap helpers
+static void events_up(SM83 *cpu, unsigned i) {
+  const SM83Event event = cpu->events[i];
+
+  while (i > 0) {
+    const unsigned parent = (i - 1) / 2;
+    if (cpu->events[parent].when <= event.when) break;
+    cpu->events[i] = cpu->events[parent];
+    i = parent;
+  }
+
+  cpu->events[i] = event;
 }
-static void ld_nn_a(SM83 *cpu) {
-  uint16_t low = cpu->read(cpu->pc++);
-  uint16_t high = cpu->read(cpu->pc++);
-  uint16_t nn = (uint16_t)(high << 8) | low;
-  cpu->write(nn, cpu->a);
+
+static void events_down(SM83 *cpu, unsigned i) {
+  const SM83Event event = cpu->events[i];
+
+  for (;;) {
+    unsigned child = 2 * i + 1;
+    if (child >= cpu->event_count) break;
+    if (child + 1 < cpu->event_count && cpu->events[child + 1].when < cpu->events[child].when) child++;
+    if (event.when <= cpu->events[child].when) break;
+    cpu->events[i] = cpu->events[child];
+    i = child;
+  }
+
+  cpu->events[i] = event;
 }
 
-// ** 8-bit arithmetic and logical instructions **
-#define ADD(value) { \
-  uint8_t result = (uint8_t)(cpu->a + value); \
-  set_flag(&cpu->f, FLAG_Z, (result == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, (((cpu->a & 0x0F) + (value & 0x0F)) & 0x10) == 0x10); \
-  set_flag(&cpu->f, FLAG_C, (result < cpu->a)); \
-  cpu->a = result; \
+static void events_remove(SM83 *cpu, unsigned i) {
+  cpu->events[i] = cpu->events[--cpu->event_count];
+  if (i < cpu->event_count) {
+    events_down(cpu, i);
+    events_up(cpu, i);
+  }
 }
-#define ADDr(r) { \
-  uint8_t value = cpu->r; \
-  ADD(value); \
+
+// Fires every event that is due, in order
+static void events_run(SM83 *cpu) {
+  while (cpu->event_count && cpu->events[0].when <= cpu->cycles) {
+    const SM83Event event = cpu->events[0];
+    events_remove(cpu, 0);
+    event.callback(cpu, event.data, event.when);
+  }
 }
 
-static void add_a_b(SM83 *cpu) { ADDr(b); }
-static void add_a_c(SM83 *cpu) { ADDr(c); }
-static void add_a_d(SM83 *cpu) { ADDr(d); }
-static void add_a_e(SM83 *cpu) { ADDr(e); }
-static void add_a_h(SM83 *cpu) { ADDr(h); }
-static void add_a_l(SM83 *cpu) { ADDr(l); }
-static void add_a_a(SM83 *cpu) { ADDr(a); }
-static void add_a_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); ADD(value); }
-static void add_a_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); ADD(value); }
+int SM83_schedule(SM83 *cpu, uint64_t when, void (*callback)(SM83 *, void *, uint64_t), void *data) {
+  SM83 *bus = cpu->bus;
+  if (bus->event_count == SM83_MAX_EVENTS) return -1;
 
-#define ADC(value) { \
-  uint8_t carry = (cpu->f >> FLAG_C) & 1; \
-  uint8_t result = (uint8_t)(cpu->a + value + carry); \
-  set_flag(&cpu->f, FLAG_Z, (result == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, (((cpu->a & 0x0F) + (value & 0x0F) + carry) & 0x10) == 0x10); \
-  set_flag(&cpu->f, FLAG_C, (((cpu->a & 0xFF) + (value & 0xFF) + carry) & 0x100) == 0x100); \
-  cpu->a = result; \
+  bus->events[bus->event_count] = (SM83Event){ when, callback, data };
+  events_up(bus, bus->event_count++);
+  return 0;
 }
-#define ADCr(r) { \
-  uint8_t value = cpu->r; \
-  ADC(value); \
+
+void SM83_cancel(SM83 *cpu, void (*callback)(SM83 *, void *, uint64_t), const void *data) {
+  SM83 *bus = cpu->bus;
+
+  unsigned count = 0;
+  for (unsigned i = 0; i < bus->event_count; i++) {
+    if (bus->events[i].callback != callback || bus->events[i].data != data) bus->events[count++] = bus->events[i];
+  }
+
+  // Rebuild the heap from what's left
+  bus->event_count = count;
+  for (unsigned i = count / 2; i-- > 0;) events_down(bus, i);
+}
+
+// Bus helpers
+// Mapped pages are accessed directly, the rest go to the host bus.
+// Defining SM83_READ(userdata, addr) and SM83_WRITE(userdata, addr, value) before
+// including the implementation makes the core call them directly instead of going
+// through cpu->read/cpu->write, so the host bus can be inlined into every handler. Mapped
+// pages still come first: a host doing all of memory itself maps nothing
+#if defined(SM83_READ) != defined(SM83_WRITE)
+#error "SM83_READ and SM83_WRITE must be defined together"
+#endif
+
+static inline
+uint8_t bus_read(SM83 *cpu, uint16_t addr) {
+  const SM83 *bus = cpu->bus;
+
+  const uint8_t *page = bus->read_map[addr >> 8];
+  if (page) return page[addr & 0xFF];
+
+#ifdef SM83_READ
+  return SM83_READ(bus->userdata, addr);
+#else
+  return bus->read(bus->userdata, addr);
+#endif
+}
+
+#ifdef SM83_BLOCK_CACHE
+#define BLOCK_BYTES (SM83_BLOCK_OPS * 3) // Longest a block gets
+
+// The two blocks a host address may be in. Fibonacci hashing, as blocks often start a
+// power of two apart (the same code in every bank, unrolled loops...)
+static inline
+SM83Block *block_set(SM83 *bus, const uint8_t *page, unsigned offset) {
+  const uint32_t hash = (uint32_t)(uintptr_t)(page + offset) * 2654435761u;
+  return &bus->blocks[((uint64_t)hash * (SM83_BLOCKS / 2) >> 32) * 2];
+}
+
+static inline
+SM83CodePage *code_slot(SM83 *bus, const uint8_t *page) {
+  return &bus->code[((uintptr_t)page >> 8) % SM83_CODE_PAGES];
+}
+
+// Drops every block covering byte `offset` of host page `page`. Blocks never cross a page,
+// so only those starting up to a block's length before it can, whatever address they ran at
+static void blocks_invalidate(SM83 *bus, const uint8_t *page, unsigned offset) {
+  for (unsigned start = offset >= BLOCK_BYTES ? offset - (BLOCK_BYTES - 1) : 0; start <= offset; start++) {
+    SM83Block *set = block_set(bus, page, start);
+    for (unsigned way = 0; way < 2; way++) {
+      SM83Block *block = &set[way];
+      if (block->page == page && (block->pc & 0xFF) == start && offset - start < block->length) block->page = NULL;
+    }
+  }
+
+  code_slot(bus, page)->bytes[offset >> 3] &= (uint8_t)~(1 << (offset & 7));
+}
+
+// Called for every byte about to change on a host page
+static inline
+void code_write(SM83 *bus, const uint8_t *page, unsigned offset) {
+  const SM83CodePage *code = code_slot(bus, page);
+  if (code->page == page && (code->bytes[offset >> 3] & (1 << (offset & 7)))) blocks_invalidate(bus, page, offset);
+}
+#endif
+
+void SM83_invalidate(SM83 *cpu, uint16_t addr, size_t size) {
+#ifdef SM83_BLOCK_CACHE
+  SM83 *bus = cpu->bus;
+
+  for (size_t i = 0; i < size && addr + i < 0x10000; i++) {
+    const uint16_t at = (uint16_t)(addr + i);
+    const uint8_t *page = bus->read_map[at >> 8];
+    if (page) code_write(bus, page, at & 0xFF);
+  }
+#else
+  (void)cpu; (void)addr; (void)size;
+#endif
+}
+
+static inline
+void bus_write(SM83 *cpu, uint16_t addr, uint8_t value) {
+  SM83 *bus = cpu->bus;
+
+  uint8_t *page = bus->write_map[addr >> 8];
+
+#ifdef SM83_BLOCK_CACHE
+  // Either path may land on memory someone decoded code from, through this mapping or
+  // another one. The callbacks are taken to write where reads come from
+  const uint8_t *target = page ? page : bus->read_map[addr >> 8];
+  if (target) code_write(bus, target, addr & 0xFF);
+#endif
+
+#ifdef SM83_DIRTY_PAGES
+  bus->dirty[addr >> 11] |= (uint8_t)(1 << ((addr >> 8) & 7));
+#endif
+
+  if (page) { page[addr & 0xFF] = value; return; }
+
+#ifdef SM83_WRITE
+  SM83_WRITE(bus->userdata, addr, value);
+#else
+  bus->write(bus->userdata, addr, value);
+#endif
+}
+
+#ifdef SM83_PROFILE
+static inline
+uint32_t profile_key(const SM83Profile *profile, uint16_t addr) {
+  return (addr >= 0x4000 && addr < 0x8000) ? (uint32_t)profile->bank << 16 | addr : addr;
+}
+
+// The node for calling `key` from `parent`, made if needed. `parent` itself once full
+static uint16_t profile_child(SM83Profile *profile, uint16_t parent, uint32_t key) {
+  uint16_t node = profile->nodes[parent].child;
+  while (node && profile->nodes[node].key != key) node = profile->nodes[node].sibling;
+  if (node || profile->node_count == SM83_PROFILE_NODES) return node ? node : parent;
+
+  unsigned function = 0;
+  while (function < profile->function_count && profile->functions[function] != key) function++;
+  if (function == profile->function_count) profile->functions[profile->function_count++] = key;
+
+  node = (uint16_t)profile->node_count++;
+  SM83ProfileNode *child = &profile->nodes[node];
+  child->key = key;
+  child->function = (uint16_t)function;
+  child->parent = parent;
+  child->child = 0;
+  child->sibling = profile->nodes[parent].child;
+  child->samples = 0;
+  profile->nodes[parent].child = node;
+
+  return node;
+}
+
+// After a CALL (or RST, or an interrupt) to PC pushed its return address at SP
+static void profile_call(SM83Profile *profile, uint16_t pc, uint16_t sp) {
+  if (profile->depth == SM83_PROFILE_DEPTH) return;
+
+  profile->stack_node[profile->depth] = profile->node;
+  profile->stack_sp[profile->depth++] = sp;
+  profile->node = profile_child(profile, profile->node, profile_key(profile, pc));
+}
+
+// After a return left SP at `sp`
+static void profile_ret(SM83Profile *profile, uint16_t sp) {
+  while (profile->depth && profile->stack_sp[profile->depth - 1] < sp) {
+    profile->node = profile->stack_node[--profile->depth];
+  }
+}
+
+#define PROFILE_CALL(cpu) { if ((cpu)->bus->profile) profile_call((cpu)->bus->profile, (cpu)->pc, (cpu)->sp); }
+#define PROFILE_RET(cpu) { if ((cpu)->bus->profile) profile_ret((cpu)->bus->profile, (cpu)->sp); }
+#else
+#define PROFILE_CALL(cpu) {}
+#define PROFILE_RET(cpu) {}
+#endif
+
+static inline
+uint8_t interrupts_pending(const SM83 *cpu) {
+  return cpu->bus->ie & cpu->bus->if_ & 0x1F;
+}
+
+// Immediate operands
+static inline
+uint8_t fetch(SM83 *cpu) {
+#ifdef SM83_BLOCK_CACHE
+  // Instructions running from a block have them decoded already
+  if (cpu->operands) { cpu->pc++; return *cpu->operands++; }
+#endif
+  return bus_read(cpu, cpu->pc++);
+}
+
+// Flags helpers
+#define FLAG_Z 7
+#define FLAG_N 6
+#define FLAG_H 5
+#define FLAG_C 4
+
+#ifdef SM83_LAZY_FLAGS
+static inline
+uint8_t flags_build(const SM83 *cpu) {
+  const uint16_t result = cpu->flags_result;
+  const uint8_t z = (uint8_t)(((result & 0xFF) == 0) << FLAG_Z);
+  const uint8_t h = (uint8_t)(((cpu->flags_x ^ cpu->flags_y ^ result) & 0x10) << 1);
+  const uint8_t c = (uint8_t)((result >> 4) & 0x10);
+
+  switch (cpu->flags_op) {
+    case FLAGS_ADD: return z | h | c;
+    case FLAGS_SUB: return z | 0x40 | h | c;
+    case FLAGS_AND: return z | 0x20;
+    case FLAGS_LOGIC: return z;
+    case FLAGS_INC: return (uint8_t)(z | (((result & 0x0F) == 0x00) << FLAG_H) | (cpu->flags_x << FLAG_C));
+    case FLAGS_DEC: return (uint8_t)(z | 0x40 | (((result & 0x0F) == 0x0F) << FLAG_H) | (cpu->flags_x << FLAG_C));
+    default: return cpu->f;
+  }
+}
+#endif
+
+#ifdef SM83_FLAG_TABLES
+// Flags (Z, N, H, C) for every 8-bit ALU result, so instructions only have to look them up
+static uint8_t flags_add[2][0x100][0x100]; // [carry][a][value]
+static uint8_t flags_sub[2][0x100][0x100]; // [carry][a][value], also used by CP
+static uint8_t flags_inc[0x100]; // [result], but C
+static uint8_t flags_dec[0x100]; // [result], but C
+static uint8_t flags_zero[0x100]; // [result], Z only
+static uint16_t daa_table[0x800]; // [N, H, C][a] -> result | Z and C flags << 8
+
+// Tables are the same for every instance, instances may be set up from several threads at
+// once: the first caller fills them, anyone else getting here meanwhile waits until it's done
+static void flag_tables_init(void) {
+  static atomic_int state = 0; // 0 empty, 1 being filled, 2 ready
+  int expected = 0;
+
+  if (atomic_load_explicit(&state, memory_order_acquire) == 2) return;
+  if (!atomic_compare_exchange_strong_explicit(&state, &expected, 1, memory_order_acquire, memory_order_acquire)) {
+    while (atomic_load_explicit(&state, memory_order_acquire) != 2) {}
+    return;
+  }
+
+  for (unsigned carry = 0; carry < 2; carry++) {
+    for (unsigned a = 0; a < 0x100; a++) {
+      for (unsigned value = 0; value < 0x100; value++) {
+        const unsigned sum = a + value + carry;
+        flags_add[carry][a][value] = (uint8_t)(
+          (((sum & 0xFF) == 0) << FLAG_Z) |
+          ((((a & 0x0F) + (value & 0x0F) + carry) > 0x0F) << FLAG_H) |
+          ((sum > 0xFF) << FLAG_C));
+
+        const unsigned difference = (a - value - carry) & 0xFF;
+        flags_sub[carry][a][value] = (uint8_t)(
+          ((difference == 0) << FLAG_Z) | (1 << FLAG_N) |
+          (((a & 0x0F) < (value & 0x0F) + carry) << FLAG_H) |
+          ((a < value + carry) << FLAG_C));
+      }
+    }
+  }
+
+  for (unsigned result = 0; result < 0x100; result++) {
+    flags_zero[result] = (uint8_t)((result == 0) << FLAG_Z);
+    flags_inc[result] = (uint8_t)(flags_zero[result] | (((result & 0x0F) == 0x00) << FLAG_H));
+    flags_dec[result] = (uint8_t)(flags_zero[result] | (1 << FLAG_N) | (((result & 0x0F) == 0x0F) << FLAG_H));
+  }
+
+  for (unsigned nhc = 0; nhc < 8; nhc++) {
+    for (unsigned a = 0; a < 0x100; a++) {
+      unsigned result = a;
+      unsigned c_flag = nhc & 1;
+      const unsigned h_flag = (nhc >> 1) & 1;
+
+      if (!(nhc & 4)) {
+        if (c_flag || result > 0x99) { result += 0x60; c_flag = 1; }
+        if (h_flag || (result & 0x0F) > 0x09) result += 0x06;
+      } else {
+        if (c_flag) result -= 0x60;
+        if (h_flag) result -= 0x06;
+      }
+
+      result &= 0xFF;
+      daa_table[nhc << 8 | a] = (uint16_t)(result | ((unsigned)(result == 0) << FLAG_Z | c_flag << FLAG_C) << 8);
+    }
+  }
+
+  atomic_store_explicit(&state, 2, memory_order_release);
+}
+#endif
+
+// Brings F up to date, needed before anything touches it directly
+static inline
+void flags_sync(SM83 *cpu) {
+#ifdef SM83_LAZY_FLAGS
+  if (cpu->flags_op != FLAGS_NONE) {
+    cpu->f = flags_build(cpu);
+    cpu->flags_op = FLAGS_NONE;
+  }
+#else
+  (void)cpu;
+#endif
+}
+
+#ifdef SM83_LAZY_FLAGS
+static inline
+void flags_lazy(SM83 *cpu, uint8_t op, uint8_t x, uint8_t y, uint16_t result) {
+  cpu->flags_op = op;
+  cpu->flags_x = x;
+  cpu->flags_y = y;
+  cpu->flags_result = result;
+}
+#endif
+
+static inline
+void set_flag(SM83 *cpu, uint8_t flag, uint8_t value) {
+  flags_sync(cpu);
+
+  if (value) {
+    cpu->f |= (uint8_t)(1 << flag);
+  } else {
+    cpu->f &= (uint8_t)~(1 << flag);
+  }
+}
+
+static inline
+uint8_t get_flag(SM83 *cpu, uint8_t flag) {
+#ifdef SM83_LAZY_FLAGS
+  // Z and C are what conditions and carries ask for, and are cheap to get
+  if (cpu->flags_op != FLAGS_NONE) {
+    if (flag == FLAG_Z) return (cpu->flags_result & 0xFF) == 0;
+    if (flag == FLAG_C) {
+      switch (cpu->flags_op) {
+        case FLAGS_ADD: case FLAGS_SUB: return (cpu->flags_result >> 8) & 1;
+        case FLAGS_INC: case FLAGS_DEC: return cpu->flags_x;
+        default: return 0;
+      }
+    }
+    return (flags_build(cpu) >> flag) & 1;
+  }
+#endif
+  return (cpu->f >> flag) & 1;
+}
+
+// Instructions
+// ----------------
+static void nop(SM83 *cpu) { (void)cpu; }
+static void halt(SM83 *cpu) {
+  // With IME off and an interrupt already pending HALT ends right away (the HALT bug,
+  // which reads the next byte twice, isn't emulated)
+  if (!cpu->ime && interrupts_pending(cpu)) return;
+  cpu->halted = 1;
+}
+// Low power until an interrupt, as HALT (the joypad, which wakes it on hardware, raises
+// one). Its second byte isn't read, and what it does to DIV and CGB speed is the host's
+static void stop(SM83 *cpu) { halt(cpu); }
+
+static void invalid(SM83 *cpu) {
+  (void)cpu;
+  // TODO: Decide what to do
+}
+
+static void di(SM83 *cpu) {
+  cpu->ime = 0;
+  cpu->ime_delay = 0;
+}
+static void ei(SM83 *cpu) { cpu->ime_delay = 1; }
+
+// ** 8-bit load instructions **
+static void ld_b_b(SM83 *cpu) { cpu->b = cpu->b; }
+static void ld_b_c(SM83 *cpu) { cpu->b = cpu->c; }
+static void ld_b_d(SM83 *cpu) { cpu->b = cpu->d; }
+static void ld_b_e(SM83 *cpu) { cpu->b = cpu->e; }
+static void ld_b_h(SM83 *cpu) { cpu->b = cpu->h; }
+static void ld_b_l(SM83 *cpu) { cpu->b = cpu->l; }
+static void ld_b_a(SM83 *cpu) { cpu->b = cpu->a; }
+static void ld_c_b(SM83 *cpu) { cpu->c = cpu->b; }
+static void ld_c_c(SM83 *cpu) { cpu->c = cpu->c; }
+static void ld_c_d(SM83 *cpu) { cpu->c = cpu->d; }
+static void ld_c_e(SM83 *cpu) { cpu->c = cpu->e; }
+static void ld_c_h(SM83 *cpu) { cpu->c = cpu->h; }
+static void ld_c_l(SM83 *cpu) { cpu->c = cpu->l; }
+static void ld_c_a(SM83 *cpu) { cpu->c = cpu->a; }
+static void ld_d_b(SM83 *cpu) { cpu->d = cpu->b; }
+static void ld_d_c(SM83 *cpu) { cpu->d = cpu->c; }
+static void ld_d_d(SM83 *cpu) { cpu->d = cpu->d; }
+static void ld_d_e(SM83 *cpu) { cpu->d = cpu->e; }
+static void ld_d_h(SM83 *cpu) { cpu->d = cpu->h; }
+static void ld_d_l(SM83 *cpu) { cpu->d = cpu->l; }
+static void ld_d_a(SM83 *cpu) { cpu->d = cpu->a; }
+static void ld_e_b(SM83 *cpu) { cpu->e = cpu->b; }
+static void ld_e_c(SM83 *cpu) { cpu->e = cpu->c; }
+static void ld_e_d(SM83 *cpu) { cpu->e = cpu->d; }
+static void ld_e_e(SM83 *cpu) { cpu->e = cpu->e; }
+static void ld_e_h(SM83 *cpu) { cpu->e = cpu->h; }
+static void ld_e_l(SM83 *cpu) { cpu->e = cpu->l; }
+static void ld_e_a(SM83 *cpu) { cpu->e = cpu->a; }
+static void ld_h_b(SM83 *cpu) { cpu->h = cpu->b; }
+static void ld_h_c(SM83 *cpu) { cpu->h = cpu->c; }
+static void ld_h_d(SM83 *cpu) { cpu->h = cpu->d; }
+static void ld_h_e(SM83 *cpu) { cpu->h = cpu->e; }
+static void ld_h_h(SM83 *cpu) { cpu->h = cpu->h; }
+static void ld_h_l(SM83 *cpu) { cpu->h = cpu->l; }
+static void ld_h_a(SM83 *cpu) { cpu->h = cpu->a; }
+static void ld_l_b(SM83 *cpu) { cpu->l = cpu->b; }
+static void ld_l_c(SM83 *cpu) { cpu->l = cpu->c; }
+static void ld_l_d(SM83 *cpu) { cpu->l = cpu->d; }
+static void ld_l_e(SM83 *cpu) { cpu->l = cpu->e; }
+static void ld_l_h(SM83 *cpu) { cpu->l = cpu->h; }
+static void ld_l_l(SM83 *cpu) { cpu->l = cpu->l; }
+static void ld_l_a(SM83 *cpu) { cpu->l = cpu->a; }
+static void ld_a_b(SM83 *cpu) { cpu->a = cpu->b; }
+static void ld_a_c(SM83 *cpu) { cpu->a = cpu->c; }
+static void ld_a_d(SM83 *cpu) { cpu->a = cpu->d; }
+static void ld_a_e(SM83 *cpu) { cpu->a = cpu->e; }
+static void ld_a_h(SM83 *cpu) { cpu->a = cpu->h; }
+static void ld_a_l(SM83 *cpu) { cpu->a = cpu->l; }
+static void ld_a_a(SM83 *cpu) { cpu->a = cpu->a; }
+
+static void ld_b_n(SM83 *cpu) { cpu->b = fetch(cpu); }
+static void ld_c_n(SM83 *cpu) { cpu->c = fetch(cpu); }
+static void ld_d_n(SM83 *cpu) { cpu->d = fetch(cpu); }
+static void ld_e_n(SM83 *cpu) { cpu->e = fetch(cpu); }
+static void ld_h_n(SM83 *cpu) { cpu->h = fetch(cpu); }
+static void ld_l_n(SM83 *cpu) { cpu->l = fetch(cpu); }
+static void ld_a_n(SM83 *cpu) { cpu->a = fetch(cpu); }
+
+static void ld_b_hl(SM83 *cpu) { cpu->b = bus_read(cpu, cpu->hl); }
+static void ld_c_hl(SM83 *cpu) { cpu->c = bus_read(cpu, cpu->hl); }
+static void ld_d_hl(SM83 *cpu) { cpu->d = bus_read(cpu, cpu->hl); }
+static void ld_e_hl(SM83 *cpu) { cpu->e = bus_read(cpu, cpu->hl); }
+static void ld_h_hl(SM83 *cpu) { cpu->h = bus_read(cpu, cpu->hl); }
+static void ld_l_hl(SM83 *cpu) { cpu->l = bus_read(cpu, cpu->hl); }
+static void ld_a_hl(SM83 *cpu) { cpu->a = bus_read(cpu, cpu->hl); }
+static void ld_a_hlp(SM83 *cpu) { cpu->a = bus_read(cpu, cpu->hl++); }
+static void ld_a_hlm(SM83 *cpu) { cpu->a = bus_read(cpu, cpu->hl--); }
+
+static void ldi_bc_a(SM83 *cpu) { bus_write(cpu, cpu->bc, cpu->a); }
+static void ldi_de_a(SM83 *cpu) { bus_write(cpu, cpu->de, cpu->a); }
+static void ldi_hlp_a(SM83 *cpu) { bus_write(cpu, cpu->hl++, cpu->a); }
+static void ldi_hlm_a(SM83 *cpu) { bus_write(cpu, cpu->hl--, cpu->a); }
+static void ldi_hl_b(SM83 *cpu) { bus_write(cpu, cpu->hl, cpu->b); }
+static void ldi_hl_c(SM83 *cpu) { bus_write(cpu, cpu->hl, cpu->c); }
+static void ldi_hl_d(SM83 *cpu) { bus_write(cpu, cpu->hl, cpu->d); }
+static void ldi_hl_e(SM83 *cpu) { bus_write(cpu, cpu->hl, cpu->e); }
+static void ldi_hl_h(SM83 *cpu) { bus_write(cpu, cpu->hl, cpu->h); }
+static void ldi_hl_l(SM83 *cpu) { bus_write(cpu, cpu->hl, cpu->l); }
+static void ldi_hl_a(SM83 *cpu) { bus_write(cpu, cpu->hl, cpu->a); }
+static void ldi_hl_n(SM83 *cpu) { bus_write(cpu, cpu->hl, fetch(cpu)); }
+static void ldi_a_bc(SM83 *cpu) { cpu->a = bus_read(cpu, cpu->bc); }
+static void ldi_a_de(SM83 *cpu) { cpu->a = bus_read(cpu, cpu->de); }
+
+static void ldh_n_a(SM83 *cpu) {
+  uint16_t n = fetch(cpu);
+  bus_write(cpu, 0xFF00 | n, cpu->a);
+}
+static void ldh_c_a(SM83 *cpu) { bus_write(cpu, (uint16_t)(0xFF00 | cpu->c), cpu->a); }
+static void ldh_a_c(SM83 *cpu) { cpu->a = bus_read(cpu, (uint16_t)(0xFF00 | cpu->c)); }
+static void ldh_a_n(SM83 *cpu) {
+  uint16_t n = fetch(cpu);
+  cpu->a = bus_read(cpu, 0xFF00 | n);
+}
+
+static void ld_a_nn(SM83 *cpu) {
+  uint16_t low = fetch(cpu);
+  uint16_t high = fetch(cpu);
+  uint16_t nn = (uint16_t)(high << 8) | low;
+  cpu->a = bus_read(cpu, nn);
+}
+static void ld_nn_a(SM83 *cpu) {
+  uint16_t low = fetch(cpu);
+  uint16_t high = fetch(cpu);
+  uint16_t nn = (uint16_t)(high << 8) | low;
+  bus_write(cpu, nn, cpu->a);
+}
+
+// ** 8-bit arithmetic and logical instructions **
+#ifdef SM83_LAZY_FLAGS
+#define ADD(value) { \
+  uint16_t result = (uint16_t)(cpu->a + value); \
+  flags_lazy(cpu, FLAGS_ADD, cpu->a, value, result); \
+  cpu->a = (uint8_t)result; \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define ADD(value) { \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_add[0][cpu->a][value]); \
+  cpu->a = (uint8_t)(cpu->a + value); \
+}
+#else
+#define ADD(value) { \
+  uint8_t result = (uint8_t)(cpu->a + value); \
+  set_flag(cpu, FLAG_Z, (result == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, (((cpu->a & 0x0F) + (value & 0x0F)) & 0x10) == 0x10); \
+  set_flag(cpu, FLAG_C, (result < cpu->a)); \
+  cpu->a = result; \
+}
+#endif
+#define ADDr(r) { \
+  uint8_t value = cpu->r; \
+  ADD(value); \
+}
+
+static void add_a_b(SM83 *cpu) { ADDr(b); }
+static void add_a_c(SM83 *cpu) { ADDr(c); }
+static void add_a_d(SM83 *cpu) { ADDr(d); }
+static void add_a_e(SM83 *cpu) { ADDr(e); }
+static void add_a_h(SM83 *cpu) { ADDr(h); }
+static void add_a_l(SM83 *cpu) { ADDr(l); }
+static void add_a_a(SM83 *cpu) { ADDr(a); }
+static void add_a_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); ADD(value); }
+static void add_a_n(SM83 *cpu) { uint8_t value = fetch(cpu); ADD(value); }
+
+#ifdef SM83_LAZY_FLAGS
+#define ADC(value) { \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
+  uint16_t result = (uint16_t)(cpu->a + value + carry); \
+  flags_lazy(cpu, FLAGS_ADD, cpu->a, value, result); \
+  cpu->a = (uint8_t)result; \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define ADC(value) { \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_add[carry][cpu->a][value]); \
+  cpu->a = (uint8_t)(cpu->a + value + carry); \
+}
+#else
+#define ADC(value) { \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
+  uint8_t result = (uint8_t)(cpu->a + value + carry); \
+  set_flag(cpu, FLAG_Z, (result == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, (((cpu->a & 0x0F) + (value & 0x0F) + carry) & 0x10) == 0x10); \
+  set_flag(cpu, FLAG_C, (((cpu->a & 0xFF) + (value & 0xFF) + carry) & 0x100) == 0x100); \
+  cpu->a = result; \
+}
+#endif
+#define ADCr(r) { \
+  uint8_t value = cpu->r; \
+  ADC(value); \
 }
 
 static void adc_a_b(SM83 *cpu) { ADCr(b); }
@@ -263,17 +1249,30 @@ static void adc_a_e(SM83 *cpu) { ADCr(e); }
 static void adc_a_h(SM83 *cpu) { ADCr(h); }
 static void adc_a_l(SM83 *cpu) { ADCr(l); }
 static void adc_a_a(SM83 *cpu) { ADCr(a); }
-static void adc_a_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); ADC(value); }
-static void adc_a_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); ADC(value); }
+static void adc_a_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); ADC(value); }
+static void adc_a_n(SM83 *cpu) { uint8_t value = fetch(cpu); ADC(value); }
 
+#ifdef SM83_LAZY_FLAGS
+#define SUB(value) { \
+  uint16_t result = (uint16_t)(cpu->a - value); \
+  flags_lazy(cpu, FLAGS_SUB, cpu->a, value, result); \
+  cpu->a = (uint8_t)result; \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define SUB(value) { \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_sub[0][cpu->a][value]); \
+  cpu->a = (uint8_t)(cpu->a - value); \
+}
+#else
 #define SUB(value) { \
   uint8_t result = (uint8_t)(cpu->a - value); \
-  set_flag(&cpu->f, FLAG_Z, (result == 0)); \
-  set_flag(&cpu->f, FLAG_N, 1); \
-  set_flag(&cpu->f, FLAG_H, ((cpu->a & 0x0F) < (value & 0x0F))); \
-  set_flag(&cpu->f, FLAG_C, (result > cpu->a)); \
+  set_flag(cpu, FLAG_Z, (result == 0)); \
+  set_flag(cpu, FLAG_N, 1); \
+  set_flag(cpu, FLAG_H, ((cpu->a & 0x0F) < (value & 0x0F))); \
+  set_flag(cpu, FLAG_C, (result > cpu->a)); \
   cpu->a = result; \
 }
+#endif
 #define SUBr(r) { \
   uint8_t value = cpu->r; \
   SUB(value); \
@@ -286,18 +1285,33 @@ static void sub_e(SM83 *cpu) { SUBr(e); }
 static void sub_h(SM83 *cpu) { SUBr(h); }
 static void sub_l(SM83 *cpu) { SUBr(l); }
 static void sub_a(SM83 *cpu) { SUBr(a); }
-static void sub_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); SUB(value); }
-static void sub_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); SUB(value); }
+static void sub_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); SUB(value); }
+static void sub_n(SM83 *cpu) { uint8_t value = fetch(cpu); SUB(value); }
 
+#ifdef SM83_LAZY_FLAGS
 #define SBC(value) { \
-  uint8_t carry = (cpu->f >> FLAG_C) & 1; \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
+  uint16_t result = (uint16_t)(cpu->a - value - carry); \
+  flags_lazy(cpu, FLAGS_SUB, cpu->a, value, result); \
+  cpu->a = (uint8_t)result; \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define SBC(value) { \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_sub[carry][cpu->a][value]); \
+  cpu->a = (uint8_t)(cpu->a - value - carry); \
+}
+#else
+#define SBC(value) { \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
   uint8_t result = (uint8_t)(cpu->a - value - carry); \
-  set_flag(&cpu->f, FLAG_Z, (result == 0)); \
-  set_flag(&cpu->f, FLAG_N, 1); \
-  set_flag(&cpu->f, FLAG_H, ((cpu->a & 0x0F) < (value & 0x0F) + carry)); \
-  set_flag(&cpu->f, FLAG_C, ((cpu->a & 0xFF) < (value & 0xFF) + carry)); \
+  set_flag(cpu, FLAG_Z, (result == 0)); \
+  set_flag(cpu, FLAG_N, 1); \
+  set_flag(cpu, FLAG_H, ((cpu->a & 0x0F) < (value & 0x0F) + carry)); \
+  set_flag(cpu, FLAG_C, ((cpu->a & 0xFF) < (value & 0xFF) + carry)); \
   cpu->a = result; \
 }
+#endif
 #define SBCr(r) { \
   uint8_t value = cpu->r; \
   SBC(value); \
@@ -310,16 +1324,28 @@ static void sbc_a_e(SM83 *cpu) { SBCr(e); }
 static void sbc_a_h(SM83 *cpu) { SBCr(h); }
 static void sbc_a_l(SM83 *cpu) { SBCr(l); }
 static void sbc_a_a(SM83 *cpu) { SBCr(a); }
-static void sbc_a_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); SBC(value); }
-static void sbc_a_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); SBC(value); }
+static void sbc_a_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); SBC(value); }
+static void sbc_a_n(SM83 *cpu) { uint8_t value = fetch(cpu); SBC(value); }
 
+#ifdef SM83_LAZY_FLAGS
+#define AND(value) { \
+  cpu->a &= value; \
+  flags_lazy(cpu, FLAGS_AND, 0, 0, cpu->a); \
+}
+#elif defined(SM83_FLAG_TABLES)
 #define AND(value) { \
   cpu->a &= value; \
-  set_flag(&cpu->f, FLAG_Z, (cpu->a == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 1); \
-  set_flag(&cpu->f, FLAG_C, 0); \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_zero[cpu->a] | (1 << FLAG_H)); \
 }
+#else
+#define AND(value) { \
+  cpu->a &= value; \
+  set_flag(cpu, FLAG_Z, (cpu->a == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 1); \
+  set_flag(cpu, FLAG_C, 0); \
+}
+#endif
 #define ANDr(r) { \
   uint8_t value = cpu->r; \
   AND(value); \
@@ -332,19 +1358,31 @@ static void and_e(SM83 *cpu) { ANDr(e); }
 static void and_h(SM83 *cpu) { ANDr(h); }
 static void and_l(SM83 *cpu) { ANDr(l); }
 static void and_a(SM83 *cpu) { ANDr(a); }
-static void and_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); AND(value); }
-static void and_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); AND(value); }
+static void and_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); AND(value); }
+static void and_n(SM83 *cpu) { uint8_t value = fetch(cpu); AND(value); }
 
+#ifdef SM83_LAZY_FLAGS
 #define XOR(value) { \
   cpu->a ^= value; \
-  set_flag(&cpu->f, FLAG_Z, (cpu->a == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
-  set_flag(&cpu->f, FLAG_C, 0); \
-}
-#define XORr(r) { \
-  uint8_t value = cpu->r; \
-  XOR(value); \
+  flags_lazy(cpu, FLAGS_LOGIC, 0, 0, cpu->a); \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define XOR(value) { \
+  cpu->a ^= value; \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_zero[cpu->a]); \
+}
+#else
+#define XOR(value) { \
+  cpu->a ^= value; \
+  set_flag(cpu, FLAG_Z, (cpu->a == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
+  set_flag(cpu, FLAG_C, 0); \
+}
+#endif
+#define XORr(r) { \
+  uint8_t value = cpu->r; \
+  XOR(value); \
 }
 
 static void xor_b(SM83 *cpu) { XORr(b); }
@@ -354,16 +1392,28 @@ static void xor_e(SM83 *cpu) { XORr(e); }
 static void xor_h(SM83 *cpu) { XORr(h); }
 static void xor_l(SM83 *cpu) { XORr(l); }
 static void xor_a(SM83 *cpu) { XORr(a); }
-static void xor_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); XOR(value); }
-static void xor_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); XOR(value); }
+static void xor_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); XOR(value); }
+static void xor_n(SM83 *cpu) { uint8_t value = fetch(cpu); XOR(value); }
 
+#ifdef SM83_LAZY_FLAGS
+#define OR(value) { \
+  cpu->a |= value; \
+  flags_lazy(cpu, FLAGS_LOGIC, 0, 0, cpu->a); \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define OR(value) { \
+  cpu->a |= value; \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_zero[cpu->a]); \
+}
+#else
 #define OR(value) { \
   cpu->a |= value; \
-  set_flag(&cpu->f, FLAG_Z, (cpu->a == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
-  set_flag(&cpu->f, FLAG_C, 0); \
+  set_flag(cpu, FLAG_Z, (cpu->a == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
+  set_flag(cpu, FLAG_C, 0); \
 }
+#endif
 #define ORr(r) { \
   uint8_t value = cpu->r; \
   OR(value); \
@@ -376,16 +1426,27 @@ static void or_e(SM83 *cpu) { ORr(e); }
 static void or_h(SM83 *cpu) { ORr(h); }
 static void or_l(SM83 *cpu) { ORr(l); }
 static void or_a(SM83 *cpu) { ORr(a); }
-static void or_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); OR(value); }
-static void or_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); OR(value); }
+static void or_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); OR(value); }
+static void or_n(SM83 *cpu) { uint8_t value = fetch(cpu); OR(value); }
 
+#ifdef SM83_LAZY_FLAGS
+#define CP(value) { \
+  uint16_t result = (uint16_t)(cpu->a - value); \
+  flags_lazy(cpu, FLAGS_SUB, cpu->a, value, result); \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define CP(value) { \
+  cpu->f = (uint8_t)((cpu->f & 0x0F) | flags_sub[0][cpu->a][value]); \
+}
+#else
 #define CP(value) { \
   uint8_t result = (uint8_t)(cpu->a - value); \
-  set_flag(&cpu->f, FLAG_Z, (result == 0)); \
-  set_flag(&cpu->f, FLAG_N, 1); \
-  set_flag(&cpu->f, FLAG_H, ((cpu->a & 0x0F) < (value & 0x0F))); \
-  set_flag(&cpu->f, FLAG_C, (result > cpu->a)); \
+  set_flag(cpu, FLAG_Z, (result == 0)); \
+  set_flag(cpu, FLAG_N, 1); \
+  set_flag(cpu, FLAG_H, ((cpu->a & 0x0F) < (value & 0x0F))); \
+  set_flag(cpu, FLAG_C, (result > cpu->a)); \
 }
+#endif
 #define CPr(r) { \
   uint8_t value = cpu->r; \
   CP(value); \
@@ -398,32 +1459,37 @@ static void cp_e(SM83 *cpu) { CPr(e); }
 static void cp_h(SM83 *cpu) { CPr(h); }
 static void cp_l(SM83 *cpu) { CPr(l); }
 static void cp_a(SM83 *cpu) { CPr(a); }
-static void cp_hl(SM83 *cpu) { uint8_t value = cpu->read(cpu->hl); CP(value); }
-static void cp_n(SM83 *cpu) { uint8_t value = cpu->read(cpu->pc++); CP(value); }
+static void cp_hl(SM83 *cpu) { uint8_t value = bus_read(cpu, cpu->hl); CP(value); }
+static void cp_n(SM83 *cpu) { uint8_t value = fetch(cpu); CP(value); }
 
 static void ccf(SM83 *cpu) {
-  set_flag(&cpu->f, FLAG_N, 0);
-  set_flag(&cpu->f, FLAG_H, 0);
-  set_flag(&cpu->f, FLAG_C, !get_flag(&cpu->f, FLAG_C));
+  set_flag(cpu, FLAG_N, 0);
+  set_flag(cpu, FLAG_H, 0);
+  set_flag(cpu, FLAG_C, !get_flag(cpu, FLAG_C));
 }
 
 static void scf(SM83 *cpu) {
-  set_flag(&cpu->f, FLAG_N, 0);
-  set_flag(&cpu->f, FLAG_H, 0);
-  set_flag(&cpu->f, FLAG_C, 1);
+  set_flag(cpu, FLAG_N, 0);
+  set_flag(cpu, FLAG_H, 0);
+  set_flag(cpu, FLAG_C, 1);
 }
 
 static void cpl(SM83 *cpu) {
   cpu->a = (uint8_t)~cpu->a;
-  set_flag(&cpu->f, FLAG_N, 1);
-  set_flag(&cpu->f, FLAG_H, 1);
+  set_flag(cpu, FLAG_N, 1);
+  set_flag(cpu, FLAG_H, 1);
 }
 
 // https://forums.nesdev.org/viewtopic.php?p=196282&sid=c64eb1685d89a431486b92c0130ee4b2#p196282
 static void daa(SM83 *cpu) {
-  uint8_t n_flag = get_flag(&cpu->f, FLAG_N);
-  uint8_t h_flag = get_flag(&cpu->f, FLAG_H);
-  uint8_t c_flag = get_flag(&cpu->f, FLAG_C);
+#ifdef SM83_FLAG_TABLES
+  const uint16_t entry = daa_table[((cpu->f >> FLAG_C) & 7) << 8 | cpu->a];
+  cpu->a = (uint8_t)entry;
+  cpu->f = (uint8_t)((cpu->f & 0x4F) | (entry >> 8));
+#else
+  uint8_t n_flag = get_flag(cpu, FLAG_N);
+  uint8_t h_flag = get_flag(cpu, FLAG_H);
+  uint8_t c_flag = get_flag(cpu, FLAG_C);
 
   if (!n_flag) {
     if (c_flag || cpu->a > 0x99) {
@@ -437,24 +1503,49 @@ static void daa(SM83 *cpu) {
     if (h_flag) cpu->a = (uint8_t)(cpu->a - 0x6);
   }
 
-  set_flag(&cpu->f, FLAG_Z, cpu->a == 0);
-  set_flag(&cpu->f, FLAG_H, 0);
-  set_flag(&cpu->f, FLAG_C, c_flag);
+  set_flag(cpu, FLAG_Z, cpu->a == 0);
+  set_flag(cpu, FLAG_H, 0);
+  set_flag(cpu, FLAG_C, c_flag);
+#endif
+}
+
+#ifdef SM83_LAZY_FLAGS
+#define INCr(r) { \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
+  cpu->r++; \
+  flags_lazy(cpu, FLAGS_INC, carry, 0, cpu->r); \
+}
+
+#define DECr(r) { \
+  uint8_t carry = get_flag(cpu, FLAG_C); \
+  cpu->r--; \
+  flags_lazy(cpu, FLAGS_DEC, carry, 0, cpu->r); \
+}
+#elif defined(SM83_FLAG_TABLES)
+#define INCr(r) { \
+  cpu->r++; \
+  cpu->f = (uint8_t)((cpu->f & 0x1F) | flags_inc[cpu->r]); \
 }
 
+#define DECr(r) { \
+  cpu->r--; \
+  cpu->f = (uint8_t)((cpu->f & 0x1F) | flags_dec[cpu->r]); \
+}
+#else
 #define INCr(r) { \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, ((cpu->r & 0x0F) == 0x0F)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, ((cpu->r & 0x0F) == 0x0F)); \
   cpu->r++; \
-  set_flag(&cpu->f, FLAG_Z, (cpu->r == 0)); \
+  set_flag(cpu, FLAG_Z, (cpu->r == 0)); \
 }
 
 #define DECr(r) { \
-  set_flag(&cpu->f, FLAG_N, 1); \
-  set_flag(&cpu->f, FLAG_H, ((cpu->r & 0x0F) == 0x00)); \
+  set_flag(cpu, FLAG_N, 1); \
+  set_flag(cpu, FLAG_H, ((cpu->r & 0x0F) == 0x00)); \
   cpu->r--; \
-  set_flag(&cpu->f, FLAG_Z, (cpu->r == 0)); \
+  set_flag(cpu, FLAG_Z, (cpu->r == 0)); \
 }
+#endif
 
 static void inc_b(SM83 *cpu) { INCr(b); }
 static void inc_c(SM83 *cpu) { INCr(c); }
@@ -464,12 +1555,12 @@ static void inc_h(SM83 *cpu) { INCr(h); }
 static void inc_l(SM83 *cpu) { INCr(l); }
 static void inc_a(SM83 *cpu) { INCr(a); }
 static void inci_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
-  set_flag(&cpu->f, FLAG_N, 0);
-  set_flag(&cpu->f, FLAG_H, ((value & 0x0F) == 0x0F));
+  uint8_t value = bus_read(cpu, cpu->hl);
+  set_flag(cpu, FLAG_N, 0);
+  set_flag(cpu, FLAG_H, ((value & 0x0F) == 0x0F));
   value++;
-  set_flag(&cpu->f, FLAG_Z, (value == 0));
-  cpu->write(cpu->hl, value);
+  set_flag(cpu, FLAG_Z, (value == 0));
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void dec_b(SM83 *cpu) { DECr(b); }
@@ -480,31 +1571,31 @@ static void dec_h(SM83 *cpu) { DECr(h); }
 static void dec_l(SM83 *cpu) { DECr(l); }
 static void dec_a(SM83 *cpu) { DECr(a); }
 static void deci_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
-  set_flag(&cpu->f, FLAG_N, 1);
-  set_flag(&cpu->f, FLAG_H, ((value & 0x0F) == 0x00));
+  uint8_t value = bus_read(cpu, cpu->hl);
+  set_flag(cpu, FLAG_N, 1);
+  set_flag(cpu, FLAG_H, ((value & 0x0F) == 0x00));
   value--;
-  set_flag(&cpu->f, FLAG_Z, (value == 0));
-  cpu->write(cpu->hl, value);
+  set_flag(cpu, FLAG_Z, (value == 0));
+  bus_write(cpu, cpu->hl, value);
 }
 
 
 // ** 16-bit load instructions **
 #define LDrrnn(rr) { \
-  uint16_t low = cpu->read(cpu->pc++); \
-  uint16_t high = cpu->read(cpu->pc++); \
+  uint16_t low = fetch(cpu); \
+  uint16_t high = fetch(cpu); \
   uint16_t nn = (uint16_t)(high << 8) | low; \
   cpu->rr = nn; \
 }
 
 #define PUSH(rr) { \
-  cpu->write(--cpu->sp, (uint8_t)((cpu->rr >> 8) & 0xFF)); \
-  cpu->write(--cpu->sp, (uint8_t)(cpu->rr & 0xFF)); \
+  bus_write(cpu, --cpu->sp, (uint8_t)((cpu->rr >> 8) & 0xFF)); \
+  bus_write(cpu, --cpu->sp, (uint8_t)(cpu->rr & 0xFF)); \
 }
 
 #define POP(rr) { \
-  uint16_t low = cpu->read(cpu->sp++); \
-  uint16_t high = cpu->read(cpu->sp++); \
+  uint16_t low = bus_read(cpu, cpu->sp++); \
+  uint16_t high = bus_read(cpu, cpu->sp++); \
   cpu->rr = (uint16_t)(high << 8) | low; \
 }
 
@@ -513,28 +1604,28 @@ static void ld_de_nn(SM83 *cpu) { LDrrnn(de); }
 static void ld_hl_nn(SM83 *cpu) { LDrrnn(hl); }
 static void ld_sp_nn(SM83 *cpu) { LDrrnn(sp); }
 static void ld_nn_sp(SM83 *cpu) {
-  uint16_t low = cpu->read(cpu->pc++);
-  uint16_t high = cpu->read(cpu->pc++);
+  uint16_t low = fetch(cpu);
+  uint16_t high = fetch(cpu);
   uint16_t nn = (uint16_t)(high << 8) | low;
-  cpu->write(nn++, (uint8_t)(cpu->sp & 0xFF));
-  cpu->write(nn, (uint8_t)((cpu->sp >> 8) & 0xFF));
+  bus_write(cpu, nn++, (uint8_t)(cpu->sp & 0xFF));
+  bus_write(cpu, nn, (uint8_t)((cpu->sp >> 8) & 0xFF));
 }
 static void ld_sp_hl(SM83 *cpu) { cpu->sp = cpu->hl; }
 static void push_bc(SM83 *cpu) { PUSH(bc); }
 static void push_de(SM83 *cpu) { PUSH(de); }
 static void push_hl(SM83 *cpu) { PUSH(hl); }
-static void push_af(SM83 *cpu) { PUSH(af); }
+static void push_af(SM83 *cpu) { flags_sync(cpu); PUSH(af); }
 static void pop_bc(SM83 *cpu) { POP(bc); }
 static void pop_de(SM83 *cpu) { POP(de); }
 static void pop_hl(SM83 *cpu) { POP(hl); }
-static void pop_af(SM83 *cpu) { POP(af); cpu->f &= 0xF0; }
+static void pop_af(SM83 *cpu) { flags_sync(cpu); POP(af); cpu->f &= 0xF0; }
 static void ld_hl_sp_e(SM83 *cpu) {
-  int8_t e = (int8_t)cpu->read(cpu->pc++);
+  int8_t e = (int8_t)fetch(cpu);
   uint16_t result = (uint16_t)(cpu->sp + e);
-  set_flag(&cpu->f, FLAG_Z, 0);
-  set_flag(&cpu->f, FLAG_N, 0);
-  set_flag(&cpu->f, FLAG_H, (((cpu->sp & 0x0F) + (e & 0x0F)) & 0x10) == 0x10);
-  set_flag(&cpu->f, FLAG_C, (((cpu->sp & 0xFF) + (e & 0xFF)) & 0x100) == 0x100);
+  set_flag(cpu, FLAG_Z, 0);
+  set_flag(cpu, FLAG_N, 0);
+  set_flag(cpu, FLAG_H, (((cpu->sp & 0x0F) + (e & 0x0F)) & 0x10) == 0x10);
+  set_flag(cpu, FLAG_C, (((cpu->sp & 0xFF) + (e & 0xFF)) & 0x100) == 0x100);
   cpu->hl = result;
 }
 
@@ -542,9 +1633,9 @@ static void ld_hl_sp_e(SM83 *cpu) {
 // ** 16-bit arithmetic instructions **
 #define ADDHLrr(rr) { \
   uint32_t result = (uint32_t)cpu->hl + (uint32_t)cpu->rr; \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, (((cpu->hl & 0x0FFF) + (cpu->rr & 0x0FFF)) & 0x1000) == 0x1000); \
-  set_flag(&cpu->f, FLAG_C, (result > 0xFFFF)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, (((cpu->hl & 0x0FFF) + (cpu->rr & 0x0FFF)) & 0x1000) == 0x1000); \
+  set_flag(cpu, FLAG_C, (result > 0xFFFF)); \
   cpu->hl = (uint16_t)(result & 0xFFFF); \
 }
 
@@ -561,26 +1652,26 @@ static void add_hl_de(SM83 *cpu) { ADDHLrr(de); }
 static void add_hl_hl(SM83 *cpu) { ADDHLrr(hl); }
 static void add_hl_sp(SM83 *cpu) { ADDHLrr(sp); }
 static void add_sp_e(SM83 *cpu) {
-  int8_t e = (int8_t)cpu->read(cpu->pc++);
+  int8_t e = (int8_t)fetch(cpu);
   uint16_t result = (uint16_t)(cpu->sp + e);
-  set_flag(&cpu->f, FLAG_Z, 0);
-  set_flag(&cpu->f, FLAG_N, 0);
-  set_flag(&cpu->f, FLAG_H, (((cpu->sp & 0x0F) + (e & 0x0F)) & 0x10) == 0x10);
-  set_flag(&cpu->f, FLAG_C, (((cpu->sp & 0xFF) + (e & 0xFF)) & 0x100) == 0x100);
+  set_flag(cpu, FLAG_Z, 0);
+  set_flag(cpu, FLAG_N, 0);
+  set_flag(cpu, FLAG_H, (((cpu->sp & 0x0F) + (e & 0x0F)) & 0x10) == 0x10);
+  set_flag(cpu, FLAG_C, (((cpu->sp & 0xFF) + (e & 0xFF)) & 0x100) == 0x100);
   cpu->sp = result;
 }
 
 // ** Control instructions **
 static void jp_nn(SM83 *cpu) {
-  uint16_t low = cpu->read(cpu->pc++);
-  uint16_t high = cpu->read(cpu->pc++);
+  uint16_t low = fetch(cpu);
+  uint16_t high = fetch(cpu);
   cpu->pc = (uint16_t)(high << 8) | low;
 }
 static void jp_hl(SM83 *cpu) { cpu->pc = cpu->hl; }
 
 #define JPccnn(cc) { \
-  uint16_t low = cpu->read(cpu->pc++); \
-  uint16_t high = cpu->read(cpu->pc++); \
+  uint16_t low = fetch(cpu); \
+  uint16_t high = fetch(cpu); \
   uint16_t nn = (uint16_t)(high << 8) | low; \
   if (cc) { \
     cpu->pc = nn; \
@@ -588,13 +1679,13 @@ static void jp_hl(SM83 *cpu) { cpu->pc = cpu->hl; }
   } \
 }
 
-static void jp_nz_nn(SM83 *cpu) { JPccnn(!get_flag(&cpu->f, FLAG_Z)); }
-static void jp_z_nn(SM83 *cpu) { JPccnn(get_flag(&cpu->f, FLAG_Z)); }
-static void jp_nc_nn(SM83 *cpu) { JPccnn(!get_flag(&cpu->f, FLAG_C)); }
-static void jp_c_nn(SM83 *cpu) { JPccnn(get_flag(&cpu->f, FLAG_C)); }
+static void jp_nz_nn(SM83 *cpu) { JPccnn(!get_flag(cpu, FLAG_Z)); }
+static void jp_z_nn(SM83 *cpu) { JPccnn(get_flag(cpu, FLAG_Z)); }
+static void jp_nc_nn(SM83 *cpu) { JPccnn(!get_flag(cpu, FLAG_C)); }
+static void jp_c_nn(SM83 *cpu) { JPccnn(get_flag(cpu, FLAG_C)); }
 
 #define JRcce(cc) { \
-  int8_t e = (int8_t)cpu->read(cpu->pc++); \
+  int8_t e = (int8_t)fetch(cpu); \
   if (cc) { \
     cpu->pc = (uint16_t)((int)cpu->pc + e); \
     cpu->t = (uint8_t)(cpu->t + 4); \
@@ -602,22 +1693,23 @@ static void jp_c_nn(SM83 *cpu) { JPccnn(get_flag(&cpu->f, FLAG_C)); }
 }
 
 static void jr_e(SM83 *cpu) {
-  int8_t e = (int8_t)cpu->read(cpu->pc++);
+  int8_t e = (int8_t)fetch(cpu);
   cpu->pc = (uint16_t)((int)cpu->pc + e); \
 }
-static void jr_nz_e(SM83 *cpu) { JRcce(!get_flag(&cpu->f, FLAG_Z)); }
-static void jr_z_e(SM83 *cpu) { JRcce(get_flag(&cpu->f, FLAG_Z)); }
-static void jr_nc_e(SM83 *cpu) { JRcce(!get_flag(&cpu->f, FLAG_C)); }
-static void jr_c_e(SM83 *cpu) { JRcce(get_flag(&cpu->f, FLAG_C)); }
+static void jr_nz_e(SM83 *cpu) { JRcce(!get_flag(cpu, FLAG_Z)); }
+static void jr_z_e(SM83 *cpu) { JRcce(get_flag(cpu, FLAG_Z)); }
+static void jr_nc_e(SM83 *cpu) { JRcce(!get_flag(cpu, FLAG_C)); }
+static void jr_c_e(SM83 *cpu) { JRcce(get_flag(cpu, FLAG_C)); }
 
 #define CALL(addr) { \
-  cpu->write(--cpu->sp, (uint8_t)((cpu->pc >> 8) & 0xFF)); \
-  cpu->write(--cpu->sp, (uint8_t)(cpu->pc & 0xFF)); \
+  bus_write(cpu, --cpu->sp, (uint8_t)((cpu->pc >> 8) & 0xFF)); \
+  bus_write(cpu, --cpu->sp, (uint8_t)(cpu->pc & 0xFF)); \
   cpu->pc = addr; \
+  PROFILE_CALL(cpu); \
 }
 #define CALLccnn(cc) { \
-  uint16_t low = cpu->read(cpu->pc++); \
-  uint16_t high = cpu->read(cpu->pc++); \
+  uint16_t low = fetch(cpu); \
+  uint16_t high = fetch(cpu); \
   uint16_t nn = (uint16_t)(high << 8) | low; \
   if (cc) { \
     CALL(nn); \
@@ -626,20 +1718,21 @@ static void jr_c_e(SM83 *cpu) { JRcce(get_flag(&cpu->f, FLAG_C)); }
 }
 
 static void call_nn(SM83 *cpu) {
-  uint16_t low = cpu->read(cpu->pc++);
-  uint16_t high = cpu->read(cpu->pc++);
+  uint16_t low = fetch(cpu);
+  uint16_t high = fetch(cpu);
   uint16_t nn = (uint16_t)(high << 8) | low;
   CALL(nn);
 }
-static void call_nz_nn(SM83 *cpu) { CALLccnn(!get_flag(&cpu->f, FLAG_Z)); }
-static void call_z_nn(SM83 *cpu) { CALLccnn(get_flag(&cpu->f, FLAG_Z)); }
-static void call_nc_nn(SM83 *cpu) { CALLccnn(!get_flag(&cpu->f, FLAG_C)); }
-static void call_c_nn(SM83 *cpu) { CALLccnn(get_flag(&cpu->f, FLAG_C)); }
+static void call_nz_nn(SM83 *cpu) { CALLccnn(!get_flag(cpu, FLAG_Z)); }
+static void call_z_nn(SM83 *cpu) { CALLccnn(get_flag(cpu, FLAG_Z)); }
+static void call_nc_nn(SM83 *cpu) { CALLccnn(!get_flag(cpu, FLAG_C)); }
+static void call_c_nn(SM83 *cpu) { CALLccnn(get_flag(cpu, FLAG_C)); }
 
 #define RET() { \
-  uint16_t low = cpu->read(cpu->sp++); \
-  uint16_t high = cpu->read(cpu->sp++); \
+  uint16_t low = bus_read(cpu, cpu->sp++); \
+  uint16_t high = bus_read(cpu, cpu->sp++); \
   cpu->pc = (uint16_t)(high << 8) | low; \
+  PROFILE_RET(cpu); \
 }
 #define RETcc(cc) { \
   if (cc) { \
@@ -649,13 +1742,13 @@ static void call_c_nn(SM83 *cpu) { CALLccnn(get_flag(&cpu->f, FLAG_C)); }
 }
 
 static void ret(SM83 *cpu) { RET(); }
-static void ret_nz(SM83 *cpu) { RETcc(!get_flag(&cpu->f, FLAG_Z)); }
-static void ret_z(SM83 *cpu) { RETcc(get_flag(&cpu->f, FLAG_Z)); }
-static void ret_nc(SM83 *cpu) { RETcc(!get_flag(&cpu->f, FLAG_C)); }
-static void ret_c(SM83 *cpu) { RETcc(get_flag(&cpu->f, FLAG_C)); }
+static void ret_nz(SM83 *cpu) { RETcc(!get_flag(cpu, FLAG_Z)); }
+static void ret_z(SM83 *cpu) { RETcc(get_flag(cpu, FLAG_Z)); }
+static void ret_nc(SM83 *cpu) { RETcc(!get_flag(cpu, FLAG_C)); }
+static void ret_c(SM83 *cpu) { RETcc(get_flag(cpu, FLAG_C)); }
 static void reti(SM83 *cpu) {
   RET();
-  // cpu->ime = 1; TODO TODO TODO
+  cpu->ime = 1;
 }
 static void rst_00(SM83 *cpu) { CALL(0x00); }
 static void rst_08(SM83 *cpu) { CALL(0x08); }
@@ -670,84 +1763,84 @@ static void rst_38(SM83 *cpu) { CALL(0x38); }
 #define RLCr(r) { \
   uint8_t carry = (r >> 7) & 1; \
   r = (uint8_t)((r << 1) | carry); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
-  set_flag(&cpu->f, FLAG_C, carry); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
+  set_flag(cpu, FLAG_C, carry); \
 }
 
 #define RRCr(r) { \
   uint8_t carry = r & 1; \
   r = (uint8_t)((r >> 1) | (carry << 7)); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
-  set_flag(&cpu->f, FLAG_C, carry); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
+  set_flag(cpu, FLAG_C, carry); \
 }
 
 #define RLr(r) { \
   uint8_t carry = (r >> 7) & 1; \
-  r = (uint8_t)((r << 1) | get_flag(&cpu->f, FLAG_C)); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
-  set_flag(&cpu->f, FLAG_C, carry); \
+  r = (uint8_t)((r << 1) | get_flag(cpu, FLAG_C)); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
+  set_flag(cpu, FLAG_C, carry); \
 }
 
 #define RRr(r) { \
   uint8_t carry = r & 1; \
-  r = (uint8_t)((r >> 1) | (get_flag(&cpu->f, FLAG_C) << 7)); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
-  set_flag(&cpu->f, FLAG_C, carry); \
+  r = (uint8_t)((r >> 1) | (get_flag(cpu, FLAG_C) << 7)); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
+  set_flag(cpu, FLAG_C, carry); \
 }
 
 #define SLAr(r) { \
-  set_flag(&cpu->f, FLAG_C, (r >> 7) & 1); \
+  set_flag(cpu, FLAG_C, (r >> 7) & 1); \
   r = (uint8_t)(r << 1); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
 }
 
 #define SRAr(r) { \
-  set_flag(&cpu->f, FLAG_C, r & 1); \
+  set_flag(cpu, FLAG_C, r & 1); \
   r = (uint8_t)((r >> 1) | (r & 0x80)); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
 }
 
 #define SWAPr(r) { \
   r = (uint8_t)((r << 4) | (r >> 4)); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
-  set_flag(&cpu->f, FLAG_C, 0); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
+  set_flag(cpu, FLAG_C, 0); \
 }
 
 #define SRLr(r) { \
-  set_flag(&cpu->f, FLAG_C, r & 1); \
+  set_flag(cpu, FLAG_C, r & 1); \
   r = (uint8_t)(r >> 1); \
-  set_flag(&cpu->f, FLAG_Z, (r == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 0); \
+  set_flag(cpu, FLAG_Z, (r == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 0); \
 }
 
 #define BITb(b, r) { \
-  set_flag(&cpu->f, FLAG_Z, ((r & (1 << b)) == 0)); \
-  set_flag(&cpu->f, FLAG_N, 0); \
-  set_flag(&cpu->f, FLAG_H, 1); \
+  set_flag(cpu, FLAG_Z, ((r & (1 << b)) == 0)); \
+  set_flag(cpu, FLAG_N, 0); \
+  set_flag(cpu, FLAG_H, 1); \
 }
 
 #define RESb(b, r) { r &= (uint8_t)~(1 << b); }
 #define SETb(b, r) { r |= (1 << b); }
 
-static void rlca(SM83 *cpu) { RLCr(cpu->a); set_flag(&cpu->f, FLAG_Z, 0); }
-static void rrca(SM83 *cpu) { RRCr(cpu->a); set_flag(&cpu->f, FLAG_Z, 0); }
-static void rla(SM83 *cpu) { RLr(cpu->a); set_flag(&cpu->f, FLAG_Z, 0); }
-static void rra(SM83 *cpu) { RRr(cpu->a); set_flag(&cpu->f, FLAG_Z, 0); }
+static void rlca(SM83 *cpu) { RLCr(cpu->a); set_flag(cpu, FLAG_Z, 0); }
+static void rrca(SM83 *cpu) { RRCr(cpu->a); set_flag(cpu, FLAG_Z, 0); }
+static void rla(SM83 *cpu) { RLr(cpu->a); set_flag(cpu, FLAG_Z, 0); }
+static void rra(SM83 *cpu) { RRr(cpu->a); set_flag(cpu, FLAG_Z, 0); }
 
 static void rlc_b(SM83 *cpu) { RLCr(cpu->b); }
 static void rlc_c(SM83 *cpu) { RLCr(cpu->c); }
@@ -757,9 +1850,9 @@ static void rlc_h(SM83 *cpu) { RLCr(cpu->h); }
 static void rlc_l(SM83 *cpu) { RLCr(cpu->l); }
 static void rlc_a(SM83 *cpu) { RLCr(cpu->a); }
 static void rlc_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RLCr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void rrc_b(SM83 *cpu) { RRCr(cpu->b); }
@@ -770,9 +1863,9 @@ static void rrc_h(SM83 *cpu) { RRCr(cpu->h); }
 static void rrc_l(SM83 *cpu) { RRCr(cpu->l); }
 static void rrc_a(SM83 *cpu) { RRCr(cpu->a); }
 static void rrc_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RRCr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void rl_b(SM83 *cpu) { RLr(cpu->b); }
@@ -783,9 +1876,9 @@ static void rl_h(SM83 *cpu) { RLr(cpu->h); }
 static void rl_l(SM83 *cpu) { RLr(cpu->l); }
 static void rl_a(SM83 *cpu) { RLr(cpu->a); }
 static void rl_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RLr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void rr_b(SM83 *cpu) { RRr(cpu->b); }
@@ -796,9 +1889,9 @@ static void rr_h(SM83 *cpu) { RRr(cpu->h); }
 static void rr_l(SM83 *cpu) { RRr(cpu->l); }
 static void rr_a(SM83 *cpu) { RRr(cpu->a); }
 static void rr_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RRr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void sla_b(SM83 *cpu) { SLAr(cpu->b); }
@@ -809,9 +1902,9 @@ static void sla_h(SM83 *cpu) { SLAr(cpu->h); }
 static void sla_l(SM83 *cpu) { SLAr(cpu->l); }
 static void sla_a(SM83 *cpu) { SLAr(cpu->a); }
 static void sla_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SLAr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void sra_b(SM83 *cpu) { SRAr(cpu->b); }
@@ -822,9 +1915,9 @@ static void sra_h(SM83 *cpu) { SRAr(cpu->h); }
 static void sra_l(SM83 *cpu) { SRAr(cpu->l); }
 static void sra_a(SM83 *cpu) { SRAr(cpu->a); }
 static void sra_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SRAr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void swap_b(SM83 *cpu) { SWAPr(cpu->b); }
@@ -835,9 +1928,9 @@ static void swap_h(SM83 *cpu) { SWAPr(cpu->h); }
 static void swap_l(SM83 *cpu) { SWAPr(cpu->l); }
 static void swap_a(SM83 *cpu) { SWAPr(cpu->a); }
 static void swap_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SWAPr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void srl_b(SM83 *cpu) { SRLr(cpu->b); }
@@ -848,9 +1941,9 @@ static void srl_h(SM83 *cpu) { SRLr(cpu->h); }
 static void srl_l(SM83 *cpu) { SRLr(cpu->l); }
 static void srl_a(SM83 *cpu) { SRLr(cpu->a); }
 static void srl_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SRLr(value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void bit_0_b(SM83 *cpu) { BITb(0, cpu->b); }
@@ -860,7 +1953,7 @@ static void bit_0_e(SM83 *cpu) { BITb(0, cpu->e); }
 static void bit_0_h(SM83 *cpu) { BITb(0, cpu->h); }
 static void bit_0_l(SM83 *cpu) { BITb(0, cpu->l); }
 static void bit_0_a(SM83 *cpu) { BITb(0, cpu->a); }
-static void bit_0_hl(SM83 *cpu) { BITb(0, cpu->read(cpu->hl)); }
+static void bit_0_hl(SM83 *cpu) { BITb(0, bus_read(cpu, cpu->hl)); }
 
 static void bit_1_b(SM83 *cpu) { BITb(1, cpu->b); }
 static void bit_1_c(SM83 *cpu) { BITb(1, cpu->c); }
@@ -869,7 +1962,7 @@ static void bit_1_e(SM83 *cpu) { BITb(1, cpu->e); }
 static void bit_1_h(SM83 *cpu) { BITb(1, cpu->h); }
 static void bit_1_l(SM83 *cpu) { BITb(1, cpu->l); }
 static void bit_1_a(SM83 *cpu) { BITb(1, cpu->a); }
-static void bit_1_hl(SM83 *cpu) { BITb(1, cpu->read(cpu->hl)); }
+static void bit_1_hl(SM83 *cpu) { BITb(1, bus_read(cpu, cpu->hl)); }
 
 static void bit_2_b(SM83 *cpu) { BITb(2, cpu->b); }
 static void bit_2_c(SM83 *cpu) { BITb(2, cpu->c); }
@@ -878,7 +1971,7 @@ static void bit_2_e(SM83 *cpu) { BITb(2, cpu->e); }
 static void bit_2_h(SM83 *cpu) { BITb(2, cpu->h); }
 static void bit_2_l(SM83 *cpu) { BITb(2, cpu->l); }
 static void bit_2_a(SM83 *cpu) { BITb(2, cpu->a); }
-static void bit_2_hl(SM83 *cpu) { BITb(2, cpu->read(cpu->hl)); }
+static void bit_2_hl(SM83 *cpu) { BITb(2, bus_read(cpu, cpu->hl)); }
 
 static void bit_3_b(SM83 *cpu) { BITb(3, cpu->b); }
 static void bit_3_c(SM83 *cpu) { BITb(3, cpu->c); }
@@ -887,7 +1980,7 @@ static void bit_3_e(SM83 *cpu) { BITb(3, cpu->e); }
 static void bit_3_h(SM83 *cpu) { BITb(3, cpu->h); }
 static void bit_3_l(SM83 *cpu) { BITb(3, cpu->l); }
 static void bit_3_a(SM83 *cpu) { BITb(3, cpu->a); }
-static void bit_3_hl(SM83 *cpu) { BITb(3, cpu->read(cpu->hl)); }
+static void bit_3_hl(SM83 *cpu) { BITb(3, bus_read(cpu, cpu->hl)); }
 
 static void bit_4_b(SM83 *cpu) { BITb(4, cpu->b); }
 static void bit_4_c(SM83 *cpu) { BITb(4, cpu->c); }
@@ -896,7 +1989,7 @@ static void bit_4_e(SM83 *cpu) { BITb(4, cpu->e); }
 static void bit_4_h(SM83 *cpu) { BITb(4, cpu->h); }
 static void bit_4_l(SM83 *cpu) { BITb(4, cpu->l); }
 static void bit_4_a(SM83 *cpu) { BITb(4, cpu->a); }
-static void bit_4_hl(SM83 *cpu) { BITb(4, cpu->read(cpu->hl)); }
+static void bit_4_hl(SM83 *cpu) { BITb(4, bus_read(cpu, cpu->hl)); }
 
 static void bit_5_b(SM83 *cpu) { BITb(5, cpu->b); }
 static void bit_5_c(SM83 *cpu) { BITb(5, cpu->c); }
@@ -905,7 +1998,7 @@ static void bit_5_e(SM83 *cpu) { BITb(5, cpu->e); }
 static void bit_5_h(SM83 *cpu) { BITb(5, cpu->h); }
 static void bit_5_l(SM83 *cpu) { BITb(5, cpu->l); }
 static void bit_5_a(SM83 *cpu) { BITb(5, cpu->a); }
-static void bit_5_hl(SM83 *cpu) { BITb(5, cpu->read(cpu->hl)); }
+static void bit_5_hl(SM83 *cpu) { BITb(5, bus_read(cpu, cpu->hl)); }
 
 static void bit_6_b(SM83 *cpu) { BITb(6, cpu->b); }
 static void bit_6_c(SM83 *cpu) { BITb(6, cpu->c); }
@@ -914,7 +2007,7 @@ static void bit_6_e(SM83 *cpu) { BITb(6, cpu->e); }
 static void bit_6_h(SM83 *cpu) { BITb(6, cpu->h); }
 static void bit_6_l(SM83 *cpu) { BITb(6, cpu->l); }
 static void bit_6_a(SM83 *cpu) { BITb(6, cpu->a); }
-static void bit_6_hl(SM83 *cpu) { BITb(6, cpu->read(cpu->hl)); }
+static void bit_6_hl(SM83 *cpu) { BITb(6, bus_read(cpu, cpu->hl)); }
 
 static void bit_7_b(SM83 *cpu) { BITb(7, cpu->b); }
 static void bit_7_c(SM83 *cpu) { BITb(7, cpu->c); }
@@ -923,7 +2016,7 @@ static void bit_7_e(SM83 *cpu) { BITb(7, cpu->e); }
 static void bit_7_h(SM83 *cpu) { BITb(7, cpu->h); }
 static void bit_7_l(SM83 *cpu) { BITb(7, cpu->l); }
 static void bit_7_a(SM83 *cpu) { BITb(7, cpu->a); }
-static void bit_7_hl(SM83 *cpu) { BITb(7, cpu->read(cpu->hl)); }
+static void bit_7_hl(SM83 *cpu) { BITb(7, bus_read(cpu, cpu->hl)); }
 
 static void res_0_b(SM83 *cpu) { RESb(0, cpu->b); }
 static void res_0_c(SM83 *cpu) { RESb(0, cpu->c); }
@@ -933,9 +2026,9 @@ static void res_0_h(SM83 *cpu) { RESb(0, cpu->h); }
 static void res_0_l(SM83 *cpu) { RESb(0, cpu->l); }
 static void res_0_a(SM83 *cpu) { RESb(0, cpu->a); }
 static void res_0_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(0, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void res_1_b(SM83 *cpu) { RESb(1, cpu->b); }
@@ -946,9 +2039,9 @@ static void res_1_h(SM83 *cpu) { RESb(1, cpu->h); }
 static void res_1_l(SM83 *cpu) { RESb(1, cpu->l); }
 static void res_1_a(SM83 *cpu) { RESb(1, cpu->a); }
 static void res_1_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(1, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void res_2_b(SM83 *cpu) { RESb(2, cpu->b); }
@@ -959,9 +2052,9 @@ static void res_2_h(SM83 *cpu) { RESb(2, cpu->h); }
 static void res_2_l(SM83 *cpu) { RESb(2, cpu->l); }
 static void res_2_a(SM83 *cpu) { RESb(2, cpu->a); }
 static void res_2_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(2, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void res_3_b(SM83 *cpu) { RESb(3, cpu->b); }
@@ -972,9 +2065,9 @@ static void res_3_h(SM83 *cpu) { RESb(3, cpu->h); }
 static void res_3_l(SM83 *cpu) { RESb(3, cpu->l); }
 static void res_3_a(SM83 *cpu) { RESb(3, cpu->a); }
 static void res_3_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(3, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void res_4_b(SM83 *cpu) { RESb(4, cpu->b); }
@@ -985,9 +2078,9 @@ static void res_4_h(SM83 *cpu) { RESb(4, cpu->h); }
 static void res_4_l(SM83 *cpu) { RESb(4, cpu->l); }
 static void res_4_a(SM83 *cpu) { RESb(4, cpu->a); }
 static void res_4_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(4, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void res_5_b(SM83 *cpu) { RESb(5, cpu->b); }
@@ -998,9 +2091,9 @@ static void res_5_h(SM83 *cpu) { RESb(5, cpu->h); }
 static void res_5_l(SM83 *cpu) { RESb(5, cpu->l); }
 static void res_5_a(SM83 *cpu) { RESb(5, cpu->a); }
 static void res_5_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(5, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void res_6_b(SM83 *cpu) { RESb(6, cpu->b); }
@@ -1011,9 +2104,9 @@ static void res_6_h(SM83 *cpu) { RESb(6, cpu->h); }
 static void res_6_l(SM83 *cpu) { RESb(6, cpu->l); }
 static void res_6_a(SM83 *cpu) { RESb(6, cpu->a); }
 static void res_6_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(6, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void res_7_b(SM83 *cpu) { RESb(7, cpu->b); }
@@ -1024,9 +2117,9 @@ static void res_7_h(SM83 *cpu) { RESb(7, cpu->h); }
 static void res_7_l(SM83 *cpu) { RESb(7, cpu->l); }
 static void res_7_a(SM83 *cpu) { RESb(7, cpu->a); }
 static void res_7_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   RESb(7, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_0_b(SM83 *cpu) { SETb(0, cpu->b); }
@@ -1037,9 +2130,9 @@ static void set_0_h(SM83 *cpu) { SETb(0, cpu->h); }
 static void set_0_l(SM83 *cpu) { SETb(0, cpu->l); }
 static void set_0_a(SM83 *cpu) { SETb(0, cpu->a); }
 static void set_0_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(0, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_1_b(SM83 *cpu) { SETb(1, cpu->b); }
@@ -1050,9 +2143,9 @@ static void set_1_h(SM83 *cpu) { SETb(1, cpu->h); }
 static void set_1_l(SM83 *cpu) { SETb(1, cpu->l); }
 static void set_1_a(SM83 *cpu) { SETb(1, cpu->a); }
 static void set_1_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(1, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_2_b(SM83 *cpu) { SETb(2, cpu->b); }
@@ -1063,9 +2156,9 @@ static void set_2_h(SM83 *cpu) { SETb(2, cpu->h); }
 static void set_2_l(SM83 *cpu) { SETb(2, cpu->l); }
 static void set_2_a(SM83 *cpu) { SETb(2, cpu->a); }
 static void set_2_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(2, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_3_b(SM83 *cpu) { SETb(3, cpu->b); }
@@ -1076,9 +2169,9 @@ static void set_3_h(SM83 *cpu) { SETb(3, cpu->h); }
 static void set_3_l(SM83 *cpu) { SETb(3, cpu->l); }
 static void set_3_a(SM83 *cpu) { SETb(3, cpu->a); }
 static void set_3_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(3, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_4_b(SM83 *cpu) { SETb(4, cpu->b); }
@@ -1089,9 +2182,9 @@ static void set_4_h(SM83 *cpu) { SETb(4, cpu->h); }
 static void set_4_l(SM83 *cpu) { SETb(4, cpu->l); }
 static void set_4_a(SM83 *cpu) { SETb(4, cpu->a); }
 static void set_4_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(4, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_5_b(SM83 *cpu) { SETb(5, cpu->b); }
@@ -1102,9 +2195,9 @@ static void set_5_h(SM83 *cpu) { SETb(5, cpu->h); }
 static void set_5_l(SM83 *cpu) { SETb(5, cpu->l); }
 static void set_5_a(SM83 *cpu) { SETb(5, cpu->a); }
 static void set_5_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(5, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_6_b(SM83 *cpu) { SETb(6, cpu->b); }
@@ -1115,9 +2208,9 @@ static void set_6_h(SM83 *cpu) { SETb(6, cpu->h); }
 static void set_6_l(SM83 *cpu) { SETb(6, cpu->l); }
 static void set_6_a(SM83 *cpu) { SETb(6, cpu->a); }
 static void set_6_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(6, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 static void set_7_b(SM83 *cpu) { SETb(7, cpu->b); }
@@ -1128,9 +2221,9 @@ static void set_7_h(SM83 *cpu) { SETb(7, cpu->h); }
 static void set_7_l(SM83 *cpu) { SETb(7, cpu->l); }
 static void set_7_a(SM83 *cpu) { SETb(7, cpu->a); }
 static void set_7_hl(SM83 *cpu) {
-  uint8_t value = cpu->read(cpu->hl);
+  uint8_t value = bus_read(cpu, cpu->hl);
   SETb(7, value);
-  cpu->write(cpu->hl, value);
+  bus_write(cpu, cpu->hl, value);
 }
 
 // ** Prefix CB **
@@ -1170,7 +2263,7 @@ static const SM83Instruction instructions[0x100] = {
   { "DEC E", dec_e, 1, 4 },
   { "LD E, 0x%02X", ld_e_n, 2, 8 },
   { "RRA", rra, 1, 4 },
-  { "JR NZ, 0x%02X", jr_nz_e, 1, 8 }, // Note that it will add 1 more cycle if condition
+  { "JR NZ, 0x%02X", jr_nz_e, 2, 8 }, // Note that it will add 1 more cycle if condition
   { "LD HL, 0x%04X", ld_hl_nn, 3, 12 },
   { "LD [HL+], A", ldi_hlp_a, 1, 8 },
   { "INC HL", inc_hl, 1, 8 },
@@ -1178,7 +2271,7 @@ static const SM83Instruction instructions[0x100] = {
   { "DEC H", dec_h, 1, 4 },
   { "LD H, 0x%02X", ld_h_n, 2, 8 },
   { "DAA", daa, 1, 4 },
-  { "JR Z, 0x%02X", jr_z_e, 1, 8 },
+  { "JR Z, 0x%02X", jr_z_e, 2, 8 },
   { "ADD HL, HL", add_hl_hl, 1, 8 },
   { "LD A, [HL+]", ld_a_hlp, 1, 8 },
   { "DEC HL", dec_hl, 1, 8 },
@@ -1186,7 +2279,7 @@ static const SM83Instruction instructions[0x100] = {
   { "DEC L", dec_l, 1, 4 },
   { "LD L, 0x%02X", ld_l_n, 2, 8 },
   { "CPL", cpl, 1, 4 },
-  { "JR NC, 0x%02X", jr_nc_e, 1, 8 },
+  { "JR NC, 0x%02X", jr_nc_e, 2, 8 },
   { "LD SP, 0x%04X", ld_sp_nn, 3, 12 },
   { "LD [HL-], A", ldi_hlm_a, 1, 8 },
   { "INC SP", inc_sp, 1, 8 },
@@ -1194,7 +2287,7 @@ static const SM83Instruction instructions[0x100] = {
   { "DEC [HL]", deci_hl, 1, 12 },
   { "LD [HL], 0x%02X", ldi_hl_n, 2, 12 },
   { "SCF", scf, 1, 4 },
-  { "JR C, 0x%02X", jr_c_e, 1, 8 },
+  { "JR C, 0x%02X", jr_c_e, 2, 8 },
   { "ADD HL, SP", add_hl_sp, 1, 8 },
   { "LD A, [HL-]", ld_a_hlm, 1, 8 },
   { "DEC SP", dec_sp, 1, 8 },
@@ -1356,9 +2449,9 @@ static const SM83Instruction instructions[0x100] = {
   { "RST 0x10", rst_10, 1, 16 },
   { "RET C", ret_c, 1, 8 },
   { "RETI", reti, 1, 16 },
-  { "JP C, 0x%04X", jp_c_nn, 1, 12 },
+  { "JP C, 0x%04X", jp_c_nn, 3, 12 },
   { "INVALID", invalid, (uint8_t)-1, (uint8_t)-1 },
-  { "CALL C, 0x%04X", call_c_nn, 1, 12 },
+  { "CALL C, 0x%04X", call_c_nn, 3, 12 },
   { "INVALID", invalid, (uint8_t)-1, (uint8_t)-1 },
   { "SBC A, 0x%02X", sbc_a_n, 2, 8 },
   { "RST 0x18", rst_18, 1, 16 },
@@ -1655,21 +2748,1820 @@ static const SM83Instruction cb_instructions[0x100] = {
   { "SET 7, A", set_7_a, 2, 8 },
 };
 
-void SM83_tick(SM83 *cpu) {
-  if (cpu->t > 0) { cpu->t--; return; }
+// ** Interrupts **
+// Checked between instructions, only when the CPU is halted, has just run EI or has IME
+// set, so the common case costs a couple of loads
+static inline
+int needs_service(const SM83 *cpu) {
+  return cpu->halted || cpu->ime_delay || (cpu->ime && interrupts_pending(cpu));
+}
+
+// Returns the T-cycles spent instead of running an instruction, 0 if one should run
+static inline
+uint8_t service(SM83 *cpu) {
+  const uint8_t pending = interrupts_pending(cpu);
+  uint8_t ticks = 0;
+
+  if (cpu->halted) {
+    if (!pending) return 4;
+    cpu->halted = 0;
+    ticks = 4;
+  }
+
+  if (cpu->ime && pending) {
+    for (uint8_t bit = 0; bit < 5; bit++) {
+      if (!(pending & (1 << bit))) continue;
+
+      cpu->bus->if_ &= (uint8_t)~(1 << bit);
+      cpu->ime = 0;
+      cpu->ime_delay = 0;
+      CALL((uint16_t)(0x40 + 8 * bit));
+      return (uint8_t)(ticks + 20);
+    }
+  }
+
+  cpu->ime |= cpu->ime_delay;
+  cpu->ime_delay = 0;
+  return ticks;
+}
+
+// Nothing but the host or an event can wake a halted CPU, and those only get to run
+// between slices (see SM83_run), so the rest of the slice goes by at once (in whole M-cycles)
+static inline
+uint64_t halt_skip(uint64_t elapsed, uint64_t cycles) {
+  return (cycles - elapsed + 3) & ~(uint64_t)3;
+}
+
+// Counts one more run of `instruction` (from either table), which took `ticks` T-cycles.
+// Nothing at all without SM83_OPCODE_COUNTS
+#ifdef SM83_OPCODE_COUNTS
+static inline
+void count_opcode(SM83 *bus, const SM83Instruction *instruction, uint8_t ticks) {
+  const uintptr_t cb = (uintptr_t)instruction - (uintptr_t)cb_instructions;
+  const size_t index = cb < sizeof(cb_instructions) ? 0x100 + cb / sizeof(SM83Instruction) : (size_t)(instruction - instructions);
+  bus->opcode_runs[index][(ticks >> 2) % 7]++;
+}
+#define COUNT_OPCODE(cpu, instruction) count_opcode((cpu)->bus, (instruction), (cpu)->t)
+#else
+#define COUNT_OPCODE(cpu, instruction) ((void)0)
+#endif
+
+// Hands the instruction at PC to the trace callback, `elapsed` T-cycles into the slice.
+// Nothing at all without SM83_TRACE
+#ifdef SM83_TRACE
+static void trace_record(SM83 *cpu, uint64_t elapsed) {
+  SM83 *bus = cpu->bus;
+  SM83TraceRecord record;
+  memset(&record, 0, sizeof(record));
+
+  flags_sync(cpu);
+  record.cycles = bus->cycles + elapsed;
+  record.pc = cpu->pc;
+  record.sp = cpu->sp;
+  record.af = cpu->af;
+  record.bc = cpu->bc;
+  record.de = cpu->de;
+  record.hl = cpu->hl;
+  record.ime = cpu->ime;
+  record.ie = bus->ie;
+  record.if_ = bus->if_;
+  record.halted = cpu->halted;
+
+  // Only through the map: a read callback may have side effects (FIFOs, latches) that
+  // looking at the code mustn't trigger. Bytes that aren't mapped stay zero
+  const uint8_t *page = bus->read_map[cpu->pc >> 8];
+  record.opcode[0] = page ? page[cpu->pc & 0xFF] : 0;
+  const uint8_t length = record.opcode[0] == 0xCB ? 2 : instructions[record.opcode[0]].length;
+  for (uint8_t i = 1; i < length && i < 3; i++) {
+    const uint16_t addr = (uint16_t)(cpu->pc + i);
+    page = bus->read_map[addr >> 8];
+    record.opcode[i] = page ? page[addr & 0xFF] : 0;
+  }
 
-  const uint8_t opcode = cpu->read(cpu->pc++);
+  bus->trace(bus->trace_data, &record);
+}
+#define TRACING(cpu) ((cpu)->bus->trace != NULL)
+#define TRACE(cpu, elapsed) { if ((cpu)->bus->trace) trace_record((cpu), (elapsed)); }
+#else
+#define TRACING(cpu) 0
+#define TRACE(cpu, elapsed) {}
+#endif
+
+// ** Dispatch cores **
+// SM83_run can be built around a single switch (SM83_DISPATCH_SWITCH) or GCC's computed
+// goto with the dispatch replicated after every opcode (SM83_DISPATCH_GOTO) instead of
+// the function pointer tables, which are still used by SM83_step and for metadata.
+// Either way, the registers are worked on from a local copy for the whole run, so the
+// compiler can keep them in host registers, and written back only on exit
+#if defined(SM83_DISPATCH_GOTO) && !defined(__GNUC__)
+#undef SM83_DISPATCH_GOTO
+#define SM83_DISPATCH_SWITCH
+#endif
+
+#if defined(SM83_DISPATCH_SWITCH) || defined(SM83_DISPATCH_GOTO)
+
+#ifdef __GNUC__
+#define SM83_FLATTEN __attribute__((flatten))
+#else
+#define SM83_FLATTEN
+#endif
+
+// Every opcode but the 0xCB prefix
+#define SM83_OPCODES(OP) \
+  OP(0x00, nop) OP(0x01, ld_bc_nn) OP(0x02, ldi_bc_a) OP(0x03, inc_bc) OP(0x04, inc_b) OP(0x05, dec_b) OP(0x06, ld_b_n) OP(0x07, rlca) \
+  OP(0x08, ld_nn_sp) OP(0x09, add_hl_bc) OP(0x0A, ldi_a_bc) OP(0x0B, dec_bc) OP(0x0C, inc_c) OP(0x0D, dec_c) OP(0x0E, ld_c_n) OP(0x0F, rrca) \
+  OP(0x10, stop) OP(0x11, ld_de_nn) OP(0x12, ldi_de_a) OP(0x13, inc_de) OP(0x14, inc_d) OP(0x15, dec_d) OP(0x16, ld_d_n) OP(0x17, rla) \
+  OP(0x18, jr_e) OP(0x19, add_hl_de) OP(0x1A, ldi_a_de) OP(0x1B, dec_de) OP(0x1C, inc_e) OP(0x1D, dec_e) OP(0x1E, ld_e_n) OP(0x1F, rra) \
+  OP(0x20, jr_nz_e) OP(0x21, ld_hl_nn) OP(0x22, ldi_hlp_a) OP(0x23, inc_hl) OP(0x24, inc_h) OP(0x25, dec_h) OP(0x26, ld_h_n) OP(0x27, daa) \
+  OP(0x28, jr_z_e) OP(0x29, add_hl_hl) OP(0x2A, ld_a_hlp) OP(0x2B, dec_hl) OP(0x2C, inc_l) OP(0x2D, dec_l) OP(0x2E, ld_l_n) OP(0x2F, cpl) \
+  OP(0x30, jr_nc_e) OP(0x31, ld_sp_nn) OP(0x32, ldi_hlm_a) OP(0x33, inc_sp) OP(0x34, inci_hl) OP(0x35, deci_hl) OP(0x36, ldi_hl_n) OP(0x37, scf) \
+  OP(0x38, jr_c_e) OP(0x39, add_hl_sp) OP(0x3A, ld_a_hlm) OP(0x3B, dec_sp) OP(0x3C, inc_a) OP(0x3D, dec_a) OP(0x3E, ld_a_n) OP(0x3F, ccf) \
+  OP(0x40, ld_b_b) OP(0x41, ld_b_c) OP(0x42, ld_b_d) OP(0x43, ld_b_e) OP(0x44, ld_b_h) OP(0x45, ld_b_l) OP(0x46, ld_b_hl) OP(0x47, ld_b_a) \
+  OP(0x48, ld_c_b) OP(0x49, ld_c_c) OP(0x4A, ld_c_d) OP(0x4B, ld_c_e) OP(0x4C, ld_c_h) OP(0x4D, ld_c_l) OP(0x4E, ld_c_hl) OP(0x4F, ld_c_a) \
+  OP(0x50, ld_d_b) OP(0x51, ld_d_c) OP(0x52, ld_d_d) OP(0x53, ld_d_e) OP(0x54, ld_d_h) OP(0x55, ld_d_l) OP(0x56, ld_d_hl) OP(0x57, ld_d_a) \
+  OP(0x58, ld_e_b) OP(0x59, ld_e_c) OP(0x5A, ld_e_d) OP(0x5B, ld_e_e) OP(0x5C, ld_e_h) OP(0x5D, ld_e_l) OP(0x5E, ld_e_hl) OP(0x5F, ld_e_a) \
+  OP(0x60, ld_h_b) OP(0x61, ld_h_c) OP(0x62, ld_h_d) OP(0x63, ld_h_e) OP(0x64, ld_h_h) OP(0x65, ld_h_l) OP(0x66, ld_h_hl) OP(0x67, ld_h_a) \
+  OP(0x68, ld_l_b) OP(0x69, ld_l_c) OP(0x6A, ld_l_d) OP(0x6B, ld_l_e) OP(0x6C, ld_l_h) OP(0x6D, ld_l_l) OP(0x6E, ld_l_hl) OP(0x6F, ld_l_a) \
+  OP(0x70, ldi_hl_b) OP(0x71, ldi_hl_c) OP(0x72, ldi_hl_d) OP(0x73, ldi_hl_e) OP(0x74, ldi_hl_h) OP(0x75, ldi_hl_l) OP(0x76, halt) OP(0x77, ldi_hl_a) \
+  OP(0x78, ld_a_b) OP(0x79, ld_a_c) OP(0x7A, ld_a_d) OP(0x7B, ld_a_e) OP(0x7C, ld_a_h) OP(0x7D, ld_a_l) OP(0x7E, ld_a_hl) OP(0x7F, ld_a_a) \
+  OP(0x80, add_a_b) OP(0x81, add_a_c) OP(0x82, add_a_d) OP(0x83, add_a_e) OP(0x84, add_a_h) OP(0x85, add_a_l) OP(0x86, add_a_hl) OP(0x87, add_a_a) \
+  OP(0x88, adc_a_b) OP(0x89, adc_a_c) OP(0x8A, adc_a_d) OP(0x8B, adc_a_e) OP(0x8C, adc_a_h) OP(0x8D, adc_a_l) OP(0x8E, adc_a_hl) OP(0x8F, adc_a_a) \
+  OP(0x90, sub_b) OP(0x91, sub_c) OP(0x92, sub_d) OP(0x93, sub_e) OP(0x94, sub_h) OP(0x95, sub_l) OP(0x96, sub_hl) OP(0x97, sub_a) \
+  OP(0x98, sbc_a_b) OP(0x99, sbc_a_c) OP(0x9A, sbc_a_d) OP(0x9B, sbc_a_e) OP(0x9C, sbc_a_h) OP(0x9D, sbc_a_l) OP(0x9E, sbc_a_hl) OP(0x9F, sbc_a_a) \
+  OP(0xA0, and_b) OP(0xA1, and_c) OP(0xA2, and_d) OP(0xA3, and_e) OP(0xA4, and_h) OP(0xA5, and_l) OP(0xA6, and_hl) OP(0xA7, and_a) \
+  OP(0xA8, xor_b) OP(0xA9, xor_c) OP(0xAA, xor_d) OP(0xAB, xor_e) OP(0xAC, xor_h) OP(0xAD, xor_l) OP(0xAE, xor_hl) OP(0xAF, xor_a) \
+  OP(0xB0, or_b) OP(0xB1, or_c) OP(0xB2, or_d) OP(0xB3, or_e) OP(0xB4, or_h) OP(0xB5, or_l) OP(0xB6, or_hl) OP(0xB7, or_a) \
+  OP(0xB8, cp_b) OP(0xB9, cp_c) OP(0xBA, cp_d) OP(0xBB, cp_e) OP(0xBC, cp_h) OP(0xBD, cp_l) OP(0xBE, cp_hl) OP(0xBF, cp_a) \
+  OP(0xC0, ret_nz) OP(0xC1, pop_bc) OP(0xC2, jp_nz_nn) OP(0xC3, jp_nn) OP(0xC4, call_nz_nn) OP(0xC5, push_bc) OP(0xC6, add_a_n) OP(0xC7, rst_00) \
+  OP(0xC8, ret_z) OP(0xC9, ret) OP(0xCA, jp_z_nn) OP(0xCC, call_z_nn) OP(0xCD, call_nn) OP(0xCE, adc_a_n) OP(0xCF, rst_08) \
+  OP(0xD0, ret_nc) OP(0xD1, pop_de) OP(0xD2, jp_nc_nn) OP(0xD3, invalid) OP(0xD4, call_nc_nn) OP(0xD5, push_de) OP(0xD6, sub_n) OP(0xD7, rst_10) \
+  OP(0xD8, ret_c) OP(0xD9, reti) OP(0xDA, jp_c_nn) OP(0xDB, invalid) OP(0xDC, call_c_nn) OP(0xDD, invalid) OP(0xDE, sbc_a_n) OP(0xDF, rst_18) \
+  OP(0xE0, ldh_n_a) OP(0xE1, pop_hl) OP(0xE2, ldh_c_a) OP(0xE3, invalid) OP(0xE4, invalid) OP(0xE5, push_hl) OP(0xE6, and_n) OP(0xE7, rst_20) \
+  OP(0xE8, add_sp_e) OP(0xE9, jp_hl) OP(0xEA, ld_nn_a) OP(0xEB, invalid) OP(0xEC, invalid) OP(0xED, invalid) OP(0xEE, xor_n) OP(0xEF, rst_28) \
+  OP(0xF0, ldh_a_n) OP(0xF1, pop_af) OP(0xF2, ldh_a_c) OP(0xF3, di) OP(0xF4, invalid) OP(0xF5, push_af) OP(0xF6, or_n) OP(0xF7, rst_30) \
+  OP(0xF8, ld_hl_sp_e) OP(0xF9, ld_sp_hl) OP(0xFA, ld_a_nn) OP(0xFB, ei) OP(0xFC, invalid) OP(0xFD, invalid) OP(0xFE, cp_n) OP(0xFF, rst_38)
+
+#define SM83_CB_OPCODES(OP) \
+  OP(0x00, rlc_b) OP(0x01, rlc_c) OP(0x02, rlc_d) OP(0x03, rlc_e) OP(0x04, rlc_h) OP(0x05, rlc_l) OP(0x06, rlc_hl) OP(0x07, rlc_a) \
+  OP(0x08, rrc_b) OP(0x09, rrc_c) OP(0x0A, rrc_d) OP(0x0B, rrc_e) OP(0x0C, rrc_h) OP(0x0D, rrc_l) OP(0x0E, rrc_hl) OP(0x0F, rrc_a) \
+  OP(0x10, rl_b) OP(0x11, rl_c) OP(0x12, rl_d) OP(0x13, rl_e) OP(0x14, rl_h) OP(0x15, rl_l) OP(0x16, rl_hl) OP(0x17, rl_a) \
+  OP(0x18, rr_b) OP(0x19, rr_c) OP(0x1A, rr_d) OP(0x1B, rr_e) OP(0x1C, rr_h) OP(0x1D, rr_l) OP(0x1E, rr_hl) OP(0x1F, rr_a) \
+  OP(0x20, sla_b) OP(0x21, sla_c) OP(0x22, sla_d) OP(0x23, sla_e) OP(0x24, sla_h) OP(0x25, sla_l) OP(0x26, sla_hl) OP(0x27, sla_a) \
+  OP(0x28, sra_b) OP(0x29, sra_c) OP(0x2A, sra_d) OP(0x2B, sra_e) OP(0x2C, sra_h) OP(0x2D, sra_l) OP(0x2E, sra_hl) OP(0x2F, sra_a) \
+  OP(0x30, swap_b) OP(0x31, swap_c) OP(0x32, swap_d) OP(0x33, swap_e) OP(0x34, swap_h) OP(0x35, swap_l) OP(0x36, swap_hl) OP(0x37, swap_a) \
+  OP(0x38, srl_b) OP(0x39, srl_c) OP(0x3A, srl_d) OP(0x3B, srl_e) OP(0x3C, srl_h) OP(0x3D, srl_l) OP(0x3E, srl_hl) OP(0x3F, srl_a) \
+  OP(0x40, bit_0_b) OP(0x41, bit_0_c) OP(0x42, bit_0_d) OP(0x43, bit_0_e) OP(0x44, bit_0_h) OP(0x45, bit_0_l) OP(0x46, bit_0_hl) OP(0x47, bit_0_a) \
+  OP(0x48, bit_1_b) OP(0x49, bit_1_c) OP(0x4A, bit_1_d) OP(0x4B, bit_1_e) OP(0x4C, bit_1_h) OP(0x4D, bit_1_l) OP(0x4E, bit_1_hl) OP(0x4F, bit_1_a) \
+  OP(0x50, bit_2_b) OP(0x51, bit_2_c) OP(0x52, bit_2_d) OP(0x53, bit_2_e) OP(0x54, bit_2_h) OP(0x55, bit_2_l) OP(0x56, bit_2_hl) OP(0x57, bit_2_a) \
+  OP(0x58, bit_3_b) OP(0x59, bit_3_c) OP(0x5A, bit_3_d) OP(0x5B, bit_3_e) OP(0x5C, bit_3_h) OP(0x5D, bit_3_l) OP(0x5E, bit_3_hl) OP(0x5F, bit_3_a) \
+  OP(0x60, bit_4_b) OP(0x61, bit_4_c) OP(0x62, bit_4_d) OP(0x63, bit_4_e) OP(0x64, bit_4_h) OP(0x65, bit_4_l) OP(0x66, bit_4_hl) OP(0x67, bit_4_a) \
+  OP(0x68, bit_5_b) OP(0x69, bit_5_c) OP(0x6A, bit_5_d) OP(0x6B, bit_5_e) OP(0x6C, bit_5_h) OP(0x6D, bit_5_l) OP(0x6E, bit_5_hl) OP(0x6F, bit_5_a) \
+  OP(0x70, bit_6_b) OP(0x71, bit_6_c) OP(0x72, bit_6_d) OP(0x73, bit_6_e) OP(0x74, bit_6_h) OP(0x75, bit_6_l) OP(0x76, bit_6_hl) OP(0x77, bit_6_a) \
+  OP(0x78, bit_7_b) OP(0x79, bit_7_c) OP(0x7A, bit_7_d) OP(0x7B, bit_7_e) OP(0x7C, bit_7_h) OP(0x7D, bit_7_l) OP(0x7E, bit_7_hl) OP(0x7F, bit_7_a) \
+  OP(0x80, res_0_b) OP(0x81, res_0_c) OP(0x82, res_0_d) OP(0x83, res_0_e) OP(0x84, res_0_h) OP(0x85, res_0_l) OP(0x86, res_0_hl) OP(0x87, res_0_a) \
+  OP(0x88, res_1_b) OP(0x89, res_1_c) OP(0x8A, res_1_d) OP(0x8B, res_1_e) OP(0x8C, res_1_h) OP(0x8D, res_1_l) OP(0x8E, res_1_hl) OP(0x8F, res_1_a) \
+  OP(0x90, res_2_b) OP(0x91, res_2_c) OP(0x92, res_2_d) OP(0x93, res_2_e) OP(0x94, res_2_h) OP(0x95, res_2_l) OP(0x96, res_2_hl) OP(0x97, res_2_a) \
+  OP(0x98, res_3_b) OP(0x99, res_3_c) OP(0x9A, res_3_d) OP(0x9B, res_3_e) OP(0x9C, res_3_h) OP(0x9D, res_3_l) OP(0x9E, res_3_hl) OP(0x9F, res_3_a) \
+  OP(0xA0, res_4_b) OP(0xA1, res_4_c) OP(0xA2, res_4_d) OP(0xA3, res_4_e) OP(0xA4, res_4_h) OP(0xA5, res_4_l) OP(0xA6, res_4_hl) OP(0xA7, res_4_a) \
+  OP(0xA8, res_5_b) OP(0xA9, res_5_c) OP(0xAA, res_5_d) OP(0xAB, res_5_e) OP(0xAC, res_5_h) OP(0xAD, res_5_l) OP(0xAE, res_5_hl) OP(0xAF, res_5_a) \
+  OP(0xB0, res_6_b) OP(0xB1, res_6_c) OP(0xB2, res_6_d) OP(0xB3, res_6_e) OP(0xB4, res_6_h) OP(0xB5, res_6_l) OP(0xB6, res_6_hl) OP(0xB7, res_6_a) \
+  OP(0xB8, res_7_b) OP(0xB9, res_7_c) OP(0xBA, res_7_d) OP(0xBB, res_7_e) OP(0xBC, res_7_h) OP(0xBD, res_7_l) OP(0xBE, res_7_hl) OP(0xBF, res_7_a) \
+  OP(0xC0, set_0_b) OP(0xC1, set_0_c) OP(0xC2, set_0_d) OP(0xC3, set_0_e) OP(0xC4, set_0_h) OP(0xC5, set_0_l) OP(0xC6, set_0_hl) OP(0xC7, set_0_a) \
+  OP(0xC8, set_1_b) OP(0xC9, set_1_c) OP(0xCA, set_1_d) OP(0xCB, set_1_e) OP(0xCC, set_1_h) OP(0xCD, set_1_l) OP(0xCE, set_1_hl) OP(0xCF, set_1_a) \
+  OP(0xD0, set_2_b) OP(0xD1, set_2_c) OP(0xD2, set_2_d) OP(0xD3, set_2_e) OP(0xD4, set_2_h) OP(0xD5, set_2_l) OP(0xD6, set_2_hl) OP(0xD7, set_2_a) \
+  OP(0xD8, set_3_b) OP(0xD9, set_3_c) OP(0xDA, set_3_d) OP(0xDB, set_3_e) OP(0xDC, set_3_h) OP(0xDD, set_3_l) OP(0xDE, set_3_hl) OP(0xDF, set_3_a) \
+  OP(0xE0, set_4_b) OP(0xE1, set_4_c) OP(0xE2, set_4_d) OP(0xE3, set_4_e) OP(0xE4, set_4_h) OP(0xE5, set_4_l) OP(0xE6, set_4_hl) OP(0xE7, set_4_a) \
+  OP(0xE8, set_5_b) OP(0xE9, set_5_c) OP(0xEA, set_5_d) OP(0xEB, set_5_e) OP(0xEC, set_5_h) OP(0xED, set_5_l) OP(0xEE, set_5_hl) OP(0xEF, set_5_a) \
+  OP(0xF0, set_6_b) OP(0xF1, set_6_c) OP(0xF2, set_6_d) OP(0xF3, set_6_e) OP(0xF4, set_6_h) OP(0xF5, set_6_l) OP(0xF6, set_6_hl) OP(0xF7, set_6_a) \
+  OP(0xF8, set_7_b) OP(0xF9, set_7_c) OP(0xFA, set_7_d) OP(0xFB, set_7_e) OP(0xFC, set_7_h) OP(0xFD, set_7_l) OP(0xFE, set_7_hl) OP(0xFF, set_7_a)
+
+#ifdef SM83_DISPATCH_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+SM83_FLATTEN static
+uint64_t run_dispatch(SM83 *self, uint64_t cycles) {
+  SM83 local;
+  memcpy(&local, self, offsetof(SM83, bus));
+  local.bus = self->bus;
+
+  SM83 *const cpu = &local;
+  uint64_t elapsed = 0;
+  const SM83Instruction *instruction;
+  uint8_t opcode;
+
+#ifdef SM83_DISPATCH_GOTO
+#define LABEL(opcode, handler) [opcode] = &&op_##opcode,
+#define CB_LABEL(opcode, handler) [opcode] = &&cb_##opcode,
+  static const void *const labels[0x100] = { SM83_OPCODES(LABEL) [0xCB] = &&op_0xCB };
+  static const void *const cb_labels[0x100] = { SM83_CB_OPCODES(CB_LABEL) };
+#undef LABEL
+#undef CB_LABEL
+
+#define DISPATCH() { \
+  if (elapsed >= cycles) goto exit; \
+  if (needs_service(cpu)) goto interrupts; \
+  FETCH(); \
+}
+#define FETCH() { \
+  TRACE(cpu, elapsed); \
+  opcode = bus_read(cpu, cpu->pc++); \
+  instruction = &instructions[opcode]; \
+  cpu->t = 0; \
+  goto *labels[opcode]; \
+}
+#define RETIRE() { \
+  cpu->t = (uint8_t)(cpu->t + instruction->ticks); \
+  cpu->instruction = instruction; \
+  COUNT_OPCODE(cpu, instruction); \
+  elapsed += cpu->t; \
+  DISPATCH(); \
+}
+#define OP(opcode, handler) op_##opcode: handler(cpu); RETIRE();
+#define CB_OP(opcode, handler) cb_##opcode: handler(cpu); RETIRE();
+
+  DISPATCH();
+
+interrupts: {
+    const uint8_t ticks = service(cpu);
+    if (ticks) {
+      elapsed += cpu->halted ? halt_skip(elapsed, cycles) : ticks;
+      DISPATCH();
+    }
+    // Straight to the next instruction, so the one after EI always runs
+    FETCH();
+  }
+
+  SM83_OPCODES(OP)
+
+op_0xCB:
+  opcode = bus_read(cpu, cpu->pc++);
+  instruction = &cb_instructions[opcode];
+  goto *cb_labels[opcode];
+
+  SM83_CB_OPCODES(CB_OP)
+
+exit:
+#undef DISPATCH
+#undef FETCH
+#undef RETIRE
+#undef OP
+#undef CB_OP
+#else
+#define OP(opcode, handler) case opcode: handler(cpu); break;
+
+  while (elapsed < cycles) {
+    if (needs_service(cpu)) {
+      const uint8_t ticks = service(cpu);
+      if (ticks) {
+        elapsed += cpu->halted ? halt_skip(elapsed, cycles) : ticks;
+        continue;
+      }
+    }
+
+    TRACE(cpu, elapsed);
+    opcode = bus_read(cpu, cpu->pc++);
+    cpu->t = 0;
+
+    if (opcode == 0xCB) {
+      opcode = bus_read(cpu, cpu->pc++);
+      instruction = &cb_instructions[opcode];
+
+      switch (opcode) {
+        SM83_CB_OPCODES(OP)
+        default: break;
+      }
+    } else {
+      instruction = &instructions[opcode];
+
+      switch (opcode) {
+        SM83_OPCODES(OP)
+        default: break;
+      }
+    }
+
+    cpu->t = (uint8_t)(cpu->t + instruction->ticks);
+    cpu->instruction = instruction;
+    COUNT_OPCODE(cpu, instruction);
+    elapsed += cpu->t;
+  }
+
+#undef OP
+#endif
+
+  flags_sync(cpu);
+  memcpy(self, &local, offsetof(SM83, bus));
+
+  return elapsed;
+}
+
+#ifdef SM83_DISPATCH_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#endif // SM83_DISPATCH_SWITCH || SM83_DISPATCH_GOTO
+
+static inline
+uint8_t execute(SM83 *cpu) {
+  const uint8_t opcode = bus_read(cpu, cpu->pc++);
   const SM83Instruction *instruction = &instructions[opcode];
 
   if (opcode == 0xCB) {
-    const uint8_t cb_opcode = cpu->read(cpu->pc++);
+    const uint8_t cb_opcode = bus_read(cpu, cpu->pc++);
     instruction = &cb_instructions[cb_opcode];
   }
 
+  // Conditional instructions add their extra ticks on top of this
+  cpu->t = 0;
   instruction->exec(cpu);
 
   cpu->t = (uint8_t)(cpu->t + instruction->ticks);
   cpu->instruction = instruction;
+  COUNT_OPCODE(cpu, instruction);
+
+  return cpu->t;
+}
+
+#ifdef SM83_BLOCK_CACHE
+// ** Block cache **
+// Straight-line code on mapped pages is decoded once into blocks of handlers and their
+// immediates, ending at anything that may jump, halt or touch IME. Blocks never cross a
+// page and are keyed by PC and the page they came from, so switching banks with SM83_map
+// needs no flushing. CPU writes drop the blocks covering the written host byte, whichever
+// address it was written through
+static inline
+int ends_block(uint8_t opcode) {
+  switch (opcode) {
+    case 0x10: case 0x76: case 0xF3: case 0xFB: // STOP, HALT, DI, EI
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: // JP
+    case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // CALL
+    case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9: // RET, RETI
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static void block_decode(SM83 *bus, SM83Block *block, uint16_t pc, const uint8_t *page) {
+  unsigned offset = pc & 0xFF;
+
+  // The page takes over its slot, the blocks of the one it had lose track of their bytes
+  SM83CodePage *code = code_slot(bus, page);
+  if (code->page != page) {
+    if (code->page) {
+      for (unsigned i = 0; i < SM83_BLOCKS; i++) {
+        if (bus->blocks[i].page == code->page) bus->blocks[i].page = NULL;
+      }
+    }
+    code->page = page;
+    memset(code->bytes, 0, sizeof(code->bytes));
+  }
+
+  block->count = 0;
+  block->ticks = 0;
+  while (block->count < SM83_BLOCK_OPS) {
+    const uint8_t opcode = page[offset];
+    const SM83Instruction *instruction = &instructions[opcode];
+    unsigned size = 1, length = instruction->length;
+
+    if (opcode == 0xCB) {
+      if (offset == 0xFF) break;
+      instruction = &cb_instructions[page[offset + 1]];
+      size = length = 2;
+    }
+
+    // INVALID, or the rest is on another page
+    if (length > 3 || offset + length > 0x100) break;
+
+    SM83BlockOp *op = &block->ops[block->count++];
+    op->exec = instruction->exec;
+    op->instruction = instruction;
+    op->ticks = instruction->ticks;
+    op->size = (uint8_t)size;
+    block->ticks = (uint16_t)(block->ticks + instruction->ticks);
+    for (unsigned i = 0; i < 2; i++) op->operands[i] = size + i < length ? page[offset + size + i] : 0;
+    op->memory = strchr(instruction->mnemonic, '[') || !strncmp(instruction->mnemonic, "PUSH", 4) ||
+                 !strncmp(instruction->mnemonic, "POP", 3);
+
+    for (unsigned i = offset; i < offset + length; i++) code->bytes[i >> 3] |= (uint8_t)(1 << (i & 7));
+
+    offset += length;
+    if (size == 1 && ends_block(opcode)) {
+      block->ticks += 12; // Taken CALL cc and RET cc, the longest
+      break;
+    }
+  }
+
+  block->page = block->count ? page : NULL;
+#ifdef SM83_JIT
+  block->native = NULL;
+  block->hits = 0;
+#endif
+  block->pc = pc;
+  block->length = (uint8_t)(offset - (pc & 0xFF));
+}
+
+// The block for `pc` on `page`, decoded over the way of its set not hit last (or an empty
+// one) if it isn't there. Blocks never move, compiled ones refer to their own slot
+static inline
+SM83Block *block_find(SM83 *bus, const uint8_t *page, uint16_t pc) {
+  SM83Block *set = block_set(bus, page, pc & 0xFF);
+  uint8_t *recent = &bus->block_recent[(set - bus->blocks) / 2];
+
+  unsigned way;
+  if (set[0].page == page && set[0].pc == pc) way = 0;
+  else if (set[1].page == page && set[1].pc == pc) way = 1;
+  else {
+    way = !set[0].page ? 0 : !set[1].page ? 1 : !*recent;
+    block_decode(bus, &set[way], pc, page);
+  }
+
+  *recent = (uint8_t)way;
+  return &set[way];
+}
+
+#ifdef SM83_JIT
+// ** JIT **
+// Hot blocks are compiled into x86-64, with the registers kept where x86 has them by name
+// for the whole block: AF in ax (A in ah, F in al), BC in cx, DE in dx and HL in bx. Loads
+// between them and of immediates, 8-bit ALU operations, INC/DEC, 16-bit loads and INC/DEC
+// and JP/JR are native, x86 leaving Z, H and C in its own flags just as the SM83 sets them.
+// Everything else calls the same handler the interpreter would, with the registers written
+// back before and reloaded after. Compiled blocks keep the interpreter's contract: they
+// stop after any instruction that runs out the budget, writes over the block or switches
+// its bank, and return the T-cycles they ran
+#define JIT_BLOCK_MAX 8192 // Worst case for one block
+
+#define EMIT(...) { \
+  const uint8_t bytes_[] = { __VA_ARGS__ }; \
+  memcpy(at, bytes_, sizeof(bytes_)); \
+  at += sizeof(bytes_); \
+}
+#define EMIT16(value) { const uint16_t v_ = (uint16_t)(value); memcpy(at, &v_, 2); at += 2; }
+#define EMIT32(value) { const uint32_t v_ = (uint32_t)(value); memcpy(at, &v_, 4); at += 4; }
+#define EMIT64(value) { const uint64_t v_ = (uint64_t)(value); memcpy(at, &v_, 8); at += 8; }
+
+// Jumps to the exit after instruction `i` (jcc rel32, patched once the exits are there)
+#define EMIT_EXIT_IF(cc) { \
+  EMIT(0x0F, cc); \
+  fixups[fixup_count] = at; \
+  fixup_ops[fixup_count++] = i; \
+  EMIT32(0); \
+}
+
+// ax, cx, dx, bx to (0x89) or from (0x8B) AF, BC, DE, HL: mov [r15 + rr], r16 or back
+#define EMIT_REGISTERS(direction) { \
+  for (unsigned r_ = 0; r_ < 4; r_++) { \
+    EMIT(0x66, 0x41, direction, (uint8_t)(0x87 | r_ << 3)); EMIT32(jit_pairs[r_]); \
+  } \
+}
+
+// F from the x86 flags the last instruction left: Z, H and C where `mask` has ZF, AF and CF,
+// C as it was if `keep_c`, and the bits in `set`
+#define EMIT_FLAGS(mask, set, keep_c) { \
+  EMIT(0x89, 0xC7, 0x9F, 0x0F, 0xB6, 0xF4, 0x89, 0xF8); /* mov edi, eax; lahf; movzx esi, ah; mov eax, edi */ \
+  if ((mask) & 0x01) EMIT(0x89, 0xF7, 0x83, 0xE7, 0x01, 0xC1, 0xE7, 0x04); /* mov edi, esi; and edi, 1; shl edi, 4 */ \
+  EMIT(0x83, 0xE6, (uint8_t)((mask) & 0x50), 0x01, 0xF6); /* and esi, ZF | AF; add esi, esi */ \
+  if ((mask) & 0x01) EMIT(0x09, 0xFE); /* or esi, edi */ \
+  if ((set) != 0) EMIT(0x83, 0xCE, (uint8_t)(set)); /* or esi, set */ \
+  if (keep_c) EMIT(0x24, 0x10, 0x40, 0x08, 0xF0) /* and al, 0x10; or al, sil */ \
+  else EMIT(0x40, 0x88, 0xF0); /* mov al, sil */ \
+}
+
+// T-cycles of `op` (of `opcode`) onto r12, and its run counted
+#ifdef SM83_OPCODE_COUNTS
+#define EMIT_TICKS() { \
+  const size_t index_ = op->size == 1 ? opcode : 0x100 + (size_t)(op->instruction - cb_instructions); \
+  const uint32_t runs_ = (uint32_t)(offsetof(SM83, opcode_runs) + index_ * sizeof(bus->opcode_runs[0])); \
+  EMIT(0x49, 0x81, 0xC4); EMIT32(op->ticks); /* add r12, ticks */ \
+  if (conditional) { \
+    EMIT(0x41, 0x0F, 0xB6, 0xB7); EMIT32(offsetof(SM83, t)); /* movzx esi, byte [r15 + t] */ \
+    EMIT(0x83, 0xC6, op->ticks); /* add esi, ticks */ \
+    EMIT(0xC1, 0xEE, 0x02); /* shr esi, 2 */ \
+    EMIT(0x49, 0x83, 0x84, 0xF6); EMIT32(runs_); EMIT(0x01); /* add qword [r14 + rsi * 8 + runs], 1 */ \
+  } else { \
+    EMIT(0x49, 0x83, 0x86); EMIT32(runs_ + (op->ticks >> 2) * sizeof(uint64_t)); EMIT(0x01); /* add qword [r14 + runs + m], 1 */ \
+  } \
+}
+#else
+#define EMIT_TICKS() { EMIT(0x49, 0x81, 0xC4); EMIT32(op->ticks); } // add r12, ticks
+#endif
+
+// Calls the handler of instruction `i_`, at `pc_`, as the interpreter would: with the
+// registers in the struct, PC past the opcode and the immediates read from the block
+#define EMIT_HANDLER(i_, pc_) { \
+  EMIT_REGISTERS(0x89); \
+  EMIT(0x66, 0x41, 0xC7, 0x87); EMIT32(offsetof(SM83, pc)); EMIT16((pc_) + block->ops[i_].size); /* mov word [r15 + pc], pc */ \
+  EMIT(0x49, 0x8D, 0xB6); EMIT32(block_ops + (i_) * sizeof(SM83BlockOp) + offsetof(SM83BlockOp, operands)); /* lea rsi, [r14 + operands] */ \
+  EMIT(0x49, 0x89, 0xB7); EMIT32(offsetof(SM83, operands)); /* mov [r15 + operands], rsi */ \
+  EMIT(0x4C, 0x89, 0xFF); /* mov rdi, r15 */ \
+  EMIT(0x48, 0xB8); EMIT64((uintptr_t)block->ops[i_].exec); /* mov rax, exec */ \
+  EMIT(0xFF, 0xD0); /* call rax */ \
+  EMIT_REGISTERS(0x8B); \
+}
+
+// After a handler: is the block still there, and still mapped?
+#define EMIT_PAGE_CHECK() { \
+  EMIT(0x48, 0xBE); EMIT64((uintptr_t)block->page); /* mov rsi, page */ \
+  EMIT(0x49, 0x39, 0xB6); EMIT32(block_page); /* cmp [r14 + block page], rsi */ \
+  EMIT_EXIT_IF(0x85); /* jne */ \
+  EMIT(0x49, 0x39, 0xB6); EMIT32(map_page); /* cmp [r14 + read_map page], rsi */ \
+  EMIT_EXIT_IF(0x85); /* jne */ \
+}
+
+// Interrupt due (needs_service)? Only handlers change what it looks at
+#define EMIT_SERVICE_CHECK() { \
+  EMIT(0x41, 0x0F, 0xB6, 0xB7); EMIT32(offsetof(SM83, halted)); /* movzx esi, byte [r15 + halted] */ \
+  EMIT(0x41, 0x0A, 0xB7); EMIT32(offsetof(SM83, ime_delay)); /* or sil, [r15 + ime_delay] */ \
+  EMIT_EXIT_IF(0x85); /* jnz */ \
+  EMIT(0x41, 0x80, 0xBF); EMIT32(offsetof(SM83, ime)); EMIT(0x00); /* cmp byte [r15 + ime], 0 */ \
+  uint8_t *const skip_ = at; \
+  EMIT(0x74, 0x00); /* je past the rest */ \
+  EMIT(0x41, 0x0F, 0xB6, 0xB6); EMIT32(offsetof(SM83, ie)); /* movzx esi, byte [r14 + ie] */ \
+  EMIT(0x41, 0x22, 0xB6); EMIT32(offsetof(SM83, if_)); /* and sil, [r14 + if_] */ \
+  EMIT(0x40, 0xF6, 0xC6, 0x1F); /* test sil, 0x1F */ \
+  EMIT_EXIT_IF(0x85); /* jnz */ \
+  skip_[1] = (uint8_t)(at - (skip_ + 2)); \
+}
+
+// B, C, D, E, H, L, (HL), A as they appear in opcodes, as x86 encodes the byte registers
+// holding them: ch, cl, dh, dl, bh, bl, -, ah
+static const uint8_t jit_registers[8] = { 5, 1, 6, 2, 7, 3, 0, 4 };
+
+// Where ax, cx, dx and bx are written back to
+static const uint32_t jit_pairs[4] = { offsetof(SM83, af), offsetof(SM83, bc), offsetof(SM83, de), offsetof(SM83, hl) };
+
+#ifndef SM83_LAZY_FLAGS
+// ADD, ADC, SUB, SBC, AND, XOR, OR, CP as x86 op r/m8, r8 and as 0x80 /digit with an
+// immediate, and the flags they leave (see EMIT_FLAGS)
+static const struct { uint8_t code, digit, mask, set; } jit_alu[8] = {
+  { 0x00, 0, 0x51, 0x00 }, { 0x10, 2, 0x51, 0x00 }, { 0x28, 5, 0x51, 0x40 }, { 0x18, 3, 0x51, 0x40 },
+  { 0x20, 4, 0x40, 0x20 }, { 0x30, 6, 0x40, 0x00 }, { 0x08, 1, 0x40, 0x00 }, { 0x38, 7, 0x51, 0x40 },
+};
+#endif
+
+static inline
+int jit_conditional(uint8_t opcode) {
+  // JR cc, JP cc, CALL cc, RET cc, the only handlers adding to cpu->t
+  return (opcode & 0xE7) == 0x20 || (opcode & 0xE7) == 0xC2 || (opcode & 0xE7) == 0xC4 || (opcode & 0xE7) == 0xC0;
+}
+
+// Native code is uint64_t (SM83 *cpu, uint64_t budget), with r15 = cpu, r14 = cpu->bus (blocks
+// and the memory map live there), r12 = T-cycles so far and r13 = budget, rsi and rdi for
+// scratch. Nothing refers to the struct by address, only by offset
+static void jit_disable(SM83 *bus) {
+  for (unsigned i = 0; i < SM83_BLOCKS; i++) bus->blocks[i].native = NULL;
+  bus->jit_disabled = 1;
+}
+
+static void jit_compile(SM83 *bus, SM83Block *block) {
+  if (bus->jit_disabled) return;
+
+  // Writable or executable, never both (W^X): writable while a block goes in, then back
+  if (!bus->jit_code) {
+    void *code = mmap(NULL, SM83_JIT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) { bus->jit_disabled = 1; return; }
+    bus->jit_code = code;
+    bus->jit_used = 0;
+  } else if (mprotect(bus->jit_code, SM83_JIT_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    jit_disable(bus);
+    return;
+  }
+
+  // Out of space, start over
+  if (bus->jit_used + JIT_BLOCK_MAX > SM83_JIT_SIZE) {
+    for (unsigned i = 0; i < SM83_BLOCKS; i++) {
+      bus->blocks[i].native = NULL;
+      bus->blocks[i].hits = 0;
+    }
+    bus->jit_used = 0;
+  }
+
+  uint8_t *const start = bus->jit_code + bus->jit_used;
+  uint8_t *at = start;
+  uint8_t *fixups[SM83_BLOCK_OPS * 9];
+  unsigned fixup_ops[SM83_BLOCK_OPS * 9], fixup_count = 0;
+  uint16_t pcs[SM83_BLOCK_OPS], nexts[SM83_BLOCK_OPS]; // Where each instruction is, and PC after it unless a handler set it
+  uint8_t called[SM83_BLOCK_OPS];
+  uint8_t *slows[SM83_BLOCK_OPS], *resumes[SM83_BLOCK_OPS]; // Reads' jumps to their handler, and where it comes back to
+  unsigned slow_ops[SM83_BLOCK_OPS], slow_count = 0;
+
+  const uint32_t block_page = (uint32_t)(offsetof(SM83, blocks) + (size_t)(block - bus->blocks) * sizeof(SM83Block) + offsetof(SM83Block, page));
+  const uint32_t block_ops = block_page - (uint32_t)offsetof(SM83Block, page) + (uint32_t)offsetof(SM83Block, ops);
+  const uint32_t map_page = (uint32_t)(offsetof(SM83, read_map) + (size_t)(block->pc >> 8) * sizeof(bus->read_map[0]));
+  uint16_t pc = block->pc;
+
+  EMIT(0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx; push r12; push r13; push r14; push r15
+  EMIT(0x49, 0x89, 0xFF); // mov r15, rdi
+  EMIT(0x45, 0x31, 0xE4); // xor r12d, r12d
+  EMIT(0x49, 0x89, 0xF5); // mov r13, rsi
+  EMIT(0x4D, 0x8B, 0xB7); EMIT32(offsetof(SM83, bus)); // mov r14, [r15 + bus]
+  EMIT_REGISTERS(0x8B);
+
+  for (unsigned i = 0; i < block->count; i++) {
+    const SM83BlockOp *op = &block->ops[i];
+    const uint8_t opcode = op->size == 1 ? (uint8_t)(op->instruction - instructions) : 0xCB;
+    const unsigned dst = (opcode >> 3) & 7, src = opcode & 7;
+    const uint8_t cb = op->size == 2 ? (uint8_t)(op->instruction - cb_instructions) : 0x36; // 0x36 is SWAP [HL]
+    const uint8_t target = jit_registers[cb & 7]; // CB-prefixed ones' register
+    const int conditional = op->size == 1 && jit_conditional(opcode);
+    uint16_t next = (uint16_t)(pc + (op->size == 1 ? op->instruction->length : 2));
+    int call = 0;
+
+    // Reading memory and nothing else, through BC, DE or HL (1 to 3, as cx, dx, bx)
+    unsigned read = 0;
+    if ((opcode & 0xC7) == 0x46 && dst != 6) read = 3; // LD r, [HL]
+    else if ((opcode & 0xCF) == 0x0A) read = opcode == 0x0A ? 1 : opcode == 0x1A ? 2 : 3; // LD A, [BC], [DE], [HL+], [HL-]
+#ifndef SM83_LAZY_FLAGS
+    else if (opcode >= 0x80 && opcode < 0xC0 && src == 6) read = 3; // ALU A, [HL]
+#endif
+
+    if (!conditional) EMIT_TICKS();
+
+    if (read) {
+      // Straight from a mapped page, through the handler otherwise (see below)
+      EMIT(0x0F, 0xB6, (uint8_t)(0xF4 + read)); // movzx esi, ch/dh/bh
+      EMIT(0x49, 0x8B, 0xB4, 0xF6); EMIT32(offsetof(SM83, read_map)); // mov rsi, [r14 + rsi * 8 + read_map]
+      EMIT(0x48, 0x85, 0xF6); // test rsi, rsi
+      EMIT(0x0F, 0x84); // jz handler
+      slows[slow_count] = at;
+      slow_ops[slow_count] = i;
+      EMIT32(0);
+      EMIT(0x0F, 0xB6, (uint8_t)(0xF8 + read)); // movzx edi, cl/dl/bl
+#ifndef SM83_LAZY_FLAGS
+      if (opcode >= 0x80) {
+        if (dst == 1 || dst == 3) EMIT(0x0F, 0xBA, 0xE0, 0x04); // bt eax, 4
+        EMIT((uint8_t)(jit_alu[dst].code + 2), 0x24, 0x3E); // op ah, [rsi + rdi]
+        EMIT_FLAGS(jit_alu[dst].mask, jit_alu[dst].set, 0);
+      } else
+#endif
+      {
+        EMIT(0x8A, (uint8_t)(0x04 | jit_registers[opcode >= 0x40 ? dst : 7] << 3), 0x3E); // mov r, [rsi + rdi]
+        if (opcode == 0x2A || opcode == 0x3A) EMIT(0x66, 0xFF, opcode == 0x2A ? 0xC3 : 0xCB); // inc/dec bx
+      }
+      resumes[slow_count++] = at;
+    } else if (opcode == 0x00) { // NOP
+    } else if (opcode >= 0x40 && opcode < 0x80 && dst != 6 && src != 6) { // LD r, r'
+      EMIT(0x88, (uint8_t)(0xC0 | jit_registers[src] << 3 | jit_registers[dst])); // mov dst, src
+    } else if ((opcode & 0xC7) == 0x06 && dst != 6) { // LD r, n
+      EMIT((uint8_t)(0xB0 + jit_registers[dst]), op->operands[0]); // mov r, n
+    } else if ((opcode & 0xCF) == 0x01) { // LD rr, nn
+      if (opcode == 0x31) { EMIT(0x66, 0x41, 0xC7, 0x87); EMIT32(offsetof(SM83, sp)); } // mov word [r15 + sp], nn
+      else EMIT(0x66, (uint8_t)(0xB9 + (opcode >> 4))); // mov cx/dx/bx, nn
+      EMIT(op->operands[0], op->operands[1]);
+    } else if ((opcode & 0xC7) == 0x03) { // INC rr, DEC rr
+      if (opcode >> 4 == 3) { EMIT(0x66, 0x41, 0xFF, (opcode & 0x08) ? 0x8F : 0x87); EMIT32(offsetof(SM83, sp)); } // inc/dec word [r15 + sp]
+      else EMIT(0x66, 0xFF, (uint8_t)(((opcode & 0x08) ? 0xC9 : 0xC1) + (opcode >> 4))); // inc/dec cx/dx/bx
+    } else if ((cb & 7) != 6 && cb >= 0x80) { // RES b, r and SET b, r
+      const uint8_t bit = (uint8_t)(1 << ((cb >> 3) & 7));
+      if (cb < 0xC0) EMIT(0x80, (uint8_t)(0xE0 | target), (uint8_t)~bit) // and r, ~bit
+      else EMIT(0x80, (uint8_t)(0xC8 | target), bit); // or r, bit
+#ifndef SM83_LAZY_FLAGS
+    // F is built right away, lazily evaluated flags would have it some other way
+    } else if ((opcode & 0xC6) == 0x04 && dst != 6) { // INC r, DEC r
+      EMIT(0xFE, (uint8_t)(((opcode & 1) ? 0xC8 : 0xC0) | jit_registers[dst])); // inc/dec r
+      EMIT_FLAGS(0x50, (opcode & 1) ? 0x40 : 0x00, 1);
+    } else if ((opcode >= 0x80 && opcode < 0xC0) || (opcode & 0xC7) == 0xC6) { // ALU A, r and ALU A, n
+      if (dst == 1 || dst == 3) EMIT(0x0F, 0xBA, 0xE0, 0x04); // bt eax, 4 (C into CF for ADC and SBC)
+      if (opcode < 0xC0) EMIT(jit_alu[dst].code, (uint8_t)(0xC4 | jit_registers[src] << 3)) // op ah, r
+      else EMIT(0x80, (uint8_t)(0xC4 | jit_alu[dst].digit << 3), op->operands[0]); // op ah, n
+      EMIT_FLAGS(jit_alu[dst].mask, jit_alu[dst].set, 0);
+    } else if ((cb & 7) != 6 && cb >= 0x40) { // BIT b, r
+      EMIT(0xF6, (uint8_t)(0xC0 | target), (uint8_t)(1 << ((cb >> 3) & 7))); // test r, bit
+      EMIT_FLAGS(0x40, 0x20, 1);
+    } else if ((cb & 7) != 6 && cb >= 0x20) { // SLA, SRA, SWAP, SRL r (x86 rotates leave ZF alone, RLC and the rest stay handlers)
+      if (cb >> 3 == 6) {
+        EMIT(0xC0, (uint8_t)(0xC0 | target), 0x04, 0x84, (uint8_t)(0xC0 | target << 3 | target)); // rol r, 4; test r, r
+        EMIT_FLAGS(0x40, 0x00, 0);
+      } else {
+        EMIT(0xD0, (uint8_t)((cb >> 3 == 4 ? 0xE0 : cb >> 3 == 5 ? 0xF8 : 0xE8) | target)); // shl/sar/shr r, 1
+        EMIT_FLAGS(0x41, 0x00, 0);
+      }
+#endif
+    } else if (opcode == 0xC3) { // JP nn
+      next = (uint16_t)(op->operands[1] << 8 | op->operands[0]);
+    } else if (opcode == 0x18) { // JR e
+      next = (uint16_t)(next + (int8_t)op->operands[0]);
+    } else {
+      call = 1;
+    }
+
+    if (call) {
+      if (conditional) { EMIT(0x41, 0xC6, 0x87); EMIT32(offsetof(SM83, t)); EMIT(0x00); } // mov byte [r15 + t], 0
+      EMIT_HANDLER(i, pc);
+      if (conditional) {
+        EMIT(0x41, 0x0F, 0xB6, 0xB7); EMIT32(offsetof(SM83, t)); // movzx esi, byte [r15 + t]
+        EMIT(0x49, 0x01, 0xF4); // add r12, rsi
+        EMIT_TICKS();
+      }
+    }
+
+    pcs[i] = pc;
+    nexts[i] = next;
+    called[i] = (uint8_t)call;
+    pc = next;
+
+    if (i + 1 == block->count) break;
+
+    if (call) EMIT_PAGE_CHECK();
+    // The block may also have been entered right as EI's delay ran out, with one pending
+    if (call || i == 0) EMIT_SERVICE_CHECK();
+
+    EMIT(0x4D, 0x39, 0xEC); // cmp r12, r13
+    EMIT_EXIT_IF(0x83); // jae
+  }
+
+  // One exit per instruction, for PC and cpu->instruction. The last one falls through from
+  // the block, writes the registers back and returns, the rest jump to that
+  uint8_t *exits[SM83_BLOCK_OPS];
+  uint8_t *epilogue = NULL;
+
+  for (unsigned n = block->count; n-- > 0;) {
+    exits[n] = at;
+    if (!called[n]) { EMIT(0x66, 0x41, 0xC7, 0x87); EMIT32(offsetof(SM83, pc)); EMIT16(nexts[n]); } // mov word [r15 + pc], next
+    EMIT(0x48, 0xBE); EMIT64((uintptr_t)block->ops[n].instruction); // mov rsi, instruction
+    EMIT(0x49, 0x89, 0xB7); EMIT32(offsetof(SM83, instruction)); // mov [r15 + instruction], rsi
+
+    if (!epilogue) {
+      epilogue = at;
+      EMIT_REGISTERS(0x89);
+      EMIT(0x4C, 0x89, 0xE0); // mov rax, r12
+      EMIT(0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3); // pop r15; pop r14; pop r13; pop r12; pop rbx; ret
+    } else {
+      EMIT(0xE9); EMIT32(epilogue - (at + 4)); // jmp epilogue
+    }
+  }
+
+  // Reads from unmapped pages go through the handler, which may have the callbacks do anything
+  for (unsigned n = 0; n < slow_count; n++) {
+    const unsigned i = slow_ops[n];
+    const int32_t rel = (int32_t)(at - (slows[n] + 4));
+    memcpy(slows[n], &rel, 4);
+
+    EMIT_HANDLER(i, pcs[i]);
+    if (i + 1 < block->count) {
+      EMIT_PAGE_CHECK();
+      EMIT_SERVICE_CHECK();
+    }
+    EMIT(0xE9); EMIT32(resumes[n] - (at + 4)); // jmp back
+  }
+
+  for (unsigned n = 0; n < fixup_count; n++) {
+    const int32_t rel = (int32_t)(exits[fixup_ops[n]] - (fixups[n] + 4));
+    memcpy(fixups[n], &rel, 4);
+  }
+
+  bus->jit_used += (size_t)(at - start);
+  if (mprotect(bus->jit_code, SM83_JIT_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    jit_disable(bus);
+    return;
+  }
+  memcpy(&block->native, &start, sizeof(start));
+}
+
+#undef EMIT
+#undef EMIT16
+#undef EMIT32
+#undef EMIT64
+#undef EMIT_EXIT_IF
+#undef EMIT_REGISTERS
+#undef EMIT_FLAGS
+#undef EMIT_TICKS
+#undef EMIT_HANDLER
+#undef EMIT_PAGE_CHECK
+#undef EMIT_SERVICE_CHECK
+#endif
+
+static uint64_t run_blocks(SM83 *cpu, uint64_t cycles) {
+  SM83 *bus = cpu->bus;
+  uint64_t elapsed = 0;
+
+  while (elapsed < cycles) {
+    if (needs_service(cpu)) {
+      const uint8_t ticks = service(cpu);
+      if (ticks) {
+        elapsed += cpu->halted ? halt_skip(elapsed, cycles) : ticks;
+        continue;
+      }
+    }
+
+    const uint16_t pc = cpu->pc;
+    const uint8_t *page = bus->read_map[pc >> 8];
+    SM83Block *block = page ? block_find(bus, page, pc) : NULL;
+
+    // Unmapped (or undecodable) code goes one instruction at a time
+    if (!block || !block->page) {
+      TRACE(cpu, elapsed);
+      elapsed += execute(cpu);
+      continue;
+    }
+
+#ifdef SM83_JIT
+    if (!block->native && ++block->hits > SM83_JIT_THRESHOLD) jit_compile(bus, block);
+
+    // Compiled blocks don't stop for the trace
+    if (block->native && !TRACING(cpu)) {
+      elapsed += block->native(cpu, cycles - elapsed);
+      cpu->operands = NULL;
+      continue;
+    }
+#endif
+
+    // Most blocks fit in what's left, and only their memory accesses need checking after
+    const int bounded = cycles - elapsed < block->ticks;
+    const SM83BlockOp *op = block->ops, *end = op + block->count;
+    while (op < end) {
+      TRACE(cpu, elapsed);
+      cpu->pc = (uint16_t)(cpu->pc + op->size);
+      cpu->operands = op->operands;
+      cpu->t = 0;
+      op->exec(cpu);
+
+      cpu->t = (uint8_t)(cpu->t + op->ticks);
+      COUNT_OPCODE(cpu, op->instruction);
+      elapsed += cpu->t;
+
+      // Through memory the instruction may have written over the block itself, or switched
+      // its bank. Or written IE/IF, or be the one EI lets through, and an interrupt is due
+      // right away. Nothing else can change any of that
+      if ((bounded && elapsed >= cycles) || ((op->memory || op == block->ops) &&
+          (block->page != page || bus->read_map[pc >> 8] != page || needs_service(cpu)))) break;
+      op++;
+    }
+
+    cpu->instruction = (op < end ? op : end - 1)->instruction;
+    cpu->operands = NULL;
+  }
+
+  flags_sync(cpu);
+  return elapsed;
+}
+#endif
+
+uint8_t SM83_step(SM83 *cpu) {
+  uint8_t ticks = needs_service(cpu) ? service(cpu) : 0;
+
+  if (ticks) {
+    cpu->t = ticks;
+  } else {
+    TRACE(cpu, 0);
+    ticks = execute(cpu);
+  }
+
+  flags_sync(cpu);
+
+  cpu->bus->cycles += ticks;
+  events_run(cpu->bus);
+
+  return ticks;
+}
+
+// Runs straight through `cycles` T-cycles, with no events in between. The translation
+// unit holding the implementation may bring its own as SM83_RUN_SLICE (see tools/aot.c)
+static inline
+uint64_t run_slice(SM83 *cpu, uint64_t cycles) {
+#if defined(SM83_RUN_SLICE)
+  return SM83_RUN_SLICE(cpu, cycles);
+#elif defined(SM83_DISPATCH_SWITCH) || defined(SM83_DISPATCH_GOTO)
+  return run_dispatch(cpu, cycles);
+#elif defined(SM83_BLOCK_CACHE)
+  return run_blocks(cpu, cycles);
+#else
+  uint64_t elapsed = 0;
+
+  while (elapsed < cycles) {
+    if (needs_service(cpu)) {
+      const uint8_t ticks = service(cpu);
+      if (ticks) {
+        elapsed += cpu->halted ? halt_skip(elapsed, cycles) : ticks;
+        continue;
+      }
+    }
+
+    TRACE(cpu, elapsed);
+    elapsed += execute(cpu);
+  }
+
+  flags_sync(cpu);
+  return elapsed;
+#endif
+}
+
+uint64_t SM83_run(SM83 *cpu, uint64_t cycles) {
+  SM83 *bus = cpu->bus;
+  uint64_t elapsed = 0;
+
+  events_run(bus);
+
+  while (elapsed < cycles) {
+    // Up to the next deadline, which is always in the future once events_run is done
+    uint64_t slice = cycles - elapsed;
+    if (bus->event_count && bus->events[0].when - bus->cycles < slice) slice = bus->events[0].when - bus->cycles;
+
+    const uint64_t ran = run_slice(cpu, slice);
+    elapsed += ran;
+    bus->cycles += ran;
+
+    events_run(bus);
+  }
+
+  // The whole budget has been accounted for, nothing left to count down
+  cpu->t = 0;
+
+  return elapsed;
+}
+
+void SM83_tick(SM83 *cpu) {
+  if (cpu->t > 0) { cpu->t--; return; }
+
+  SM83_step(cpu);
+}
+
+#ifdef SM83_OPCODE_COUNTS
+static int opcode_count_compare(const void *a, const void *b) {
+  const SM83OpcodeCount *x = (const SM83OpcodeCount *)a, *y = (const SM83OpcodeCount *)b;
+  if (x->cycles != y->cycles) return x->cycles < y->cycles ? 1 : -1;
+  return x->opcode < y->opcode ? -1 : x->opcode > y->opcode;
+}
+#endif
+
+int SM83_trace(SM83 *cpu, void (*callback)(void *, const SM83TraceRecord *), void *data) {
+#ifdef SM83_TRACE
+  cpu->bus->trace = callback;
+  cpu->bus->trace_data = data;
+  return 0;
+#else
+  (void)cpu;
+  (void)callback;
+  (void)data;
+  return -1;
+#endif
+}
+
+size_t SM83_opcode_counts(const SM83 *cpu, SM83OpcodeCount counts[0x200]) {
+  size_t count = 0;
+
+#ifdef SM83_OPCODE_COUNTS
+  const SM83 *bus = cpu->bus;
+
+  for (unsigned index = 0; index < 0x200; index++) {
+    SM83OpcodeCount *entry = &counts[count];
+    entry->opcode = (uint16_t)(index < 0x100 ? index : 0xCB00 | (index & 0xFF));
+    entry->mnemonic = index < 0x100 ? instructions[index].mnemonic : cb_instructions[index & 0xFF].mnemonic;
+    entry->runs = entry->cycles = 0;
+
+    for (unsigned m = 0; m < 7; m++) {
+      entry->histogram[m] = bus->opcode_runs[index][m];
+      entry->runs += entry->histogram[m];
+      entry->cycles += entry->histogram[m] * m * 4;
+    }
+
+    if (entry->runs) count++;
+  }
+
+  qsort(counts, count, sizeof(SM83OpcodeCount), opcode_count_compare);
+#else
+  (void)cpu;
+  (void)counts;
+#endif
+
+  return count;
+}
+
+void SM83_clear_opcode_counts(SM83 *cpu) {
+#ifdef SM83_OPCODE_COUNTS
+  memset(cpu->bus->opcode_runs, 0, sizeof(cpu->bus->opcode_runs));
+#else
+  (void)cpu;
+#endif
+}
+
+void SM83_profile_init(SM83Profile *profile, uint32_t interval) {
+  memset(profile, 0, sizeof(*profile));
+  profile->interval = interval ? interval : 1;
+  profile->bank = 1;
+
+  // The root stands for whatever runs outside the calls seen so far
+  profile->nodes[0].key = UINT32_MAX;
+  profile->functions[0] = UINT32_MAX;
+  profile->node_count = 1;
+  profile->function_count = 1;
+}
+
+static int profile_symbol_compare(const void *a, const void *b) {
+  const SM83ProfileSymbol *x = (const SM83ProfileSymbol *)a, *y = (const SM83ProfileSymbol *)b;
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// Hex digits at `*at`, advanced past them. -1 if there are none
+static long profile_hex(const char **at, const char *end) {
+  long value = -1;
+  for (; *at < end; (*at)++) {
+    const char c = **at;
+    const int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    if (digit < 0 || value > 0xFFFF) break;
+    value = (value < 0 ? 0 : value << 4) | digit;
+  }
+  return value;
+}
+
+unsigned SM83_profile_symbols(SM83Profile *profile, const char *text, size_t size) {
+  const char *at = text, *const end = text + size;
+  unsigned added = 0;
+
+  while (at < end && profile->symbol_count < SM83_PROFILE_SYMBOLS) {
+    const char *line = at;
+    while (at < end && *at != '\n') at++;
+    const char *const eol = at;
+    if (at < end) at++;
+
+    while (line < eol && (*line == ' ' || *line == '\t')) line++;
+    const long bank = profile_hex(&line, eol);
+    if (bank < 0 || line == eol || *line++ != ':') continue;
+    const long addr = profile_hex(&line, eol);
+    if (addr < 0 || addr > 0xFFFF || line == eol || (*line != ' ' && *line != '\t')) continue;
+
+    while (line < eol && (*line == ' ' || *line == '\t')) line++;
+    const char *name = line;
+    while (line < eol && *line != ' ' && *line != '\t' && *line != '\r' && *line != ';') line++;
+    if (line == name) continue;
+
+    SM83ProfileSymbol *symbol = &profile->symbols[profile->symbol_count++];
+    symbol->key = (addr >= 0x4000 && addr < 0x8000) ? (uint32_t)bank << 16 | (uint32_t)addr : (uint32_t)addr;
+    symbol->length = (uint16_t)((size_t)(line - name) < UINT16_MAX ? (size_t)(line - name) : UINT16_MAX);
+    symbol->name = name;
+    added++;
+  }
+
+  qsort(profile->symbols, profile->symbol_count, sizeof(SM83ProfileSymbol), profile_symbol_compare);
+  return added;
+}
+
+// The symbol `key` is at or, unless `exact`, the closest one before it in the same bank
+// and 16 KiB region. NULL if none
+static const SM83ProfileSymbol *profile_symbol(const SM83Profile *profile, uint32_t key, int exact) {
+  size_t low = 0, high = profile->symbol_count;
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    if (profile->symbols[middle].key <= key) low = middle + 1; else high = middle;
+  }
+
+  if (!low) return NULL;
+  const SM83ProfileSymbol *symbol = &profile->symbols[low - 1];
+  if (exact ? symbol->key != key : (symbol->key ^ key) >> 14) return NULL;
+  return symbol;
+}
+
+#ifdef SM83_PROFILE
+static void profile_sample(SM83 *cpu, void *data, uint64_t when) {
+  SM83Profile *profile = (SM83Profile *)data;
+  uint16_t node = profile->node;
+
+  // Code reached without a call (JP, falling through) shows up under the symbol PC is in
+  const SM83ProfileSymbol *symbol = profile_symbol(profile, profile_key(profile, cpu->pc), 0);
+  if (symbol && symbol->key != profile->nodes[node].key) node = profile_child(profile, node, symbol->key);
+
+  profile->nodes[node].samples++;
+  SM83_schedule(cpu, when + profile->interval, profile_sample, profile);
+}
+
+#endif
+
+int SM83_profile_start(SM83 *cpu, SM83Profile *profile) {
+#ifdef SM83_PROFILE
+  SM83 *bus = cpu->bus;
+  if (SM83_schedule(bus, bus->cycles + profile->interval, profile_sample, profile) < 0) return -1;
+
+  bus->profile = profile;
+  profile->node = 0;
+  profile->depth = 0;
+  return 0;
+#else
+  (void)cpu;
+  (void)profile;
+  return -1;
+#endif
+}
+
+void SM83_profile_stop(SM83 *cpu) {
+#ifdef SM83_PROFILE
+  SM83 *bus = cpu->bus;
+  if (!bus->profile) return;
+
+  SM83_cancel(bus, profile_sample, bus->profile);
+  bus->profile = NULL;
+#else
+  (void)cpu;
+#endif
+}
+
+// Name of a function into `name`, which holds 64 bytes. Returns its length
+static size_t profile_name(const SM83Profile *profile, uint32_t key, char *name) {
+  static const char digits[] = "0123456789ABCDEF";
+
+  if (key == UINT32_MAX) {
+    memcpy(name, "root", 5);
+    return 4;
+  }
+
+  const SM83ProfileSymbol *symbol = profile_symbol(profile, key, 1);
+  if (symbol) {
+    const size_t length = symbol->length < 63 ? symbol->length : 63;
+    memcpy(name, symbol->name, length);
+    name[length] = '\0';
+    return length;
+  }
+
+  const char hex[] = {
+    digits[(key >> 20) & 0xF], digits[(key >> 16) & 0xF], ':',
+    digits[(key >> 12) & 0xF], digits[(key >> 8) & 0xF], digits[(key >> 4) & 0xF], digits[key & 0xF], '\0',
+  };
+  memcpy(name, hex, sizeof(hex));
+  return sizeof(hex) - 1;
+}
+
+static void profile_append(char *out, size_t size, size_t *length, const char *text, size_t count) {
+  if (*length < size) memcpy(out + *length, text, count < size - *length ? count : size - *length);
+  *length += count;
+}
+
+size_t SM83_profile_folded(const SM83Profile *profile, char *out, size_t size) {
+  size_t length = 0;
+
+  for (unsigned i = 0; i < profile->node_count; i++) {
+    if (!profile->nodes[i].samples) continue;
+
+    // From the root down, the tree is at most as deep as the stack, plus the symbol of PC
+    uint16_t path[SM83_PROFILE_DEPTH + 2];
+    unsigned depth = 0;
+    for (uint16_t node = (uint16_t)i; node && depth < SM83_PROFILE_DEPTH + 1; node = profile->nodes[node].parent) path[depth++] = node;
+    path[depth++] = 0;
+
+    while (depth--) {
+      char name[64];
+      const size_t name_length = profile_name(profile, profile->nodes[path[depth]].key, name);
+      profile_append(out, size, &length, name, name_length);
+      profile_append(out, size, &length, depth ? ";" : " ", 1);
+    }
+
+    char number[24];
+    size_t at = sizeof(number);
+    uint64_t cycles = profile->nodes[i].samples * profile->interval;
+    number[--at] = '\n';
+    do { number[--at] = (char)('0' + cycles % 10); cycles /= 10; } while (cycles);
+    profile_append(out, size, &length, number + at, sizeof(number) - at);
+  }
+
+  if (size) out[length < size ? length : size - 1] = '\0';
+  return length;
+}
+
+static int profile_function_compare(const void *a, const void *b) {
+  const SM83ProfileFunction *x = (const SM83ProfileFunction *)a, *y = (const SM83ProfileFunction *)b;
+  if (x->inclusive != y->inclusive) return x->inclusive < y->inclusive ? 1 : -1;
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+size_t SM83_profile_functions(const SM83Profile *profile, SM83ProfileFunction functions[SM83_PROFILE_NODES]) {
+  for (unsigned i = 0; i < profile->function_count; i++) {
+    functions[i].key = profile->functions[i];
+    profile_name(profile, profile->functions[i], functions[i].name);
+    functions[i].inclusive = functions[i].exclusive = 0;
+  }
+
+  for (unsigned i = 0; i < profile->node_count; i++) {
+    const SM83ProfileNode *sampled = &profile->nodes[i];
+    if (!sampled->samples) continue;
+
+    const uint64_t cycles = sampled->samples * profile->interval;
+    functions[sampled->function].exclusive += cycles;
+
+    // Recursive functions only count once
+    uint16_t seen[SM83_PROFILE_DEPTH + 2];
+    unsigned count = 0;
+    for (uint16_t node = (uint16_t)i;; node = profile->nodes[node].parent) {
+      const uint16_t function = profile->nodes[node].function;
+      unsigned j = 0;
+      while (j < count && seen[j] != function) j++;
+      if (j == count && count < SM83_PROFILE_DEPTH + 2) {
+        seen[count++] = function;
+        functions[function].inclusive += cycles;
+      }
+      if (!node) break;
+    }
+  }
+
+  // Functions made by the calls but never sampled go
+  size_t count = 0;
+  for (unsigned i = 0; i < profile->function_count; i++) {
+    if (functions[i].inclusive) functions[count++] = functions[i];
+  }
+
+  qsort(functions, count, sizeof(SM83ProfileFunction), profile_function_compare);
+  return count;
+}
+
+// Decodes the instruction at `offset`, returns its length
+static uint8_t disassemble_decode(const uint8_t *buffer, size_t size, size_t offset, uint16_t *opcode, uint16_t *operand) {
+  const uint8_t byte = buffer[offset];
+  uint8_t length = byte == 0xCB ? 2 : instructions[byte].length;
+  if (length > 3) length = 1; // INVALID
+
+  *operand = 0;
+  if (size - offset < length) {
+    *opcode = SM83_DISASSEMBLY_DATA;
+    *operand = byte;
+    return 1;
+  }
+
+  if (byte == 0xCB) {
+    *opcode = (uint16_t)(0xCB00 | buffer[offset + 1]);
+  } else {
+    *opcode = byte;
+    if (length == 2) *operand = buffer[offset + 1];
+    if (length == 3) *operand = (uint16_t)(buffer[offset + 2] << 8 | buffer[offset + 1]);
+  }
+
+  return length;
+}
+
+// The mnemonic template with its %02X or %04X filled in
+static void disassemble_text(uint16_t opcode, uint16_t operand, char *out, size_t size) {
+  static const char digits[] = "0123456789ABCDEF";
+  const char *mnemonic = opcode == SM83_DISASSEMBLY_DATA ? "DB 0x%02X" :
+                         opcode > 0xFF ? cb_instructions[opcode & 0xFF].mnemonic : instructions[opcode].mnemonic;
+  size_t length = 0;
+
+  for (const char *c = mnemonic; *c && length + 5 < size; c++) {
+    if (c[0] == '%' && c[1] == '0' && (c[2] == '2' || c[2] == '4') && c[3] == 'X') {
+      for (unsigned count = c[2] == '4' ? 4 : 2; count--;) out[length++] = digits[(operand >> (count * 4)) & 0xF];
+      c += 3;
+    } else {
+      out[length++] = *c;
+    }
+  }
+
+  out[length] = '\0';
+}
+
+void SM83_disassemble(const uint8_t *buffer, size_t size, uint16_t base,
+                      void (*callback)(void *, const SM83Disassembly *), void *data) {
+  SM83Disassembly instruction;
+
+  for (size_t offset = 0; offset < size; offset += instruction.length) {
+    instruction.offset = offset;
+    instruction.addr = (uint16_t)(base + offset);
+    instruction.length = disassemble_decode(buffer, size, offset, &instruction.opcode, &instruction.operand);
+    disassemble_text(instruction.opcode, instruction.operand, instruction.text, sizeof(instruction.text));
+    callback(data, &instruction);
+  }
+}
+
+size_t SM83_disassemble_index(const uint8_t *buffer, size_t size, SM83IndexEntry *index) {
+  size_t count = 0;
+
+  for (size_t offset = 0; offset < size;) {
+    SM83IndexEntry *entry = &index[count++];
+    entry->offset = (uint32_t)offset;
+    offset += disassemble_decode(buffer, size, offset, &entry->opcode, &entry->operand);
+  }
+
+  return count;
+}
+
+size_t SM83_state_size(const SM83Region *regions, size_t count) {
+  size_t size = sizeof(SM83State);
+  for (size_t i = 0; i < count; i++) size += regions[i].size;
+  return size;
+}
+
+size_t SM83_save_state(const SM83 *cpu, void *buffer, size_t size, const SM83Region *regions, size_t count) {
+  const SM83 *bus = cpu->bus;
+  const size_t total = SM83_state_size(regions, count);
+  if (size < total || total - sizeof(SM83State) > UINT32_MAX) return 0;
+
+  SM83State state;
+  memset(&state, 0, sizeof(state));
+  state.magic = SM83_STATE_MAGIC;
+  state.version = SM83_STATE_VERSION;
+  state.size = sizeof(SM83State);
+  state.memory = (uint32_t)(total - sizeof(SM83State));
+
+  // F is up to date between calls, even with lazy flags
+  state.af = cpu->af;
+  state.bc = cpu->bc;
+  state.de = cpu->de;
+  state.hl = cpu->hl;
+  state.sp = cpu->sp;
+  state.pc = cpu->pc;
+  state.t = cpu->t;
+  state.ime = cpu->ime;
+  state.ime_delay = cpu->ime_delay;
+  state.halted = cpu->halted;
+  state.ie = bus->ie;
+  state.if_ = bus->if_;
+  state.cycles = bus->cycles;
+
+  uint8_t *out = (uint8_t *)buffer;
+  memcpy(out, &state, sizeof(state));
+  out += sizeof(state);
+
+  for (size_t i = 0; i < count; i++) {
+    if (regions[i].size) memcpy(out, regions[i].data, regions[i].size);
+    out += regions[i].size;
+  }
+
+  return total;
+}
+
+int SM83_load_state(SM83 *cpu, const void *buffer, size_t size, const SM83Region *regions, size_t count) {
+  SM83 *bus = cpu->bus;
+  const size_t total = SM83_state_size(regions, count);
+  if (size < total) return -1;
+
+  SM83State state;
+  memcpy(&state, buffer, sizeof(state)); // `buffer` may not be aligned
+  if (state.magic != SM83_STATE_MAGIC || state.version != SM83_STATE_VERSION ||
+      state.size != sizeof(SM83State) || state.memory != total - sizeof(SM83State)) return -1;
+
+  cpu->af = state.af;
+  cpu->bc = state.bc;
+  cpu->de = state.de;
+  cpu->hl = state.hl;
+  cpu->sp = state.sp;
+  cpu->pc = state.pc;
+  cpu->t = state.t;
+  cpu->ime = state.ime;
+  cpu->ime_delay = state.ime_delay;
+  cpu->halted = state.halted;
+  bus->ie = state.ie;
+  bus->if_ = state.if_;
+  bus->cycles = state.cycles;
+
+  cpu->flags_op = FLAGS_NONE;
+
+  const uint8_t *in = (const uint8_t *)buffer + sizeof(state);
+  for (size_t i = 0; i < count; i++) {
+    if (regions[i].size) memcpy(regions[i].data, in, regions[i].size);
+    in += regions[i].size;
+  }
+
+#ifdef SM83_BLOCK_CACHE
+  // Code may have changed anywhere
+  cpu->operands = NULL;
+  for (unsigned i = 0; i < SM83_BLOCKS; i++) bus->blocks[i].page = NULL;
+  memset(bus->code, 0, sizeof(bus->code));
+#endif
+
+  return 0;
+}
+
+// Rewind helpers. Frames are encoded as tokens of [uint16 unchanged bytes][uint16 changed
+// bytes][the changed bytes XOR the base], a keyframe being the changes from all zeroes
+static inline
+uint8_t rewind_base(const uint8_t *base, size_t i) {
+  return base ? base[i] : 0;
+}
+
+static inline
+int rewind_same8(const uint8_t *data, const uint8_t *base, size_t i) {
+  uint64_t x, y = 0;
+  memcpy(&x, data + i, 8);
+  if (base) memcpy(&y, base + i, 8);
+  return x == y;
+}
+
+// Encodes `data` against `base` (NULL for a keyframe) into `out`, or only measures it if
+// `out` is NULL. Returns the encoded size
+static size_t rewind_encode(uint8_t *out, const uint8_t *data, const uint8_t *base, size_t size) {
+  size_t encoded = 0;
+  size_t i = 0;
+
+  while (i < size) {
+    size_t skip = 0;
+    while (i + skip + 8 <= size && skip + 8 <= 0xFFFF && rewind_same8(data, base, i + skip)) skip += 8;
+    while (i + skip < size && skip < 0xFFFF && data[i + skip] == rewind_base(base, i + skip)) skip++;
+    i += skip;
+
+    // Changed bytes, along with the short unchanged gaps a new token would cost more than
+    size_t length = 0;
+    while (i + length < size && length < 0xFFFF) {
+      if (data[i + length] != rewind_base(base, i + length)) { length++; continue; }
+
+      size_t same = 1;
+      while (same < 4 && i + length + same < size && data[i + length + same] == rewind_base(base, i + length + same)) same++;
+      if (same == 4 || i + length + same == size || length + same > 0xFFFF) break;
+      length += same;
+    }
+
+    if (out) {
+      const uint16_t token[2] = { (uint16_t)skip, (uint16_t)length };
+      memcpy(out + encoded, token, sizeof(token));
+      for (size_t k = 0; k < length; k++) out[encoded + 4 + k] = data[i + k] ^ rewind_base(base, i + k);
+    }
+
+    encoded += 4 + length;
+    i += length;
+  }
+
+  return encoded;
+}
+
+// XORs an encoded frame into `data`
+static void rewind_decode(uint8_t *data, const uint8_t *in, size_t size) {
+  const uint8_t *end = in + size;
+  size_t i = 0;
+
+  while (in < end) {
+    uint16_t token[2];
+    memcpy(token, in, sizeof(token));
+    in += sizeof(token);
+    i += token[0];
+
+    for (size_t k = 0; k < token[1]; k++) data[i + k] ^= in[k];
+    in += token[1];
+    i += token[1];
+  }
+}
+
+static inline
+SM83RewindFrame *rewind_frame(SM83Rewind *rewind, unsigned i) {
+  return &rewind->frames[(rewind->first + i) % SM83_REWIND_FRAMES];
+}
+
+// Drops the oldest frame, and the frames after it up to the next keyframe that can't be
+// decoded anymore without it
+static void rewind_drop(SM83Rewind *rewind) {
+  do {
+    rewind->first = (rewind->first + 1) % SM83_REWIND_FRAMES;
+    rewind->length--;
+  } while (rewind->length && !rewind_frame(rewind, 0)->key);
+}
+
+// Finds room for `size` bytes at the head of the ring, dropping the oldest frames in the way
+static int rewind_reserve(SM83Rewind *rewind, size_t size, size_t *offset) {
+  if (size > rewind->capacity) return -1;
+
+  if (rewind->length == SM83_REWIND_FRAMES) rewind_drop(rewind);
+  if (!rewind->length) rewind->head = 0;
+
+  size_t at = rewind->head;
+  if (at + size > rewind->capacity) {
+    // Starts over from the beginning, the frames between the head and the end are the oldest
+    while (rewind->length && rewind_frame(rewind, 0)->offset >= rewind->head) rewind_drop(rewind);
+    at = 0;
+  }
+
+  while (rewind->length) {
+    const SM83RewindFrame *oldest = rewind_frame(rewind, 0);
+    if (oldest->offset >= at + size || oldest->offset + oldest->size <= at) break;
+    rewind_drop(rewind);
+  }
+
+  *offset = at;
+  return 0;
+}
+
+int SM83_rewind_init(SM83Rewind *rewind, void *memory, size_t size,
+                     const SM83Region *regions, size_t count, unsigned interval) {
+  const size_t state_size = SM83_state_size(regions, count);
+  if (size < 2 * state_size) return -1;
+
+  rewind->regions = regions;
+  rewind->count = count;
+  rewind->state_size = state_size;
+  rewind->current = (uint8_t *)memory;
+  rewind->next = rewind->current + state_size;
+
+  rewind->data = rewind->next + state_size;
+  rewind->capacity = size - 2 * state_size;
+  rewind->head = 0;
+
+  rewind->first = 0;
+  rewind->length = 0;
+  rewind->interval = interval;
+  rewind->since_key = 0;
+
+  return 0;
+}
+
+int SM83_rewind_push(SM83Rewind *rewind, const SM83 *cpu) {
+  SM83_save_state(cpu, rewind->next, rewind->state_size, rewind->regions, rewind->count);
+
+  uint8_t key = !rewind->length || rewind->since_key + 1 >= rewind->interval;
+  size_t size = rewind_encode(NULL, rewind->next, key ? NULL : rewind->current, rewind->state_size);
+  size_t offset;
+  if (rewind_reserve(rewind, size, &offset)) return -1;
+
+  // Making room dropped the frame this one was relative to
+  if (!key && !rewind->length) {
+    key = 1;
+    size = rewind_encode(NULL, rewind->next, NULL, rewind->state_size);
+    if (rewind_reserve(rewind, size, &offset)) return -1;
+  }
+
+  rewind_encode(rewind->data + offset, rewind->next, key ? NULL : rewind->current, rewind->state_size);
+
+  SM83RewindFrame *frame = rewind_frame(rewind, rewind->length++);
+  frame->offset = offset;
+  frame->size = size;
+  frame->key = key;
+  rewind->head = offset + size;
+  rewind->since_key = key ? 0 : rewind->since_key + 1;
+
+  uint8_t *current = rewind->current;
+  rewind->current = rewind->next;
+  rewind->next = current;
+
+  return 0;
+}
+
+unsigned SM83_rewind(SM83Rewind *rewind, SM83 *cpu, unsigned frames) {
+  if (!rewind->length) return 0;
+  if (frames > rewind->length - 1) frames = rewind->length - 1;
+
+  const unsigned length = rewind->length - frames;
+  int key = 0;
+  for (unsigned i = length; i < rewind->length; i++) key |= rewind_frame(rewind, i)->key;
+
+  if (!key) {
+    // XOR is its own inverse, undo the newest frames one by one
+    for (unsigned i = rewind->length; i-- > length;) {
+      const SM83RewindFrame *frame = rewind_frame(rewind, i);
+      rewind_decode(rewind->current, rewind->data + frame->offset, frame->size);
+    }
+  } else {
+    // Decode forward from the last keyframe left
+    unsigned from = length - 1;
+    while (!rewind_frame(rewind, from)->key) from--;
+
+    memset(rewind->current, 0, rewind->state_size);
+    for (unsigned i = from; i < length; i++) {
+      const SM83RewindFrame *frame = rewind_frame(rewind, i);
+      rewind_decode(rewind->current, rewind->data + frame->offset, frame->size);
+    }
+  }
+
+  if (frames) rewind->head = rewind_frame(rewind, length)->offset;
+  rewind->length = length;
+
+  rewind->since_key = 0;
+  while (!rewind_frame(rewind, length - 1 - rewind->since_key)->key) rewind->since_key++;
+
+  SM83_load_state(cpu, rewind->current, rewind->state_size, rewind->regions, rewind->count);
+  return frames;
+}
+
+
+// Batch helpers
+#define BATCH_F 6
+
+static void batch_load(SM83Batch *batch, unsigned i) {
+  SM83 *cpu = &batch->cpus[i];
+  cpu->b = batch->r[0][i]; cpu->c = batch->r[1][i];
+  cpu->d = batch->r[2][i]; cpu->e = batch->r[3][i];
+  cpu->h = batch->r[4][i]; cpu->l = batch->r[5][i];
+  cpu->f = batch->r[BATCH_F][i]; cpu->a = batch->r[7][i];
+  cpu->sp = batch->sp[i];
+  cpu->pc = batch->pc[i];
+}
+
+static void batch_store(SM83Batch *batch, unsigned i) {
+  const SM83 *cpu = &batch->cpus[i];
+  batch->r[0][i] = cpu->b; batch->r[1][i] = cpu->c;
+  batch->r[2][i] = cpu->d; batch->r[3][i] = cpu->e;
+  batch->r[4][i] = cpu->h; batch->r[5][i] = cpu->l;
+  batch->r[BATCH_F][i] = cpu->f; batch->r[7][i] = cpu->a;
+  batch->sp[i] = cpu->sp;
+  batch->pc[i] = cpu->pc;
+}
+
+// Runs `body` for every lane the batch has room for, whether in use or not: with the count
+// fixed and the rows behind restrict pointers, compilers vectorize it without any runtime
+// checks, at -O2 already. Lanes not in use hold zeros nobody reads
+#define BATCH_LANES(body) \
+  for (unsigned i = 0; i < SM83_BATCH_LANES; i++) { body }
+
+// ALU A,r on every lane, `x` being the operation as opcodes number them (ADD, ADC, SUB,
+// SBC, AND, XOR, OR, CP). Flags come out as the interpreter's, but computed on bytes alone:
+// a carry out is the result wrapping past A, a half carry bit 4 of the nibbles' sum
+static void batch_alu(unsigned x, uint8_t *restrict a, uint8_t *restrict f, const uint8_t *restrict value) {
+  switch (x) {
+    case 0: case 1: // ADD, ADC
+      BATCH_LANES(
+        const uint8_t carry = x == 1 ? (f[i] >> FLAG_C) & 1 : 0;
+        const uint8_t result = (uint8_t)(a[i] + value[i] + carry);
+        const uint8_t c = (uint8_t)((result < a[i]) | ((result == a[i]) & carry));
+        const uint8_t h = (uint8_t)((((a[i] & 0x0F) + (value[i] & 0x0F) + carry) >> 4) & 1);
+        f[i] = (uint8_t)((f[i] & 0x0F) | (result == 0) << FLAG_Z | h << FLAG_H | c << FLAG_C);
+        a[i] = result;
+      )
+      break;
+    case 2: case 3: // SUB, SBC
+      BATCH_LANES(
+        const uint8_t carry = x == 3 ? (f[i] >> FLAG_C) & 1 : 0;
+        const uint8_t result = (uint8_t)(a[i] - value[i] - carry);
+        const uint8_t c = (uint8_t)((a[i] < value[i]) | ((a[i] == value[i]) & carry));
+        const uint8_t h = (uint8_t)((((a[i] & 0x0F) - (value[i] & 0x0F) - carry) >> 4) & 1);
+        f[i] = (uint8_t)((f[i] & 0x0F) | (result == 0) << FLAG_Z | 1 << FLAG_N | h << FLAG_H | c << FLAG_C);
+        a[i] = result;
+      )
+      break;
+    case 7: // CP, a SUB that leaves A alone
+      BATCH_LANES(
+        const uint8_t h = (uint8_t)((a[i] & 0x0F) < (value[i] & 0x0F));
+        f[i] = (uint8_t)((f[i] & 0x0F) | (a[i] == value[i]) << FLAG_Z | 1 << FLAG_N | h << FLAG_H |
+                         (a[i] < value[i]) << FLAG_C);
+      )
+      break;
+    case 4: // AND
+      BATCH_LANES(
+        a[i] &= value[i];
+        f[i] = (uint8_t)((f[i] & 0x0F) | (a[i] == 0) << FLAG_Z | 1 << FLAG_H);
+      )
+      break;
+    case 5: // XOR
+      BATCH_LANES(
+        a[i] ^= value[i];
+        f[i] = (uint8_t)((f[i] & 0x0F) | (a[i] == 0) << FLAG_Z);
+      )
+      break;
+    default: // OR
+      BATCH_LANES(
+        a[i] |= value[i];
+        f[i] = (uint8_t)((f[i] & 0x0F) | (a[i] == 0) << FLAG_Z);
+      )
+      break;
+  }
+}
+
+// INC r or DEC r on every lane, C left alone
+static void batch_incdec(int dec, uint8_t *restrict r, uint8_t *restrict f) {
+  if (!dec) {
+    BATCH_LANES(
+      r[i]++;
+      f[i] = (uint8_t)((f[i] & 0x1F) | (r[i] == 0) << FLAG_Z | ((r[i] & 0x0F) == 0x00) << FLAG_H);
+    )
+  } else {
+    BATCH_LANES(
+      r[i]--;
+      f[i] = (uint8_t)((f[i] & 0x1F) | (r[i] == 0) << FLAG_Z | 1 << FLAG_N | ((r[i] & 0x0F) == 0x0F) << FLAG_H);
+    )
+  }
+}
+
+// Runs `opcode` on every lane at once if it only involves registers (NOP, LD r,r', INC/DEC r
+// and ALU A,r). Returns 0 if it doesn't
+static int batch_execute(SM83Batch *batch, uint8_t opcode) {
+  const unsigned x = (opcode >> 3) & 7;
+  const unsigned y = opcode & 7;
+
+  if (opcode == 0x00) return 1;
+
+  // LD r,r'
+  if (opcode >= 0x40 && opcode < 0x80) {
+    if (x == 6 || y == 6) return 0;
+    if (x != y) memcpy(batch->r[x], batch->r[y], sizeof(batch->r[x]));
+    return 1;
+  }
+
+  // ALU A,r, from a copy since r may be A itself
+  if (opcode >= 0x80 && opcode < 0xC0) {
+    if (y == 6) return 0;
+    uint8_t value[SM83_BATCH_LANES];
+    memcpy(value, batch->r[y], sizeof(value));
+    batch_alu(x, batch->r[7], batch->r[BATCH_F], value);
+    return 1;
+  }
+
+  // INC r, DEC r
+  if (opcode < 0x40 && x != 6 && (y == 4 || y == 5)) {
+    batch_incdec(y == 5, batch->r[x], batch->r[BATCH_F]);
+    return 1;
+  }
+
+  return 0;
+}
+
+void SM83_batch_init(SM83Batch *batch, SM83 *cpus, unsigned lanes) {
+  batch->cpus = cpus;
+  batch->lanes = lanes < SM83_BATCH_LANES ? lanes : SM83_BATCH_LANES;
+  memset(batch->r, 0, sizeof(batch->r));
+
+  for (unsigned i = 0; i < batch->lanes; i++) {
+    flags_sync(&cpus[i]);
+    batch_store(batch, i);
+  }
+}
+
+void SM83_batch_sync(SM83Batch *batch) {
+  for (unsigned i = 0; i < batch->lanes; i++) batch_load(batch, i);
+}
+
+// Opcode every lane has at `pc`, or -1 if they don't agree
+static int batch_opcode(SM83Batch *batch, uint16_t pc) {
+  SM83 *first = &batch->cpus[0];
+  const uint8_t *page = first->bus->read_map[pc >> 8];
+  const uint8_t opcode = bus_read(first, pc);
+
+  for (unsigned i = 1; i < batch->lanes; i++) {
+    SM83 *cpu = &batch->cpus[i];
+    if (page && cpu->bus->read_map[pc >> 8] == page) continue; // Same ROM
+    if (bus_read(cpu, pc) != opcode) return -1;
+  }
+
+  return opcode;
+}
+
+// T-cycles every lane can run together from here, up to the first budget or deadline to
+// reach, or 0 if they can't: they are at different PCs or some need interrupts serviced
+static uint64_t batch_together(const SM83Batch *batch, const uint64_t *elapsed, uint64_t cycles) {
+  uint64_t slice = UINT64_MAX;
+
+  for (unsigned i = 0; i < batch->lanes; i++) {
+    const SM83 *cpu = &batch->cpus[i];
+    const SM83 *bus = cpu->bus;
+    if (batch->pc[i] != batch->pc[0] || elapsed[i] >= cycles || needs_service(cpu) || TRACING(cpu)) return 0;
+
+    if (cycles - elapsed[i] < slice) slice = cycles - elapsed[i];
+    if (bus->event_count && bus->events[0].when - bus->cycles < slice) slice = bus->events[0].when - bus->cycles;
+  }
+
+  return slice;
+}
+
+// Runs a single lane on its own for `cycles` T-cycles
+static uint64_t batch_run_lane(SM83Batch *batch, unsigned i, uint64_t cycles) {
+  batch_load(batch, i);
+  const uint64_t ran = SM83_run(&batch->cpus[i], cycles);
+  batch_store(batch, i);
+  return ran;
+}
+
+void SM83_batch_run(SM83Batch *batch, uint64_t cycles) {
+  const unsigned lanes = batch->lanes;
+  uint64_t elapsed[SM83_BATCH_LANES] = { 0 };
+  unsigned done = 0;
+
+  while (done < lanes) {
+    // Register-only instructions all lanes agree on run across them, with PC and the cycles
+    // kept once for all of them. Nothing else can happen to the lanes meanwhile
+    const uint64_t slice = batch_together(batch, elapsed, cycles);
+    uint16_t pc = batch->pc[0];
+    uint64_t ran = 0;
+    int opcode = 0;
+
+    while (ran < slice) {
+      opcode = batch_opcode(batch, pc);
+      if (opcode < 0 || !batch_execute(batch, (uint8_t)opcode)) break;
+      pc++;
+      ran += 4;
+
+#ifdef SM83_OPCODE_COUNTS
+      for (unsigned i = 0; i < lanes; i++) batch->cpus[i].bus->opcode_runs[opcode][1]++;
+#endif
+    }
+
+    if (ran) {
+      const SM83Instruction *instruction = &instructions[bus_read(&batch->cpus[0], (uint16_t)(pc - 1))];
+
+      for (unsigned i = 0; i < lanes; i++) {
+        SM83 *cpu = &batch->cpus[i];
+        SM83 *bus = cpu->bus;
+        batch->pc[i] = pc;
+        cpu->t = 0;
+        cpu->instruction = instruction;
+
+        bus->cycles += ran;
+        if (bus->event_count && bus->events[0].when <= bus->cycles) {
+          // Events may look at the registers
+          batch_load(batch, i);
+          events_run(bus);
+          batch_store(batch, i);
+        }
+
+        elapsed[i] += ran;
+        if (elapsed[i] >= cycles) done++;
+      }
+
+      continue;
+    }
+
+    // Otherwise each lane runs on its own, only through the next instruction if they are
+    // still together, for a while if they went separate ways
+    const uint64_t alone = slice ? 1 : SM83_BATCH_SLICE;
+
+    for (unsigned i = 0; i < lanes; i++) {
+      if (elapsed[i] >= cycles) continue;
+
+      elapsed[i] += batch_run_lane(batch, i, cycles - elapsed[i] < alone ? cycles - elapsed[i] : alone);
+      if (elapsed[i] >= cycles) done++;
+    }
+  }
+
 }
 
 #endif // SM83_IMPLEMENTATION
\ No newline at end of file
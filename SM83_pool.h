@@ -0,0 +1,232 @@
+#ifndef SM83_POOL_H_
+#define SM83_POOL_H_
+
+// Runs many independent instances across every host core. Same deal as SM83.h: include it
+// wherever needed, and once with SM83_POOL_IMPLEMENTATION defined (POSIX threads, link
+// with -pthread)
+
+#include "SM83.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runs each of `cpus[0..count)` for (at least) `cycles` T-cycles, as SM83_run would, on
+// `threads` threads (0 for one per core, the calling one included). Instances must not
+// share anything their callbacks write to. If `ran` isn't NULL, ran[i] gets the T-cycles
+// instance i actually ran
+void SM83_pool_run(SM83 *cpus, size_t count, uint64_t cycles, uint64_t *ran, unsigned threads);
+
+// Disassembles a whole ROM image, one 16 KiB bank at a time on `threads` threads (0 for one
+// per core): bank 0 as the CPU sees it at 0x0000, the others at 0x4000, so instructions
+// never cross banks. `callback(data, bank, instruction)` gets called from every thread at
+// once, but in order within a bank, with `instruction->offset` in the ROM
+void SM83_pool_disassemble(const uint8_t *rom, size_t size,
+                           void (*callback)(void *, size_t, const SM83Disassembly *), void *data, unsigned threads);
+
+// Same as SM83_disassemble_index over the whole ROM, bank by bank as above. `index` must
+// have room for `size` entries. Returns how many were written, in ROM order
+size_t SM83_pool_disassemble_index(const uint8_t *rom, size_t size, SM83IndexEntry *index, unsigned threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SM83_POOL_H_
+
+#ifdef SM83_POOL_IMPLEMENTATION
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Threads at most
+#ifndef SM83_POOL_THREADS
+#define SM83_POOL_THREADS 256
+#endif
+
+// Jobs still to run by one thread: it takes them from the front, and the others steal from
+// the back once they run out of their own, so that jobs that finish early (e.g. instances
+// halted for most of the budget) don't leave cores idle
+typedef struct SM83PoolQueue {
+  pthread_mutex_t lock;
+  size_t begin, end;
+} SM83PoolQueue;
+
+typedef struct SM83Pool {
+  void (*job)(void *, size_t); // (data, index)
+  void *data;
+
+  SM83PoolQueue queues[SM83_POOL_THREADS];
+  unsigned threads;
+} SM83Pool;
+
+typedef struct SM83PoolWorker {
+  SM83Pool *pool;
+  unsigned index;
+} SM83PoolWorker;
+
+// Takes the next job from the front (own queue) or the back (someone else's).
+// Returns 0 if the queue is empty
+static int pool_take(SM83PoolQueue *queue, int steal, size_t *job) {
+  int taken = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->begin < queue->end) {
+    *job = steal ? --queue->end : queue->begin++;
+    taken = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return taken;
+}
+
+static void *pool_work(void *data) {
+  const SM83PoolWorker *worker = (const SM83PoolWorker *)data;
+  SM83Pool *pool = worker->pool;
+  size_t job;
+
+  for (;;) {
+    int taken = pool_take(&pool->queues[worker->index], 0, &job);
+
+    // Every other queue, starting from the next one so that thieves spread out
+    for (unsigned i = 1; i < pool->threads && !taken; i++) {
+      taken = pool_take(&pool->queues[(worker->index + i) % pool->threads], 1, &job);
+    }
+
+    // Nothing left anywhere, and nothing gets added
+    if (!taken) break;
+
+    pool->job(pool->data, job);
+  }
+
+  return NULL;
+}
+
+// Runs `job(data, i)` for every i in [0, count) on `threads` threads
+static void pool_for(size_t count, unsigned threads, void (*job)(void *, size_t), void *data) {
+  SM83Pool pool;
+  pthread_t handles[SM83_POOL_THREADS];
+  SM83PoolWorker workers[SM83_POOL_THREADS];
+
+  if (!threads) {
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (unsigned)cores : 1;
+  }
+  if (threads > SM83_POOL_THREADS) threads = SM83_POOL_THREADS;
+  if (threads > count) threads = count ? (unsigned)count : 1;
+
+  pool.job = job;
+  pool.data = data;
+  pool.threads = threads;
+
+  // Contiguous shares to start with
+  for (unsigned i = 0; i < threads; i++) {
+    pthread_mutex_init(&pool.queues[i].lock, NULL);
+    pool.queues[i].begin = count * i / threads;
+    pool.queues[i].end = count * (i + 1) / threads;
+    workers[i].pool = &pool;
+    workers[i].index = i;
+  }
+
+  // The calling thread is worker 0, the shares of threads that fail to start get stolen
+  unsigned started = 1;
+  for (unsigned i = 1; i < threads; i++) {
+    if (pthread_create(&handles[i], NULL, pool_work, &workers[i]) == 0) {
+      handles[started++] = handles[i];
+    }
+  }
+
+  pool_work(&workers[0]);
+  for (unsigned i = 1; i < started; i++) pthread_join(handles[i], NULL);
+
+  for (unsigned i = 0; i < threads; i++) pthread_mutex_destroy(&pool.queues[i].lock);
+}
+
+typedef struct SM83PoolRun {
+  SM83 *cpus;
+  uint64_t cycles;
+  uint64_t *ran;
+} SM83PoolRun;
+
+static void pool_run_one(void *data, size_t instance) {
+  const SM83PoolRun *run = (const SM83PoolRun *)data;
+  const uint64_t ran = SM83_run(&run->cpus[instance], run->cycles);
+  if (run->ran) run->ran[instance] = ran;
+}
+
+void SM83_pool_run(SM83 *cpus, size_t count, uint64_t cycles, uint64_t *ran, unsigned threads) {
+  SM83PoolRun run = { cpus, cycles, ran };
+  pool_for(count, threads, pool_run_one, &run);
+}
+
+// ROM banks, as they get disassembled
+#define SM83_POOL_BANK 0x4000
+
+typedef struct SM83PoolDisassembly {
+  const uint8_t *rom;
+  size_t size;
+
+  void (*callback)(void *, size_t, const SM83Disassembly *);
+  void *data;
+
+  SM83IndexEntry *index;
+  size_t *counts; // Entries per bank
+} SM83PoolDisassembly;
+
+typedef struct SM83PoolBank {
+  const SM83PoolDisassembly *disassembly;
+  size_t bank;
+} SM83PoolBank;
+
+// Passes an instruction on with its offset in the ROM rather than in the bank
+static void pool_disassembled(void *data, const SM83Disassembly *instruction) {
+  const SM83PoolBank *bank = (const SM83PoolBank *)data;
+  SM83Disassembly moved = *instruction;
+  moved.offset += bank->bank * SM83_POOL_BANK;
+  bank->disassembly->callback(bank->disassembly->data, bank->bank, &moved);
+}
+
+static void pool_disassemble_bank(void *data, size_t bank) {
+  const SM83PoolDisassembly *disassembly = (const SM83PoolDisassembly *)data;
+  const size_t start = bank * SM83_POOL_BANK;
+  const size_t size = disassembly->size - start < SM83_POOL_BANK ? disassembly->size - start : SM83_POOL_BANK;
+  const uint16_t base = bank ? 0x4000 : 0x0000;
+
+  if (disassembly->index) {
+    // Into the bank's own share of the index, squeezed together afterwards
+    SM83IndexEntry *index = disassembly->index + start;
+    const size_t count = SM83_disassemble_index(disassembly->rom + start, size, index);
+    for (size_t i = 0; i < count; i++) index[i].offset += (uint32_t)start;
+    disassembly->counts[bank] = count;
+  } else {
+    SM83PoolBank context = { disassembly, bank };
+    SM83_disassemble(disassembly->rom + start, size, base, pool_disassembled, &context);
+  }
+}
+
+void SM83_pool_disassemble(const uint8_t *rom, size_t size,
+                           void (*callback)(void *, size_t, const SM83Disassembly *), void *data, unsigned threads) {
+  SM83PoolDisassembly disassembly = { rom, size, callback, data, NULL, NULL };
+  pool_for((size + SM83_POOL_BANK - 1) / SM83_POOL_BANK, threads, pool_disassemble_bank, &disassembly);
+}
+
+size_t SM83_pool_disassemble_index(const uint8_t *rom, size_t size, SM83IndexEntry *index, unsigned threads) {
+  const size_t banks = (size + SM83_POOL_BANK - 1) / SM83_POOL_BANK;
+  SM83PoolDisassembly disassembly = { rom, size, NULL, NULL, index, (size_t *)calloc(banks ? banks : 1, sizeof(size_t)) };
+  if (!disassembly.counts) return SM83_disassemble_index(rom, size, index); // One go, as a single bank
+
+  pool_for(banks, threads, pool_disassemble_bank, &disassembly);
+
+  size_t count = 0;
+  for (size_t bank = 0; bank < banks; bank++) {
+    memmove(index + count, index + bank * SM83_POOL_BANK, disassembly.counts[bank] * sizeof(SM83IndexEntry));
+    count += disassembly.counts[bank];
+  }
+
+  free(disassembly.counts);
+  return count;
+}
+
+#endif // SM83_POOL_IMPLEMENTATION
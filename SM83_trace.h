@@ -0,0 +1,206 @@
+#ifndef SM83_TRACE_H_
+#define SM83_TRACE_H_
+
+// Writes the trace of an instance (see SM83_trace) to a file from a thread of its own, so
+// that tracing costs the CPU little more than copying each record. Same deal as SM83.h:
+// include it wherever needed, and once with SM83_TRACE_IMPLEMENTATION defined (POSIX
+// threads, link with -pthread). The core must be built with SM83_TRACE
+//
+//   SM83TraceWriter *writer = SM83_trace_open("trace.bin", 1 << 20);
+//   SM83_trace(&cpu, SM83_trace_record, writer);
+//   ...
+//   SM83_trace(&cpu, NULL, NULL);
+//   SM83_trace_close(writer);
+
+#include "SM83.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The file is this header followed by every record, as they are
+#define SM83_TRACE_MAGIC "SM83TRC" // With its terminator, 8 bytes
+#define SM83_TRACE_VERSION 1
+
+typedef struct SM83TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size; // sizeof(SM83TraceRecord)
+} SM83TraceHeader;
+
+typedef struct SM83TraceWriter SM83TraceWriter;
+
+// Creates (or truncates) `path` and starts the thread writing to it, through a ring of
+// `records` records (rounded up to a power of two). NULL if any of that fails
+SM83TraceWriter *SM83_trace_open(const char *path, size_t records);
+
+// The callback for SM83_trace, `writer` being what SM83_trace_open returned. Only waits
+// for the thread when the ring is full, records are never dropped
+void SM83_trace_record(void *writer, const SM83TraceRecord *record);
+
+// Writes out whatever is left and closes the file. Returns 0, or -1 if any write failed
+int SM83_trace_close(SM83TraceWriter *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SM83_TRACE_H_
+
+#ifdef SM83_TRACE_IMPLEMENTATION
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Records the producer fills before making them visible to the thread, so that the index
+// both sides look at doesn't bounce between cores on every instruction
+#ifndef SM83_TRACE_PUBLISH
+#define SM83_TRACE_PUBLISH 256
+#endif
+
+// How long the thread sleeps when there's nothing to write
+#ifndef SM83_TRACE_IDLE_NS
+#define SM83_TRACE_IDLE_NS 1000000
+#endif
+
+// Single producer (the CPU), single consumer (the thread). `head` and `tail` only grow and
+// are taken modulo the capacity, each side only ever writes its own
+struct SM83TraceWriter {
+  SM83TraceRecord *records;
+  size_t mask;
+
+  _Alignas(64) size_t head; // Producer only, may be ahead of `published`
+  size_t tail_seen; // Producer's last look at `tail`
+  _Alignas(64) atomic_size_t published;
+  _Alignas(64) atomic_size_t tail;
+
+  atomic_int done;
+  int failed; // Thread only, until joined
+  int fd;
+  pthread_t thread;
+};
+
+// Writes all of `size` bytes, retrying short and interrupted writes. Returns 0, or -1
+static int trace_write(int fd, const void *data, size_t size) {
+  const char *at = (const char *)data;
+
+  while (size) {
+    const ssize_t written = write(fd, at, size);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return -1;
+    at += written;
+    size -= (size_t)written;
+  }
+
+  return 0;
+}
+
+static void *trace_drain(void *data) {
+  SM83TraceWriter *writer = (SM83TraceWriter *)data;
+  size_t tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+
+  for (;;) {
+    // Read before `published`, so that nothing published before the end gets missed
+    const int done = atomic_load_explicit(&writer->done, memory_order_acquire);
+    const size_t head = atomic_load_explicit(&writer->published, memory_order_acquire);
+
+    if (head == tail) {
+      if (done) break;
+      const struct timespec idle = { 0, SM83_TRACE_IDLE_NS };
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    // Everything there, in at most two writes when it wraps around
+    while (tail != head) {
+      const size_t start = tail & writer->mask;
+      size_t count = head - tail;
+      if (count > writer->mask + 1 - start) count = writer->mask + 1 - start;
+
+      if (!writer->failed && trace_write(writer->fd, &writer->records[start], count * sizeof(SM83TraceRecord)) < 0) {
+        writer->failed = 1;
+      }
+
+      tail += count;
+      atomic_store_explicit(&writer->tail, tail, memory_order_release);
+    }
+  }
+
+  return NULL;
+}
+
+SM83TraceWriter *SM83_trace_open(const char *path, size_t records) {
+  size_t capacity = SM83_TRACE_PUBLISH;
+  while (capacity < records) capacity <<= 1;
+
+  SM83TraceWriter *writer = (SM83TraceWriter *)calloc(1, sizeof(SM83TraceWriter));
+  if (!writer) return NULL;
+
+  writer->records = (SM83TraceRecord *)malloc(capacity * sizeof(SM83TraceRecord));
+  writer->mask = capacity - 1;
+  atomic_init(&writer->published, 0);
+  atomic_init(&writer->tail, 0);
+  atomic_init(&writer->done, 0);
+
+  writer->fd = writer->records ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+  if (writer->fd < 0) {
+    free(writer->records);
+    free(writer);
+    return NULL;
+  }
+
+  SM83TraceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SM83_TRACE_MAGIC, sizeof(header.magic));
+  header.version = SM83_TRACE_VERSION;
+  header.record_size = sizeof(SM83TraceRecord);
+
+  if (trace_write(writer->fd, &header, sizeof(header)) < 0 ||
+      pthread_create(&writer->thread, NULL, trace_drain, writer) != 0) {
+    close(writer->fd);
+    free(writer->records);
+    free(writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+void SM83_trace_record(void *data, const SM83TraceRecord *record) {
+  SM83TraceWriter *writer = (SM83TraceWriter *)data;
+
+  // Full as far as we know, look again and wait for the thread if it really is
+  while (writer->head - writer->tail_seen > writer->mask) {
+    writer->tail_seen = atomic_load_explicit(&writer->tail, memory_order_acquire);
+    if (writer->head - writer->tail_seen > writer->mask) sched_yield();
+  }
+
+  writer->records[writer->head & writer->mask] = *record;
+  writer->head++;
+
+  if (!(writer->head % SM83_TRACE_PUBLISH)) {
+    atomic_store_explicit(&writer->published, writer->head, memory_order_release);
+  }
+}
+
+int SM83_trace_close(SM83TraceWriter *writer) {
+  atomic_store_explicit(&writer->published, writer->head, memory_order_release);
+  atomic_store_explicit(&writer->done, 1, memory_order_release);
+  pthread_join(writer->thread, NULL);
+
+  int failed = writer->failed;
+  if (close(writer->fd) != 0) failed = 1;
+
+  free(writer->records);
+  free(writer);
+  return failed ? -1 : 0;
+}
+
+#endif // SM83_TRACE_IMPLEMENTATION
@@ -0,0 +1,183 @@
+// tools/aot against the interpreter (see `make test-aot`). Built with -DAOT_ROM it writes a
+// random ROM of four banks:
+//   aot_rom aot_rom.gb
+// which tools/aot translates into aot_rom.c; built along with that, SM83_run is the
+// translated code, and it must agree with SM83_step (the plain interpreter) at every stop
+// from random registers and interrupts, as in fuzz.c:
+//   aot_test [seeds] [first seed]
+#define _POSIX_C_SOURCE 200809L
+
+#include "SM83.h"
+
+#define ROM_SIZE 0x10000
+
+#ifdef AOT_ROM
+#include <stdio.h>
+
+// Opcodes tools/aot can't follow past (returns, JP HL, invalid ones), kept out of the random
+// bytes so that it finds more than the first few blocks
+static int dead_end(uint8_t byte) {
+  switch (byte) {
+    case 0xC9: case 0xD9: case 0xE9: case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4:
+    case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Random bytes, with what makes interrupts come and go or banks switch dropped all over:
+// EI, DI, RETI, HALT, writes to IE and IF, and writes selecting the bank at 0x4000
+int main(int argc, char **argv) {
+  static uint8_t rom[ROM_SIZE];
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s rom.gb\n", argv[0]);
+    return 2;
+  }
+
+  uint32_t random = 1;
+#define RANDOM() (random ^= random << 13, random ^= random >> 17, random ^= random << 5)
+  for (size_t i = 0; i < ROM_SIZE; i++) {
+    do rom[i] = (uint8_t)RANDOM(); while (dead_end(rom[i]));
+  }
+
+  for (unsigned i = 0; i < 0x1000; i++) {
+    const uint32_t r = RANDOM();
+    size_t at = (r >> 16) % (ROM_SIZE - 8);
+
+    switch ((r >> 4) % 8) {
+      case 0: rom[at] = 0xFB; break; // EI
+      case 1: rom[at] = 0xF3; break; // DI
+      case 2: rom[at] = 0xD9; break; // RETI
+      case 3: rom[at] = 0x76; break; // HALT
+      case 4: case 5: // LD A, n; LDH [IF or IE], A
+        rom[at++] = 0x3E; rom[at++] = (uint8_t)RANDOM();
+        rom[at++] = 0xE0; rom[at] = r & 0x100 ? 0xFF : 0x0F;
+        break;
+      default: // LD A, n; LD [0x2000], A
+        rom[at++] = 0x3E; rom[at++] = (uint8_t)RANDOM();
+        rom[at++] = 0xEA; rom[at++] = 0x00; rom[at] = 0x20;
+        break;
+    }
+  }
+#undef RANDOM
+
+  FILE *out = fopen(argv[1], "wb");
+  if (!out || fwrite(rom, 1, sizeof(rom), out) != sizeof(rom) || fclose(out) != 0) {
+    perror(argv[1]);
+    return 2;
+  }
+  return 0;
+}
+
+#else
+#include "machine.h"
+
+#define STOPS 100 // SM83_run calls per seed
+
+static uint8_t rom[ROM_SIZE];
+
+// A machine from machine.h, but with the ROM on its own and banked as an MBC1 would
+typedef struct Cart {
+  Machine machine;
+  uint8_t bank;
+} Cart;
+
+static uint8_t cart_read(void *userdata, uint16_t addr) {
+  return machine_read(&((Cart *)userdata)->machine, addr);
+}
+
+static void cart_write(void *userdata, uint16_t addr, uint8_t value) {
+  Cart *cart = (Cart *)userdata;
+  if (addr >= 0x8000) {
+    machine_write(&cart->machine, addr, value);
+  } else if (addr >= 0x2000 && addr < 0x4000) {
+    cart->bank = (uint8_t)(value & 3 ? value & 3 : 1);
+    SM83_map(&cart->machine.cpu, 0x4000, 0x4000, rom + cart->bank * 0x4000, NULL);
+  }
+}
+
+// Raises a random interrupt, then again a little later
+static void raise_interrupt(SM83 *cpu, void *data, uint64_t when) {
+  Machine *machine = (Machine *)data;
+  const uint32_t random = machine_random(machine);
+  SM83_interrupt(cpu, (uint8_t)(1 << (random % 5)));
+  SM83_schedule(cpu, when + 16 + (random >> 8) % 1024, raise_interrupt, machine);
+}
+
+static Cart *cart_boot(uint32_t seed) {
+  Cart *cart = (Cart *)malloc(sizeof(Cart));
+  if (!cart) { fprintf(stderr, "Out of memory\n"); exit(2); }
+
+  Machine *machine = &cart->machine;
+  SM83 *cpu = &machine->cpu;
+  memset(cpu, 0xAB, sizeof(*cpu));
+  memset(machine->memory, 0, sizeof(machine->memory));
+  machine->random = seed | 1;
+  cart->bank = 1;
+
+  SM83_init_userdata(cpu, cart_read, cart_write, cart);
+  SM83_map(cpu, 0x0000, 0x8000, rom, NULL);
+  SM83_map(cpu, 0x8000, 0x7F00, machine->memory + 0x8000, machine->memory + 0x8000);
+  SM83_reset(cpu);
+
+  uint32_t random = seed * 2654435761u | 1;
+  random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+  cpu->af = (uint16_t)(random & 0xFFF0);
+  cpu->bc = (uint16_t)(random >> 16);
+  cpu->de = (uint16_t)(random * 3);
+  cpu->hl = (uint16_t)(random >> 8);
+  cpu->sp = (uint16_t)(0xC000 + (seed * 40503u) % 0x2000);
+  cpu->pc = 0x0100;
+  cpu->ime = seed & 1;
+  cpu->ie = (uint8_t)((seed >> 1) & 0x1F);
+  SM83_schedule(cpu, 64, raise_interrupt, machine);
+  return cart;
+}
+
+static void compare(uint32_t seed) {
+  Cart *run = cart_boot(seed), *step = cart_boot(seed);
+  uint32_t random = seed | 1;
+
+  for (unsigned stop = 0; stop < STOPS; stop++) {
+    random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+    const uint64_t cycles = 1 + random % 400;
+
+    const uint64_t ran = SM83_run(&run->machine.cpu, cycles);
+    uint64_t stepped = 0;
+    while (stepped < cycles) stepped += SM83_step(&step->machine.cpu);
+
+    if (ran != stepped || run->bank != step->bank || !machine_equal(&run->machine, &step->machine)) {
+      fprintf(stderr, "aot: seed %u differs after %u stops: PC %04X, stepping %04X, cycles %llu, stepping %llu\n",
+              seed, stop + 1, run->machine.cpu.pc, step->machine.cpu.pc,
+              (unsigned long long)run->machine.cpu.cycles, (unsigned long long)step->machine.cpu.cycles);
+      failures++;
+      break;
+    }
+  }
+
+  SM83_free(&run->machine.cpu);
+  SM83_free(&step->machine.cpu);
+  free(run);
+  free(step);
+}
+
+int main(int argc, char **argv) {
+  const uint32_t seeds = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : 300;
+  const uint32_t first = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 1;
+
+  FILE *in = fopen("aot_rom.gb", "rb");
+  if (!in || fread(rom, 1, sizeof(rom), in) != sizeof(rom)) {
+    perror("aot_rom.gb");
+    return 2;
+  }
+  fclose(in);
+
+  current = "aot";
+  for (uint32_t seed = first; seed < first + seeds; seed++) compare(seed);
+
+  printf("aot: %u seeds, %u differ\n", seeds, failures);
+  return failures != 0;
+}
+
+#endif
@@ -0,0 +1,233 @@
+// Speed of every opcode and of a few instruction mixes, built once per dispatch mode (see `make bench`).
+// Prints a summary, and appends every measurement to the CSV file given as argument
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+#include "bench_alu.h"
+
+#if defined(SM83_JIT)
+#define MODE "jit"
+#elif defined(SM83_BLOCK_CACHE)
+#define MODE "blocks"
+#elif defined(SM83_DISPATCH_GOTO)
+#define MODE "goto"
+#elif defined(SM83_DISPATCH_SWITCH)
+#define MODE "switch"
+#else
+#define MODE "table"
+#endif
+
+#define OPCODE_CYCLES 1000000
+#define MIX_CYCLES 50000000
+#define CALIBRATION_CYCLES 100000
+#define RUNS 3
+
+#define CODE_SIZE 0x4000
+
+static uint8_t memory[0x10000];
+
+// Copies 2 KiB from 0xC000 to 0xD000 over and over
+static const uint8_t mix_memcpy[] = {
+  0x21, 0x00, 0xC0, // start: LD HL, 0xC000
+  0x11, 0x00, 0xD0, // LD DE, 0xD000
+  0x01, 0x00, 0x08, // LD BC, 0x0800
+  0x2A,             // loop: LD A, [HL+]
+  0x12,             // LD [DE], A
+  0x13,             // INC DE
+  0x0B,             // DEC BC
+  0x78,             // LD A, B
+  0xB1,             // OR C
+  0x20, 0xF8,       // JR NZ, loop
+  0x18, 0xED,       // JR start
+};
+
+// Immediates and CB-prefixed bit operations, the most decoding per instruction, at 0x0100
+static const uint8_t mix_bits[] = {
+  0x3E, 0x12,       // loop: LD A, 0x12
+  0xCB, 0x37,       // SWAP A
+  0xCB, 0x00,       // RLC B
+  0xCB, 0x5F,       // BIT 3, A
+  0xC6, 0x05,       // ADD A, 0x05
+  0xE6, 0x7F,       // AND 0x7F
+  0xCB, 0xC9,       // SET 1, C
+  0xCB, 0x3A,       // SRL D
+  0xEE, 0x55,       // XOR 0x55
+  0x1D,             // DEC E
+  0x20, 0xEB,       // JR NZ, loop
+  0x18, 0xE9,       // JR loop
+};
+
+// Two levels of calls, at 0x0100
+static const uint8_t mix_calls[] = {
+  0xCD, 0x10, 0x01, // loop: CALL first
+  0xCD, 0x10, 0x01, // CALL first
+  0x18, 0xF8,       // JR loop
+  0, 0, 0, 0, 0, 0, 0, 0,
+  0xCD, 0x20, 0x01, // first: CALL second
+  0xC9,             // RET
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0xC5,             // second: PUSH BC
+  0xC1,             // POP BC
+  0xC9,             // RET
+};
+
+static uint8_t discard_read(void *userdata, uint16_t addr) {
+  (void)userdata;
+  (void)addr;
+  return 0xFF;
+}
+
+static void discard_write(void *userdata, uint16_t addr, uint8_t value) {
+  (void)userdata;
+  (void)addr;
+  (void)value;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Code is read-only, so is RAM unless `writable`: every POP/RET then reads 0x0000, the start of the code
+static void setup(SM83 *cpu, uint16_t pc, int writable) {
+  SM83_init_userdata(cpu, discard_read, discard_write, NULL);
+  SM83_map(cpu, 0x0000, 0x8000, memory, NULL);
+  SM83_map(cpu, 0x8000, 0x8000, memory + 0x8000, writable ? memory + 0x8000 : NULL);
+  SM83_reset(cpu);
+
+  cpu->af = cpu->bc = cpu->de = 0;
+  cpu->hl = 0xC000;
+  cpu->sp = 0xFFFE;
+  cpu->pc = pc;
+}
+
+typedef struct Result {
+  uint64_t instructions, cycles;
+  double seconds;
+} Result;
+
+// Best of RUNS, the instructions are counted on a shorter run through SM83_step. Every run
+// has to end with the CPU awake and PC in [low, high), or what got measured isn't the code
+static Result measure(uint16_t pc, int writable, uint64_t budget, uint32_t low, uint32_t high) {
+  static uint8_t pristine[0x10000];
+  static SM83 cpu;
+  memcpy(pristine, memory, sizeof(memory));
+
+  setup(&cpu, pc, writable);
+  uint64_t steps = 0, stepped = 0;
+  while (stepped < CALIBRATION_CYCLES) { stepped += SM83_step(&cpu); steps++; }
+
+  Result best = { 0, 0, 0 };
+  for (int run = 0; run < RUNS; run++) {
+    memcpy(memory, pristine, sizeof(memory));
+    setup(&cpu, pc, writable);
+
+    const double start = now();
+    const uint64_t cycles = SM83_run(&cpu, budget);
+    const double seconds = now() - start;
+    SM83_free(&cpu);
+
+    if (cpu.halted || cpu.pc < low || cpu.pc >= high) {
+      fprintf(stderr, "%s: left the code, at %04X%s\n", MODE, cpu.pc, cpu.halted ? ", halted" : "");
+      exit(1);
+    }
+
+    if (!best.seconds || seconds < best.seconds) {
+      best.cycles = cycles;
+      best.seconds = seconds;
+      best.instructions = (uint64_t)((double)cycles * (double)steps / (double)stepped);
+    }
+  }
+
+  return best;
+}
+
+static FILE *csv;
+
+static void record(const char *name, const char *mnemonic, Result result) {
+  if (!csv) return;
+  fprintf(csv, "%s,%s,\"%s\",%llu,%llu,%.6f,%.3f,%.1f\n", MODE, name, mnemonic,
+          (unsigned long long)result.instructions, (unsigned long long)result.cycles, result.seconds,
+          result.seconds * 1e9 / (double)result.instructions, (double)result.cycles / result.seconds / 1e6);
+}
+
+// The instruction over and over, with zeroes for operands (JR/JP/CALL land on the next copy
+// or back at 0x0000), then a jump back to the start. PUSH/CALL/RST walk the stack down into
+// the code, so with blocks they also measure invalidation
+static Result opcode(uint8_t prefix, uint8_t code, uint8_t length) {
+  memset(memory, 0, sizeof(memory));
+
+  size_t at = 0;
+  while (at + length + 3 <= CODE_SIZE) {
+    if (prefix) memory[at] = prefix;
+    memory[at + (prefix ? 1 : 0)] = code;
+    at += length;
+  }
+  memory[at] = 0xC3; // JP 0x0000
+
+  return measure(0x0000, 0, OPCODE_CYCLES, 0x0000, 0x10000);
+}
+
+// The program at 0x0100, its loop starting `loop` bytes in
+static Result mix(const uint8_t *program, size_t size, uint16_t loop) {
+  for (size_t i = 0; i < sizeof(memory); i++) memory[i] = (uint8_t)(i * 7 + (i >> 8));
+  memcpy(&memory[0x0100], program, size);
+
+  return measure(0x0100, 1, MIX_CYCLES, 0x0100u + loop, (uint32_t)(0x0100 + size));
+}
+
+static void summary(const char *name, Result result) {
+  printf("%-8s %-12s %8.2f ns/instruction %8.1f emulated MHz\n", MODE, name,
+         result.seconds * 1e9 / (double)result.instructions, (double)result.cycles / result.seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    csv = fopen(argv[1], "a");
+    if (!csv) { perror(argv[1]); return 1; }
+    fseek(csv, 0, SEEK_END);
+    if (ftell(csv) == 0) fprintf(csv, "mode,benchmark,mnemonic,instructions,cycles,seconds,ns_per_instruction,mhz\n");
+  }
+
+  const struct { const char *name; const uint8_t *program; size_t size; uint16_t loop; } mixes[] = {
+    { "memcpy", mix_memcpy, sizeof(mix_memcpy), 0 },
+    { "alu", alu_program, sizeof(alu_program), ALU_LOOP },
+    { "bits", mix_bits, sizeof(mix_bits), 0 },
+    { "calls", mix_calls, sizeof(mix_calls), 0 },
+  };
+
+  for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+    const Result result = mix(mixes[i].program, mixes[i].size, mixes[i].loop);
+    record(mixes[i].name, mixes[i].name, result);
+    summary(mixes[i].name, result);
+  }
+
+  // Every opcode that runs on its own: HALT and STOP would sleep through the budget
+  Result total = { 0, 0, 0 };
+  for (unsigned prefix = 0; prefix < 2; prefix++) {
+    for (unsigned code = 0; code < 0x100; code++) {
+      const SM83Instruction *instruction = prefix ? &cb_instructions[code] : &instructions[code];
+      if (!prefix && (code == 0xCB || code == 0x10 || code == 0x76 || instruction->exec == invalid)) continue;
+
+      const Result result = opcode(prefix ? 0xCB : 0, (uint8_t)code, (uint8_t)(prefix ? 2 : instruction->length));
+
+      char name[8];
+      snprintf(name, sizeof(name), "%s_%02X", prefix ? "cb" : "op", code);
+      record(name, instruction->mnemonic, result);
+
+      total.instructions += result.instructions;
+      total.cycles += result.cycles;
+      total.seconds += result.seconds;
+    }
+  }
+  summary("opcodes", total);
+
+  if (csv) fclose(csv);
+  return 0;
+}
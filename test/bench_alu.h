@@ -0,0 +1,27 @@
+// The ALU heavy loop that bench_flags.c times and bench.c runs as its `alu` mix, loaded at 0x0100
+#ifndef BENCH_ALU_H_
+#define BENCH_ALU_H_
+
+#include <stdint.h>
+
+#define ALU_LOOP 3 // Offset of the loop, past the LD HL
+
+static const uint8_t alu_program[] = {
+  0x21, 0x00, 0xC0, // LD HL, 0xC000
+  0x2A,             // loop: LD A, [HL+]
+  0x80,             // ADD A, B
+  0x89,             // ADC A, C
+  0x92,             // SUB D
+  0x9B,             // SBC A, E
+  0xA8,             // XOR B
+  0xB1,             // OR C
+  0xE6, 0x7F,       // AND 0x7F
+  0xFE, 0x40,       // CP 0x40
+  0x27,             // DAA
+  0x04,             // INC B
+  0x0D,             // DEC C
+  0x20, 0xF0,       // JR NZ, loop
+  0x18, 0xEE,       // JR loop
+};
+
+#endif
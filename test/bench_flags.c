@@ -0,0 +1,75 @@
+// ALU heavy benchmark, built once per flags mode (see `make bench-flags`)
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+#include "bench_alu.h"
+
+#if defined(SM83_LAZY_FLAGS)
+#define MODE "lazy"
+#elif defined(SM83_FLAG_TABLES)
+#define MODE "tables"
+#else
+#define MODE "eager"
+#endif
+
+#define CYCLES 100000000
+#define RUNS 5
+
+static uint8_t memory[0x10000];
+
+static uint8_t unmapped_read(void *userdata, uint16_t addr) {
+  (void)userdata;
+  (void)addr;
+  return 0xFF;
+}
+
+static void unmapped_write(void *userdata, uint16_t addr, uint8_t value) {
+  (void)userdata;
+  (void)addr;
+  (void)value;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+  double best = 0;
+
+  for (int run = 0; run < RUNS; run++) {
+    for (size_t i = 0; i < sizeof(memory); i++)
+      memory[i] = (uint8_t)(i * 7 + (i >> 8));
+    memcpy(&memory[0x0100], alu_program, sizeof(alu_program));
+
+    SM83 cpu;
+    SM83_init_userdata(&cpu, unmapped_read, unmapped_write, NULL);
+    SM83_map(&cpu, 0x0000, 0x10000, memory, memory);
+    SM83_reset(&cpu);
+    cpu.af = cpu.bc = cpu.de = cpu.hl = 0;
+    cpu.sp = 0xFFFE;
+    cpu.pc = 0x0100;
+
+    const double start = now();
+    const uint64_t cycles = SM83_run(&cpu, CYCLES);
+    const double mhz = (double)cycles / (now() - start) / 1e6;
+
+    // Anywhere else, and what got measured isn't the loop
+    if (cpu.halted || cpu.pc < 0x0100 + ALU_LOOP || cpu.pc >= 0x0100 + sizeof(alu_program)) {
+      fprintf(stderr, "%s: left the loop, at %04X%s\n", MODE, cpu.pc, cpu.halted ? ", halted" : "");
+      return 1;
+    }
+
+    if (mhz > best) best = mhz;
+  }
+
+  printf("%-8s %8.1f emulated MHz\n", MODE, best);
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Differential tests, built once per core (see `make test-fuzz`): random programs that rewrite
+// themselves and take interrupts, run through SM83_run and, on a second machine, one
+// SM83_step at a time (the plain table core in every build). Both must agree at every stop.
+//   fuzz_<core> [seeds] [first seed]
+#define _POSIX_C_SOURCE 200809L
+
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+
+#include "machine.h"
+
+#define STOPS 100 // SM83_run calls per seed
+
+// Raises a random interrupt, then again a little later
+static void raise_interrupt(SM83 *cpu, void *data, uint64_t when) {
+  Machine *machine = (Machine *)data;
+  const uint32_t random = machine_random(machine);
+  SM83_interrupt(cpu, (uint8_t)(1 << (random % 5)));
+  SM83_schedule(cpu, when + 16 + (random >> 8) % 1024, raise_interrupt, machine);
+}
+
+// Random bytes, with what makes interrupts come and go or code change dropped all over:
+// EI, DI, RETI, HALT, writes to IE and IF, and writes into code, some through echo RAM
+static void generate(uint8_t memory[0x10000], uint32_t seed) {
+  uint32_t random = seed * 2654435761u | 1;
+#define RANDOM() (random ^= random << 13, random ^= random >> 17, random ^= random << 5)
+
+  for (size_t i = 0; i < 0x10000; i++) memory[i] = (uint8_t)RANDOM();
+
+  for (unsigned i = 0; i < 0x800; i++) {
+    const uint32_t r = RANDOM();
+    // Code lives in ROM and WRAM (0xC000-0xDFFF), so does what writes to it
+    uint16_t at = (uint16_t)(r & 0x1000 ? 0xC000 + (r >> 16) % 0x1FF0 : (r >> 16) % 0x7FF0);
+    uint16_t target = (uint16_t)(RANDOM() % 0x2000);
+    target = (uint16_t)(r & 0x2000 ? 0xC000 + target : target);
+    if ((r & 0x6000) == 0x6000) target = (uint16_t)(target + 0x2000); // Echo RAM, same bytes
+
+    switch ((r >> 4) % 8) {
+      case 0: memory[at] = 0xFB; break; // EI
+      case 1: memory[at] = 0xF3; break; // DI
+      case 2: memory[at] = 0xD9; break; // RETI
+      case 3: memory[at] = 0x76; break; // HALT
+      case 4: case 5: // LD A, n; LDH [IF or IE], A
+        memory[at++] = 0x3E; memory[at++] = (uint8_t)RANDOM();
+        memory[at++] = 0xE0; memory[at] = r & 0x100 ? 0xFF : 0x0F;
+        break;
+      case 6: // LD HL, nn; LD [HL], n
+        memory[at++] = 0x21; memory[at++] = (uint8_t)target; memory[at++] = (uint8_t)(target >> 8);
+        memory[at++] = 0x36; memory[at] = (uint8_t)RANDOM();
+        break;
+      default: // LD [nn], A
+        memory[at++] = 0xEA; memory[at++] = (uint8_t)target; memory[at] = (uint8_t)(target >> 8);
+        break;
+    }
+  }
+#undef RANDOM
+}
+
+// Every way to reach memory: 0x0000-0x3FFF and WRAM mapped both ways, 0x4000-0x7FFF only
+// for reads (writes go through the callback to the same bytes), echo RAM mapped onto WRAM
+// and the rest through the callbacks
+static Machine *fuzz_boot(const uint8_t memory[0x10000], uint32_t seed) {
+  Machine *machine = boot(memory, 0x10000);
+  SM83 *cpu = &machine->cpu;
+
+  SM83_map(cpu, 0x0000, 0x10000, NULL, NULL);
+  SM83_map(cpu, 0x0000, 0x4000, machine->memory, machine->memory);
+  SM83_map(cpu, 0x4000, 0x4000, machine->memory + 0x4000, NULL);
+  SM83_map(cpu, 0xC000, 0x2000, machine->memory + 0xC000, machine->memory + 0xC000);
+  SM83_map(cpu, 0xE000, 0x1E00, machine->memory + 0xC000, machine->memory + 0xC000);
+
+  machine->random = seed | 1;
+  cpu->pc = 0x0100;
+  cpu->sp = (uint16_t)(0xC000 + (seed * 40503u) % 0x2000);
+  cpu->ime = seed & 1;
+  cpu->ie = (uint8_t)((seed >> 1) & 0x1F);
+  SM83_schedule(cpu, 64, raise_interrupt, machine);
+  return machine;
+}
+
+static void fuzz(uint32_t seed) {
+  static uint8_t memory[0x10000];
+  generate(memory, seed);
+
+  Machine *run = fuzz_boot(memory, seed), *step = fuzz_boot(memory, seed);
+  uint32_t random = seed | 1;
+
+  for (unsigned stop = 0; stop < STOPS; stop++) {
+    random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+    const uint64_t cycles = 1 + random % 400;
+
+    const uint64_t ran = SM83_run(&run->cpu, cycles);
+    uint64_t stepped = 0;
+    while (stepped < cycles) stepped += SM83_step(&step->cpu);
+
+    if (ran != stepped || !machine_equal(run, step)) {
+      fprintf(stderr, "%s: seed %u differs after %u stops: PC %04X, stepping %04X, cycles %llu, stepping %llu\n",
+              MODE, seed, stop + 1, run->cpu.pc, step->cpu.pc, (unsigned long long)run->cpu.cycles,
+              (unsigned long long)step->cpu.cycles);
+      failures++;
+      break;
+    }
+  }
+
+  shutdown(run);
+  shutdown(step);
+}
+
+int main(int argc, char **argv) {
+  const uint32_t seeds = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : 300;
+  const uint32_t first = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 1;
+
+  current = "fuzz";
+  for (uint32_t seed = first; seed < first + seeds; seed++) fuzz(seed);
+
+  printf("%s: %u seeds, %u differ\n", MODE, seeds, failures);
+  return failures != 0;
+}
@@ -0,0 +1,101 @@
+// What the native tests share: a bare machine around one instance, and checks that report
+// and carry on. Include after the SM83 implementation
+#ifndef MACHINE_H_
+#define MACHINE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(SM83_JIT)
+#define MODE "jit"
+#elif defined(SM83_BLOCK_CACHE)
+#define MODE "blocks"
+#elif defined(SM83_DISPATCH_SWITCH)
+#define MODE "switch"
+#elif defined(SM83_DISPATCH_GOTO)
+#define MODE "goto"
+#elif defined(SM83_LAZY_FLAGS)
+#define MODE "lazy"
+#elif defined(SM83_FLAG_TABLES)
+#define MODE "tables"
+#else
+#define MODE "table"
+#endif
+
+static const char *current; // Test running
+static unsigned failures;
+
+#define CHECK(condition) { \
+  if (!(condition)) { \
+    fprintf(stderr, "%s:%d: %s (%s): %s\n", __FILE__, __LINE__, current, MODE, #condition); \
+    failures++; \
+  } \
+}
+
+// One instance with 64 KiB of its own, mapped but for the last page, where IE and IF show up
+typedef struct Machine {
+  SM83 cpu;
+  uint8_t memory[0x10000];
+  uint32_t random; // For whatever the test drives it with
+} Machine;
+
+static inline uint8_t machine_read(void *userdata, uint16_t addr) {
+  const Machine *machine = (const Machine *)userdata;
+  if (addr == 0xFFFF) return machine->cpu.ie;
+  if (addr == 0xFF0F) return (uint8_t)(machine->cpu.if_ | 0xE0);
+  return machine->memory[addr];
+}
+
+static inline void machine_write(void *userdata, uint16_t addr, uint8_t value) {
+  Machine *machine = (Machine *)userdata;
+  if (addr == 0xFFFF) machine->cpu.ie = value;
+  else if (addr == 0xFF0F) machine->cpu.if_ = value & 0x1F;
+  else machine->memory[addr] = value;
+}
+
+// `program` at 0, everything else zero but the instance, which starts out as garbage:
+// nothing may count on it having been zeroed
+static inline Machine *boot(const uint8_t *program, size_t size) {
+  Machine *machine = (Machine *)malloc(sizeof(Machine));
+  if (!machine) { fprintf(stderr, "Out of memory\n"); exit(2); }
+
+  memset(&machine->cpu, 0xAB, sizeof(machine->cpu));
+  memset(machine->memory, 0, sizeof(machine->memory));
+  memcpy(machine->memory, program, size);
+  machine->random = 1;
+
+  SM83 *cpu = &machine->cpu;
+  SM83_init_userdata(cpu, machine_read, machine_write, machine);
+  SM83_map(cpu, 0x0000, 0xFF00, machine->memory, machine->memory);
+  SM83_reset(cpu);
+  cpu->af = cpu->bc = cpu->de = cpu->hl = 0;
+  cpu->sp = 0xFFFE;
+  cpu->pc = 0;
+  return machine;
+}
+
+static inline void shutdown(Machine *machine) {
+  SM83_free(&machine->cpu);
+  free(machine);
+}
+
+// xorshift32, never 0
+static inline uint32_t machine_random(Machine *machine) {
+  uint32_t x = machine->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return machine->random = x;
+}
+
+// Everything visible from outside the instance, between two instructions
+static inline int machine_equal(const Machine *a, const Machine *b) {
+  const SM83 *x = &a->cpu, *y = &b->cpu;
+  return x->af == y->af && x->bc == y->bc && x->de == y->de && x->hl == y->hl && x->sp == y->sp && x->pc == y->pc &&
+         x->ime == y->ime && x->ime_delay == y->ime_delay && x->halted == y->halted &&
+         x->ie == y->ie && x->if_ == y->if_ && x->cycles == y->cycles &&
+         memcmp(a->memory, b->memory, sizeof(a->memory)) == 0;
+}
+
+#endif // MACHINE_H_
@@ -1,5 +1,9 @@
 from ctypes import *
 from pathlib import Path
+import os
+
+# Set to test the library built with -DSM83_JIT (make test-jit), which adds fields
+JIT = bool(os.environ.get('SM83_JIT'))
 
 class SM83Instruction(Structure):
   _fields_ = [('mnemonic', c_char_p),
@@ -7,6 +11,33 @@ class SM83Instruction(Structure):
               ('length', c_uint8),
               ('ticks', c_uint8)]
 
+class SM83Event(Structure):
+  _fields_ = [('when', c_uint64),
+              ('callback', c_void_p),
+              ('data', c_void_p)]
+
+class SM83BlockOp(Structure):
+  _fields_ = [('exec', c_void_p),
+              ('instruction', c_void_p),
+              ('ticks', c_uint8),
+              ('size', c_uint8),
+              ('operands', c_uint8 * 2),
+              ('memory', c_uint8)]
+
+class SM83Block(Structure):
+  _fields_ = [('page', c_void_p),
+              ('native', c_void_p),
+              ('hits', c_uint16),
+              ('pc', c_uint16),
+              ('ticks', c_uint16),
+              ('count', c_uint8),
+              ('length', c_uint8),
+              ('ops', SM83BlockOp * 16)]
+
+class SM83CodePage(Structure):
+  _fields_ = [('page', c_void_p),
+              ('bytes', c_uint8 * 0x20)]
+
 class SM83(Structure):
   _fields_ = [('af', c_uint16),
               ('bc', c_uint16),
@@ -14,10 +45,35 @@ class SM83(Structure):
               ('hl', c_uint16),
               ('sp', c_uint16),
               ('pc', c_uint16),
-              ('read', CFUNCTYPE(c_uint8, c_uint16)),
-              ('write', CFUNCTYPE(None, c_uint16, c_uint8)),
               ('t', c_uint8),
-              ('instruction', POINTER(SM83Instruction))]
+              ('instruction', POINTER(SM83Instruction)),
+              ('flags_op', c_uint8),
+              ('flags_x', c_uint8),
+              ('flags_y', c_uint8),
+              ('flags_result', c_uint16),
+              ('ime', c_uint8),
+              ('ime_delay', c_uint8),
+              ('halted', c_uint8)] + \
+            ([('operands', c_void_p)] if JIT else []) + \
+            [              ('bus', c_void_p),
+              ('read', CFUNCTYPE(c_uint8, c_void_p, c_uint16)),
+              ('write', CFUNCTYPE(None, c_void_p, c_uint16, c_uint8)),
+              ('userdata', c_void_p),
+              ('legacy_read', CFUNCTYPE(c_uint8, c_uint16)),
+              ('legacy_write', CFUNCTYPE(None, c_uint16, c_uint8)),
+              ('read_map', c_void_p * 0x100),
+              ('write_map', c_void_p * 0x100),
+              ('ie', c_uint8),
+              ('if_', c_uint8),
+              ('cycles', c_uint64),
+              ('events', SM83Event * 16),
+              ('event_count', c_uint)] + \
+            ([('blocks', SM83Block * 4096),
+              ('block_recent', c_uint8 * 2048),
+              ('code', SM83CodePage * 1024),
+              ('jit_code', c_void_p),
+              ('jit_used', c_size_t),
+              ('jit_disabled', c_int)] if JIT else [])
   
   @property
   def a(self):
@@ -83,12 +139,24 @@ class SM83(Structure):
   def l(self, value):
     self.hl = (self.hl & 0xFF00) | value
 
-__lib = CDLL(Path(__file__).parent / 'libsm83.so')
+__lib = CDLL(Path(__file__).parent / ('libsm83_jit.so' if JIT else 'libsm83.so'))
 
 __lib.SM83_init.argtypes = [POINTER(SM83), c_void_p, c_void_p]
+__lib.SM83_init_userdata.argtypes = [POINTER(SM83), c_void_p, c_void_p, c_void_p]
+__lib.SM83_map.argtypes = [POINTER(SM83), c_uint16, c_size_t, c_void_p, c_void_p]
 __lib.SM83_reset.argtypes = [POINTER(SM83)]
+__lib.SM83_step.argtypes = [POINTER(SM83)]
+__lib.SM83_step.restype = c_uint8
+__lib.SM83_run.argtypes = [POINTER(SM83), c_uint64]
+__lib.SM83_run.restype = c_uint64
 __lib.SM83_tick.argtypes = [POINTER(SM83)]
+__lib.SM83_free.argtypes = [POINTER(SM83)]
 
 SM83_init = __lib.SM83_init
+SM83_init_userdata = __lib.SM83_init_userdata
+SM83_map = __lib.SM83_map
 SM83_reset = __lib.SM83_reset
+SM83_step = __lib.SM83_step
+SM83_run = __lib.SM83_run
 SM83_tick = __lib.SM83_tick
+SM83_free = __lib.SM83_free
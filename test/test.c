@@ -0,0 +1,556 @@
+// Native counterpart of test.py: runs every GameboyCPUTests file, in parallel, with the same output.
+//   test_runner [directory]                 Runs the JSON files (GameboyCPUTests/v2 by default)
+//   test_runner --convert directory file    Converts the JSON files into one binary file...
+//   test_runner file                        ...which runs straight from memory, without parsing
+#define _XOPEN_SOURCE 700
+
+// With TEST_INLINE, the bus is handed to the core over the flat memory, with nothing mapped
+// so that it's the only way there
+#ifdef TEST_INLINE
+#define TEST_CALLBACKS
+#define SM83_READ(userdata, addr) (((const uint8_t *)(userdata))[addr])
+#define SM83_WRITE(userdata, addr, value) (((uint8_t *)(userdata))[addr] = (value))
+#endif
+
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESET "\033[0m"
+#define BOLD "\033[1m"
+#define ITALIC "\033[3m"
+#define UNDERLINE "\033[4m"
+#define RED "\033[31m"
+#define GREEN "\033[32m"
+#define YELLOW "\033[33m"
+
+// Any core but the plain table one is only reached through SM83_run, asked for a single
+// instruction's worth of cycles
+#if defined(SM83_DISPATCH_SWITCH) || defined(SM83_DISPATCH_GOTO) || defined(SM83_BLOCK_CACHE) || defined(SM83_JIT) || \
+    defined(SM83_LAZY_FLAGS) || defined(SM83_FLAG_TABLES)
+#define RUN_ONE(cpu) ((cpu)->t = (uint8_t)SM83_run((cpu), 1))
+#else
+#define RUN_ONE(cpu) SM83_step(cpu)
+#endif
+
+#define MAX_RAM 8
+#define MAX_FILES 1024
+
+// Cases are also the records of the binary files, so everything here has a fixed size
+typedef struct State {
+  uint8_t a, b, c, d, e, f, h, l;
+  uint16_t pc, sp;
+  uint32_t ram_count;
+  uint16_t ram[MAX_RAM][2]; // Address, value
+} State;
+
+typedef struct Case {
+  char name[16];
+  State initial, final;
+  uint32_t cycles;
+} Case;
+
+// Binary files: the header, a table of the JSON files they came from, then every case
+#define VECTORS_MAGIC "SM83CPU"
+#define VECTORS_VERSION 1
+
+typedef struct VectorsHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t files;
+} VectorsHeader;
+
+typedef struct VectorsFile {
+  char path[256];
+  uint32_t first, count; // Cases
+} VectorsFile;
+
+typedef struct File {
+  char path[PATH_MAX];
+  const Case *cases; // Straight from a binary file, parsed from the JSON at `path` if NULL
+  size_t case_count;
+
+  int failed;
+  char *report; // What to print after the path
+  size_t report_size;
+} File;
+
+static File files[MAX_FILES];
+static size_t file_count;
+
+static size_t next_file;
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// JSON, only as much as the test files need. Cases are parsed one at a time straight
+// from the file contents, nothing gets built for the whole file
+typedef struct Parser {
+  const char *at, *end;
+  int error;
+} Parser;
+
+static void skip_space(Parser *parser) {
+  while (parser->at < parser->end && (*parser->at == ' ' || *parser->at == '\n' || *parser->at == '\r' || *parser->at == '\t')) parser->at++;
+}
+
+static int peek(Parser *parser) {
+  skip_space(parser);
+  return parser->at < parser->end ? *parser->at : -1;
+}
+
+static void expect(Parser *parser, char c) {
+  if (peek(parser) != c) { parser->error = 1; return; }
+  parser->at++;
+}
+
+// Whether the next token is `c`, consuming it if so
+static int accept(Parser *parser, char c) {
+  if (peek(parser) != c) return 0;
+  parser->at++;
+  return 1;
+}
+
+static unsigned parse_number(Parser *parser) {
+  unsigned value = 0;
+  skip_space(parser);
+  if (parser->at >= parser->end || *parser->at < '0' || *parser->at > '9') { parser->error = 1; return 0; }
+  while (parser->at < parser->end && *parser->at >= '0' && *parser->at <= '9') value = value * 10 + (unsigned)(*parser->at++ - '0');
+  return value;
+}
+
+// Copies the string into `out` (truncated to `size`), or skips it if `out` is NULL
+static void parse_string(Parser *parser, char *out, size_t size) {
+  size_t length = 0;
+  expect(parser, '"');
+
+  while (parser->at < parser->end && *parser->at != '"') {
+    if (*parser->at == '\\') parser->at++;
+    if (out && length + 1 < size) out[length++] = *parser->at;
+    parser->at++;
+  }
+
+  if (out) out[length] = '\0';
+  expect(parser, '"');
+}
+
+static void skip_value(Parser *parser) {
+  const int c = peek(parser);
+
+  if (c == '"') {
+    parse_string(parser, NULL, 0);
+  } else if (c == '[' || c == '{') {
+    const char close = c == '[' ? ']' : '}';
+    parser->at++;
+    if (accept(parser, close)) return;
+    do {
+      if (close == '}') { parse_string(parser, NULL, 0); expect(parser, ':'); }
+      skip_value(parser);
+    } while (!parser->error && accept(parser, ','));
+    expect(parser, close);
+  } else {
+    // Numbers, true/false/null
+    while (parser->at < parser->end && !strchr(",]} \n\r\t", *parser->at)) parser->at++;
+  }
+}
+
+static void parse_state(Parser *parser, State *state) {
+  char key[8];
+  state->ram_count = 0;
+
+  expect(parser, '{');
+  do {
+    parse_string(parser, key, sizeof(key));
+    expect(parser, ':');
+
+    if (!strcmp(key, "ram")) {
+      expect(parser, '[');
+      if (accept(parser, ']')) continue;
+      do {
+        if (state->ram_count == MAX_RAM) { parser->error = 1; return; }
+        expect(parser, '[');
+        state->ram[state->ram_count][0] = (uint16_t)parse_number(parser);
+        expect(parser, ',');
+        state->ram[state->ram_count][1] = (uint16_t)parse_number(parser);
+        expect(parser, ']');
+        state->ram_count++;
+      } while (!parser->error && accept(parser, ','));
+      expect(parser, ']');
+    } else if (!strcmp(key, "pc")) {
+      state->pc = (uint16_t)parse_number(parser);
+    } else if (!strcmp(key, "sp")) {
+      state->sp = (uint16_t)parse_number(parser);
+    } else if (strlen(key) == 1 && strchr("abcdefhl", key[0])) {
+      uint8_t *registers[] = { &state->a, &state->b, &state->c, &state->d, &state->e, &state->f, &state->h, &state->l };
+      *registers[strchr("abcdefhl", key[0]) - "abcdefhl"] = (uint8_t)parse_number(parser);
+    } else {
+      skip_value(parser);
+    }
+  } while (!parser->error && accept(parser, ','));
+  expect(parser, '}');
+}
+
+// Parses the next case of the array. Returns 0 once there are none left
+static int parse_case(Parser *parser, Case *test) {
+  char key[16];
+
+  if (!accept(parser, '{')) return 0;
+  do {
+    parse_string(parser, key, sizeof(key));
+    expect(parser, ':');
+
+    if (!strcmp(key, "name")) {
+      parse_string(parser, test->name, sizeof(test->name));
+    } else if (!strcmp(key, "initial")) {
+      parse_state(parser, &test->initial);
+    } else if (!strcmp(key, "final")) {
+      parse_state(parser, &test->final);
+    } else if (!strcmp(key, "cycles")) {
+      // Only how many there are matters
+      test->cycles = 0;
+      expect(parser, '[');
+      if (accept(parser, ']')) continue;
+      do {
+        skip_value(parser);
+        test->cycles++;
+      } while (!parser->error && accept(parser, ','));
+      expect(parser, ']');
+    } else {
+      skip_value(parser);
+    }
+  } while (!parser->error && accept(parser, ','));
+  expect(parser, '}');
+
+  // On to the next one
+  accept(parser, ',');
+  return !parser->error;
+}
+
+// Output of a file, printed once every file before it is done
+static void report(File *file, const char *format, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  const int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0) return;
+
+  char *report = realloc(file->report, file->report_size + (size_t)length + 1);
+  if (!report) return;
+  memcpy(report + file->report_size, line, (size_t)length + 1);
+  file->report = report;
+  file->report_size += (size_t)length;
+}
+
+static void report_state(File *file, uint16_t af, uint16_t bc, uint16_t de, uint16_t hl, uint16_t sp, uint16_t pc,
+                         const State *ram, const uint8_t *memory) {
+  report(file, "AF: %04X BC: %04X DE: %04X HL: %04X SP: %04X PC: %04X\n", af, bc, de, hl, sp, pc);
+
+  for (int bit = 7; bit >= 0; bit--) report(file, "%d", (af >> bit) & 1);
+  report(file, "\n[");
+  for (unsigned i = 0; i < ram->ram_count; i++) {
+    const uint16_t addr = ram->ram[i][0];
+    report(file, "%s[%u, %u]", i ? ", " : "", addr, memory ? memory[addr] : ram->ram[i][1]);
+  }
+  report(file, "]\n");
+}
+
+static void set_state(SM83 *cpu, uint8_t *memory, const State *state) {
+  cpu->a = state->a; cpu->f = state->f;
+  cpu->b = state->b; cpu->c = state->c;
+  cpu->d = state->d; cpu->e = state->e;
+  cpu->h = state->h; cpu->l = state->l;
+  cpu->sp = state->sp;
+  cpu->pc = state->pc;
+
+  for (unsigned i = 0; i < state->ram_count; i++) {
+    memory[state->ram[i][0]] = (uint8_t)state->ram[i][1];
+    SM83_invalidate(cpu, state->ram[i][0], 1);
+  }
+}
+
+static int run_case(File *file, SM83 *cpu, uint8_t *memory, const Case *test) {
+  int failed = 0;
+
+  // Fresh as in test.py, where HALT would stick otherwise
+  SM83_reset(cpu);
+  set_state(cpu, memory, &test->initial);
+
+  // The vectors model the fetch overlap: the opcode was read during the previous instruction,
+  // so PC starts one past it, and ends one past the next one, fetched during the last M-cycle
+  cpu->pc--;
+  RUN_ONE(cpu);
+  cpu->pc++;
+
+  const unsigned ticks = cpu->t;
+  const unsigned cycles = ticks / 4;
+
+  const State *final = &test->final;
+  const uint16_t af = (uint16_t)(final->a << 8 | final->f), bc = (uint16_t)(final->b << 8 | final->c);
+  const uint16_t de = (uint16_t)(final->d << 8 | final->e), hl = (uint16_t)(final->h << 8 | final->l);
+
+  int matches = cpu->af == af && cpu->bc == bc && cpu->de == de && cpu->hl == hl &&
+                cpu->sp == final->sp && cpu->pc == final->pc;
+  for (unsigned i = 0; i < final->ram_count; i++) {
+    if (memory[final->ram[i][0]] != final->ram[i][1]) matches = 0;
+  }
+
+  if (ticks == 255) {
+    report(file, RESET BOLD YELLOW "%s" RESET "\n", test->name);
+    report(file, RESET BOLD YELLOW "Unimplemented opcode" RESET "\n");
+    failed = 1;
+  } else if (cycles != test->cycles) {
+    report(file, RESET BOLD RED "%s" RESET "\n", test->name);
+    report(file, RESET BOLD RED "Failed timing: %u != %u" RESET "\n", cycles, test->cycles);
+    failed = 1;
+  } else if (!matches) {
+    report(file, RESET BOLD RED "%s" RESET "\n", test->name);
+    report(file, RESET BOLD RED "Failed" RESET "\n");
+    report(file, "Expected:\n");
+    report_state(file, af, bc, de, hl, final->sp, final->pc, final, NULL);
+    report(file, "Emulated:\n");
+    report_state(file, cpu->af, cpu->bc, cpu->de, cpu->hl, cpu->sp, cpu->pc, final, memory);
+    failed = 1;
+  }
+
+  // Only what the case touched needs to go back to zero
+  for (unsigned i = 0; i < test->initial.ram_count; i++) memory[test->initial.ram[i][0]] = 0;
+  for (unsigned i = 0; i < test->final.ram_count; i++) memory[test->final.ram[i][0]] = 0;
+
+  return failed;
+}
+
+// Whole contents of `path`, to be freed. NULL if it can't be read
+static char *read_file(const char *path, size_t *size) {
+  FILE *stream = fopen(path, "rb");
+  if (!stream) return NULL;
+
+  fseek(stream, 0, SEEK_END);
+  const long length = ftell(stream);
+  fseek(stream, 0, SEEK_SET);
+
+  char *contents = length >= 0 ? malloc((size_t)length + 1) : NULL;
+  *size = contents ? fread(contents, 1, (size_t)length, stream) : 0;
+  fclose(stream);
+
+  return contents;
+}
+
+static void run_file(File *file, SM83 *cpu, uint8_t *memory) {
+  if (file->cases) {
+    for (size_t i = 0; i < file->case_count && !file->failed; i++) {
+      file->failed = run_case(file, cpu, memory, &file->cases[i]);
+    }
+  } else {
+    size_t size;
+    char *contents = read_file(file->path, &size);
+    if (!contents) { report(file, RESET BOLD RED "Can't open" RESET "\n"); file->failed = 1; return; }
+
+    Parser parser = { contents, contents + size, 0 };
+    Case test;
+
+    expect(&parser, '[');
+    while (!parser.error && !file->failed && parse_case(&parser, &test)) {
+      file->failed = run_case(file, cpu, memory, &test);
+    }
+
+    if (parser.error) {
+      report(file, RESET BOLD RED "Can't parse" RESET "\n");
+      file->failed = 1;
+    }
+
+    free(contents);
+  }
+
+  if (!file->failed) report(file, RESET BOLD GREEN "Passed" RESET "\n");
+}
+
+static uint8_t memory_read(void *userdata, uint16_t addr) {
+  return ((const uint8_t *)userdata)[addr];
+}
+
+static void memory_write(void *userdata, uint16_t addr, uint8_t value) {
+  ((uint8_t *)userdata)[addr] = value;
+}
+
+static void *worker(void *data) {
+  (void)data;
+
+  // Mapped whole, as in test.py, or left to the callbacks alone with TEST_CALLBACKS
+  uint8_t *memory = calloc(0x10000, 1);
+  SM83 *cpu = malloc(sizeof(SM83));
+  if (!memory || !cpu) { free(memory); free(cpu); return NULL; }
+
+  SM83_init_userdata(cpu, memory_read, memory_write, memory);
+#ifndef TEST_CALLBACKS
+  SM83_map(cpu, 0x0000, 0x10000, memory, memory);
+#endif
+  SM83_reset(cpu);
+
+  for (;;) {
+    pthread_mutex_lock(&next_lock);
+    const size_t index = next_file++;
+    pthread_mutex_unlock(&next_lock);
+    if (index >= file_count) break;
+
+    run_file(&files[index], cpu, memory);
+  }
+
+  SM83_free(cpu);
+  free(cpu);
+  free(memory);
+  return NULL;
+}
+
+static int compare_files(const void *a, const void *b) {
+  return strcmp(((const File *)a)->path, ((const File *)b)->path);
+}
+
+// Lists the JSON files in `path`, sorted as test.py does. Returns 0, or -1 if it can't be read
+static int list_files(const char *path) {
+  char directory[PATH_MAX];
+  if (!realpath(path, directory)) { perror(path); return -1; }
+
+  DIR *dir = opendir(directory);
+  if (!dir) { perror(directory); return -1; }
+
+  const struct dirent *entry;
+  while ((entry = readdir(dir)) && file_count < MAX_FILES) {
+    const size_t length = strlen(entry->d_name);
+    if (length < 5 || strcmp(entry->d_name + length - 5, ".json")) continue;
+    if (strlen(directory) + 1 + length >= PATH_MAX) continue;
+
+    File *file = &files[file_count++];
+    strcpy(file->path, directory);
+    strcat(file->path, "/");
+    strcat(file->path, entry->d_name);
+  }
+  closedir(dir);
+
+  qsort(files, file_count, sizeof(File), compare_files);
+  return 0;
+}
+
+// Writes every case of the listed files to `path`. Returns 0, or -1 on failure
+static int convert(const char *path) {
+  FILE *out = fopen(path, "wb");
+  if (!out) { perror(path); return -1; }
+
+  VectorsHeader header = { VECTORS_MAGIC, VECTORS_VERSION, (uint32_t)file_count };
+  VectorsFile *table = calloc(file_count ? file_count : 1, sizeof(VectorsFile));
+  uint32_t cases = 0;
+  int failed = !table;
+
+  // The cases go after the table, which is only known once they are all written
+  fseek(out, (long)(sizeof(header) + file_count * sizeof(VectorsFile)), SEEK_SET);
+
+  for (size_t i = 0; i < file_count && !failed; i++) {
+    size_t size;
+    char *contents = read_file(files[i].path, &size);
+    Parser parser = { contents, contents + size, !contents };
+    Case test;
+
+    if (strlen(files[i].path) >= sizeof(table[i].path)) parser.error = 1;
+    strncpy(table[i].path, files[i].path, sizeof(table[i].path) - 1);
+    table[i].first = cases;
+
+    expect(&parser, '[');
+    while (!parser.error && parse_case(&parser, &test)) {
+      if (fwrite(&test, sizeof(test), 1, out) != 1) parser.error = 1;
+      cases++;
+    }
+    expect(&parser, ']');
+
+    table[i].count = cases - table[i].first;
+    if (parser.error) { fprintf(stderr, "%s: can't convert\n", files[i].path); failed = 1; }
+    free(contents);
+  }
+
+  fseek(out, 0, SEEK_SET);
+  if (!failed && (fwrite(&header, sizeof(header), 1, out) != 1 ||
+                  fwrite(table, sizeof(VectorsFile), file_count, out) != file_count)) failed = 1;
+  if (fclose(out)) failed = 1;
+
+  free(table);
+  return failed ? -1 : 0;
+}
+
+// Maps a binary file, its cases are run from where they sit. Returns 0, or -1 if it isn't one
+static int load(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) { perror(path); return -1; }
+
+  struct stat info;
+  const uint8_t *data = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) { perror(path); return -1; }
+
+  const size_t size = (size_t)info.st_size;
+  VectorsHeader header;
+  if (size < sizeof(header)) return -1;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, VECTORS_MAGIC, sizeof(header.magic)) || header.version != VECTORS_VERSION ||
+      header.files > MAX_FILES || size < sizeof(header) + header.files * sizeof(VectorsFile)) {
+    fprintf(stderr, "%s: not a test file of this version\n", path);
+    return -1;
+  }
+
+  const VectorsFile *table = (const VectorsFile *)(const void *)(data + sizeof(header));
+  const Case *cases = (const Case *)(const void *)(table + header.files);
+  const size_t case_count = (size - sizeof(header) - header.files * sizeof(VectorsFile)) / sizeof(Case);
+
+  for (uint32_t i = 0; i < header.files; i++) {
+    if ((size_t)table[i].first + table[i].count > case_count) return -1;
+
+    File *file = &files[file_count++];
+    memcpy(file->path, table[i].path, sizeof(table[i].path));
+    file->path[sizeof(table[i].path) - 1] = '\0';
+    file->cases = cases + table[i].first;
+    file->case_count = table[i].count;
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "--convert")) {
+    if (argc < 4) { fprintf(stderr, "usage: %s --convert directory file\n", argv[0]); return 1; }
+    return list_files(argv[2]) || convert(argv[3]) ? 1 : 0;
+  }
+
+  const char *path = argc > 1 ? argv[1] : "GameboyCPUTests/v2";
+  struct stat info;
+  if (stat(path, &info) == 0 && S_ISREG(info.st_mode) ? load(path) : list_files(path)) return 1;
+
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+  if (threads > 64) threads = 64;
+
+  pthread_t handles[64];
+  long started = 0;
+  for (long i = 0; i < threads; i++) {
+    if (pthread_create(&handles[started], NULL, worker, NULL) == 0) started++;
+  }
+  if (!started) worker(NULL);
+  for (long i = 0; i < started; i++) pthread_join(handles[i], NULL);
+
+  // Stops at the first failing file, like test.py
+  int failed = 0;
+  for (size_t i = 0; i < file_count && !failed; i++) {
+    printf(RESET BOLD ITALIC UNDERLINE "%s:" RESET " %s", files[i].path, files[i].report ? files[i].report : "\n");
+    failed = files[i].failed;
+    free(files[i].report);
+  }
+
+  return failed;
+}
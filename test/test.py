@@ -2,46 +2,49 @@ from sm83 import *
 import json
 from utils.colors import Style, Text, Back
 
-memory = (c_uint8 * 0x10000)()
+@CFUNCTYPE(c_uint8, c_void_p, c_uint16)
+def read(userdata, addr):
+  return cast(userdata, POINTER(c_uint8))[addr]
 
-@CFUNCTYPE(c_uint8, c_uint16)
-def read(addr):
-  return memory[addr]
-
-@CFUNCTYPE(None, c_uint16, c_uint8)
-def write(addr, value):
+@CFUNCTYPE(None, c_void_p, c_uint16, c_uint8)
+def write(userdata, addr, value):
   # print(f'Writing {value} to {addr}')
-  memory[addr] = value
-
-def zero_memory():
-  for i in range(0x10000):
-    memory[i] = 0
+  cast(userdata, POINTER(c_uint8))[addr] = value
 
 
 class Snapshot:
   def __init__(self, state):
+    self.memory = (c_uint8 * 0x10000)()
+
     self.cpu = SM83()
-    SM83_init(self.cpu, read, write)
+    SM83_init_userdata(self.cpu, read, write, addressof(self.memory))
+    SM83_map(self.cpu, 0x0000, 0x10000, addressof(self.memory), addressof(self.memory))
     SM83_reset(self.cpu)
     
     self.ram = None
 
     self._set_state(state)
+
+  def __del__(self):
+    SM83_free(self.cpu)
   
   def run(self):
-    zero_memory() # TODO: Ideally memory should be local to the Snapshot class
     for (addr, value) in self.ram:
-      memory[addr] = value
+      self.memory[addr] = value
 
-    SM83_tick(self.cpu)
+    if JIT:
+      # Compiled on first sight (SM83_JIT_THRESHOLD=0), and stops after one instruction
+      self.cpu.t = SM83_run(self.cpu, 1)
+    else:
+      SM83_tick(self.cpu)
 
     # for i, (addr, _) in enumerate(self.ram):
-    #   self.ram[i] = [addr, memory[addr]]
+    #   self.ram[i] = [addr, self.memory[addr]]
     
   def __eq__(self, value: 'Snapshot') -> bool:
     self.ram = []
     for (addr, _) in value.ram:
-      self.ram.append([addr, memory[addr]])
+      self.ram.append([addr, self.memory[addr]])
 
     return isinstance(value, Snapshot) and \
            self.cpu.af == value.cpu.af and \
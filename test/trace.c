@@ -0,0 +1,102 @@
+// Writes a trace through SM83_trace.h and the same run as a text log, one SM83_step at a
+// time, for tools/tracecmp to read back (see `make test-trace`):
+//   trace_<core> trace.bin trace.log bad.log
+// bad.log is trace.log with one register off, which tracecmp must catch
+#define _POSIX_C_SOURCE 200809L
+
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+#define SM83_TRACE_IMPLEMENTATION
+#include "SM83_trace.h"
+
+#include "machine.h"
+
+#define CYCLES 100000
+#define BAD_RECORD 1000 // Where bad.log is off
+
+static const uint8_t program[] = {
+  0x06, 0x00,       // LD B, 0
+  0x3E, 0x01,       // LD A, 1
+  0xCD, 0x80, 0xFF, // CALL 0xFF80
+  0x87,             // ADD A, A
+  0xCE, 0x03,       // ADC A, 3
+  0xCB, 0x38,       // SRL B
+  0x18, 0xF6,       // JR -10
+};
+
+// Outside the map, only the read callback sees it
+static const uint8_t hram[] = {
+  0x04, // INC B
+  0xC9, // RET
+};
+
+static unsigned long reads; // Through the callback
+
+static uint8_t counted_read(void *userdata, uint16_t addr) {
+  reads++;
+  return machine_read(userdata, addr);
+}
+
+static Machine *trace_boot(void) {
+  Machine *machine = boot(program, sizeof(program));
+  memcpy(&machine->memory[0xFF80], hram, sizeof(hram));
+  machine->cpu.read = counted_read;
+  return machine;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s trace.bin trace.log bad.log\n", argv[0]);
+    return 2;
+  }
+  current = "trace";
+
+  // Untraced, for what tracing mustn't change
+  Machine *plain = trace_boot();
+  reads = 0;
+  SM83_run(&plain->cpu, CYCLES);
+  const unsigned long plain_reads = reads;
+
+  // Through a ring small enough to wrap many times over
+  Machine *traced = trace_boot();
+  SM83TraceWriter *writer = SM83_trace_open(argv[1], 256);
+  CHECK(writer != NULL);
+  if (!writer) return 2;
+  CHECK(SM83_trace(&traced->cpu, SM83_trace_record, writer) == 0);
+  reads = 0;
+  SM83_run(&traced->cpu, CYCLES);
+  SM83_trace(&traced->cpu, NULL, NULL);
+  CHECK(SM83_trace_close(writer) == 0);
+  CHECK(reads == plain_reads);
+  CHECK(machine_equal(plain, traced));
+
+  // The same instructions, logged as most emulators do. PCMEM only where the trace has it
+  FILE *logs[2] = { fopen(argv[2], "w"), fopen(argv[3], "w") };
+  CHECK(logs[0] && logs[1]);
+  if (!logs[0] || !logs[1]) return 2;
+
+  Machine *stepped = trace_boot();
+  SM83 *cpu = &stepped->cpu;
+  for (unsigned long record = 0; cpu->cycles < CYCLES; record++) {
+    for (int i = 0; i < 2; i++) {
+      const uint8_t a = i && record == BAD_RECORD ? (uint8_t)(cpu->a ^ 1) : cpu->a;
+      fprintf(logs[i], "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X", a, cpu->f,
+              cpu->b, cpu->c, cpu->d, cpu->e, cpu->h, cpu->l, cpu->sp, cpu->pc);
+      if (cpu->pc < 0xFF00) {
+        const uint8_t *memory = &stepped->memory[cpu->pc];
+        fprintf(logs[i], " PCMEM:%02X,%02X,%02X,%02X", memory[0], memory[1], memory[2], memory[3]);
+      }
+      fputc('\n', logs[i]);
+    }
+    SM83_step(cpu);
+  }
+  for (int i = 0; i < 2; i++) CHECK(fclose(logs[i]) == 0);
+  CHECK(machine_equal(plain, stepped));
+
+  shutdown(plain);
+  shutdown(traced);
+  shutdown(stepped);
+
+  printf("%s: %u failed checks\n", MODE, failures);
+  return failures != 0;
+}
@@ -0,0 +1,1089 @@
+// Directed tests for what GameboyCPUTests can't reach (state outside the registers, the
+// paths around instructions rather than in them), built once per core (see `make test-units`)
+#define _POSIX_C_SOURCE 200809L
+
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+#define SM83_POOL_IMPLEMENTATION
+#include "SM83_pool.h"
+
+#include <pthread.h>
+
+#include "machine.h"
+
+// ** Tests **
+
+static void test_reset(void) {
+  static const uint8_t program[] = {
+    0x28, 0x02, // JR Z, +2
+    0x00, 0x00,
+    0x18, 0xFE, // JR -2
+  };
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+
+  // F alone says Z, whatever the lazy flags were left at
+  cpu->af = 0x0080;
+  SM83_step(cpu);
+  CHECK(cpu->pc == 0x0004);
+
+  cpu->pc = 0;
+  SM83_run(cpu, 1);
+  CHECK(cpu->pc == 0x0004);
+  shutdown(machine);
+}
+
+// Instances set up from several threads at once (the flag tables get filled on the first),
+// see units_tsan
+#define SETUP_THREADS 8
+
+static void *setup_thread(void *data) {
+  static const uint8_t program[] = {
+    0x3E, 0x0F, // LD A, 0x0F
+    0xC6, 0x01, // ADD A, 0x01
+    0x27,       // DAA
+    0xD6, 0x16, // SUB 0x16
+  };
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+
+  for (unsigned i = 0; i < 4; i++) SM83_step(cpu);
+  *(uint16_t *)data = cpu->af;
+  shutdown(machine);
+  return NULL;
+}
+
+static void test_setup_threads(void) {
+  pthread_t threads[SETUP_THREADS];
+  uint16_t af[SETUP_THREADS] = { 0 };
+
+  for (unsigned i = 0; i < SETUP_THREADS; i++) CHECK(pthread_create(&threads[i], NULL, setup_thread, &af[i]) == 0);
+  for (unsigned i = 0; i < SETUP_THREADS; i++) pthread_join(threads[i], NULL);
+
+  // 0x0F + 1 = 0x10, DAA 0x16, - 0x16 = 0 with Z and N
+  for (unsigned i = 0; i < SETUP_THREADS; i++) CHECK(af[i] == 0x00C0);
+}
+
+// EI enables interrupts only after the instruction that follows it, whichever way it runs
+static void test_ei_delay(void) {
+  static const uint8_t program[] = {
+    0xFB, // EI
+    0x00, // NOP
+    0x00, // NOP
+  };
+
+  // One instruction at a time
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+  cpu->ie = SM83_INT_VBLANK;
+  cpu->if_ = SM83_INT_VBLANK;
+
+  CHECK(SM83_step(cpu) == 4);
+  CHECK(cpu->pc == 0x0001 && !cpu->ime);
+  CHECK(SM83_step(cpu) == 4);
+  CHECK(cpu->pc == 0x0002 && cpu->ime);
+  CHECK(SM83_step(cpu) == 20);
+  CHECK(cpu->pc == 0x0040 && !cpu->ime && !cpu->if_);
+  CHECK(cpu->sp == 0xFFFC && machine->memory[0xFFFC] == 0x02 && machine->memory[0xFFFD] == 0x00);
+  shutdown(machine);
+
+  // In one go: EI, the NOP, then straight to the handler, not one instruction more
+  machine = boot(program, sizeof(program));
+  cpu = &machine->cpu;
+  cpu->ie = SM83_INT_VBLANK;
+  cpu->if_ = SM83_INT_VBLANK;
+
+  CHECK(SM83_run(cpu, 12) == 28);
+  CHECK(cpu->pc == 0x0040 && cpu->sp == 0xFFFC && machine->memory[0xFFFC] == 0x02);
+
+  // And DI right after EI never lets one through
+  machine->memory[0x0040] = 0xFB; // EI
+  machine->memory[0x0041] = 0xF3; // DI
+  machine->memory[0x0042] = 0x18; // JR -2
+  machine->memory[0x0043] = 0xFE;
+  cpu->if_ = SM83_INT_VBLANK;
+  SM83_run(cpu, 100);
+  CHECK(cpu->pc == 0x0042 && cpu->sp == 0xFFFC && cpu->if_ == SM83_INT_VBLANK);
+  shutdown(machine);
+}
+
+// The lowest pending bit enabled in IE wins and is the only one cleared, RETI takes the next
+static void test_interrupt_order(void) {
+  static const uint8_t program[] = {
+    0x00, // NOP
+    0x00, // NOP
+  };
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+  machine->memory[0x0050] = 0xD9; // Timer: RETI
+  machine->memory[0x0060] = 0x18; // Joypad: JR -2
+  machine->memory[0x0061] = 0xFE;
+
+  cpu->ime = 1;
+  cpu->ie = SM83_INT_TIMER | SM83_INT_JOYPAD;
+  cpu->if_ = SM83_INT_STAT | SM83_INT_JOYPAD | SM83_INT_TIMER; // STAT isn't enabled
+
+  CHECK(SM83_step(cpu) == 20);
+  CHECK(cpu->pc == 0x0050 && !cpu->ime);
+  CHECK(cpu->if_ == (SM83_INT_STAT | SM83_INT_JOYPAD));
+
+  CHECK(SM83_step(cpu) == 16); // RETI, IME on right away
+  CHECK(cpu->pc == 0x0000 && cpu->ime);
+
+  CHECK(SM83_step(cpu) == 20);
+  CHECK(cpu->pc == 0x0060 && cpu->if_ == SM83_INT_STAT);
+
+  // Same order through SM83_run
+  cpu->pc = 0;
+  cpu->sp = 0xFFFE;
+  cpu->ime = 1;
+  cpu->if_ = SM83_INT_STAT | SM83_INT_JOYPAD | SM83_INT_TIMER;
+  SM83_run(cpu, 36);
+  CHECK(cpu->pc == 0x0000 && cpu->if_ == (SM83_INT_STAT | SM83_INT_JOYPAD));
+  SM83_run(cpu, 20);
+  CHECK(cpu->pc == 0x0060 && cpu->if_ == SM83_INT_STAT);
+  shutdown(machine);
+}
+
+static void raise_timer(SM83 *cpu, void *data, uint64_t when) {
+  (void)data;
+  (void)when;
+  SM83_interrupt(cpu, SM83_INT_TIMER);
+}
+
+// HALT waits for an interrupt, with or without IME, and doesn't wait at all with one
+// already pending and IME off
+static void test_halt(void) {
+  static const uint8_t program[] = {
+    0x76, // HALT
+    0x04, // INC B
+    0x18, 0xFE, // JR -2
+  };
+
+  // Woken by an event, no IME: carries on after HALT, IF left as it is
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+  cpu->ie = SM83_INT_TIMER;
+  machine->memory[0x0050] = 0x18; // JR -2
+  machine->memory[0x0051] = 0xFE;
+
+  CHECK(SM83_step(cpu) == 4);
+  CHECK(cpu->halted && cpu->pc == 0x0001);
+  CHECK(SM83_step(cpu) == 4);
+  CHECK(cpu->halted && cpu->pc == 0x0001);
+
+  // Halted through the whole slice, in whole M-cycles
+  const uint64_t cycles = cpu->cycles;
+  CHECK(SM83_run(cpu, 1001) == 1004);
+  CHECK(cpu->halted && cpu->cycles == cycles + 1004);
+
+  SM83_schedule(cpu, cpu->cycles + 100, raise_timer, NULL);
+  SM83_run(cpu, 200);
+  CHECK(!cpu->halted && cpu->b == 1 && cpu->pc == 0x0002);
+  CHECK(cpu->if_ == SM83_INT_TIMER);
+  shutdown(machine);
+
+  // Woken with IME: straight into the handler
+  machine = boot(program, sizeof(program));
+  cpu = &machine->cpu;
+  cpu->ie = SM83_INT_TIMER;
+  cpu->ime = 1;
+  machine->memory[0x0050] = 0x18; // JR -2
+  machine->memory[0x0051] = 0xFE;
+
+  SM83_schedule(cpu, 100, raise_timer, NULL);
+  SM83_run(cpu, 200);
+  CHECK(!cpu->halted && cpu->b == 0 && cpu->pc == 0x0050 && !cpu->if_);
+  CHECK(machine->memory[0xFFFC] == 0x01 && machine->memory[0xFFFD] == 0x00);
+  shutdown(machine);
+
+  // Already pending, no IME: HALT ends right away
+  machine = boot(program, sizeof(program));
+  cpu = &machine->cpu;
+  cpu->ie = SM83_INT_TIMER;
+  cpu->if_ = SM83_INT_TIMER;
+
+  CHECK(SM83_step(cpu) == 4);
+  CHECK(!cpu->halted && cpu->pc == 0x0001);
+  SM83_run(cpu, 4);
+  CHECK(cpu->b == 1);
+  shutdown(machine);
+
+  // STOP sleeps the same way, through whole slices, until the joypad interrupt
+  machine = boot(program, sizeof(program));
+  cpu = &machine->cpu;
+  machine->memory[0x0000] = 0x10; // STOP
+  cpu->ie = SM83_INT_JOYPAD;
+
+  CHECK(SM83_run(cpu, 1001) == 1004);
+  CHECK(cpu->halted && cpu->pc == 0x0001 && cpu->b == 0);
+  SM83_interrupt(cpu, SM83_INT_JOYPAD);
+  SM83_run(cpu, 8);
+  CHECK(!cpu->halted && cpu->b == 1 && cpu->pc == 0x0002);
+  shutdown(machine);
+}
+
+// Events seen, in order: which one, when it was due, and when it ran
+typedef struct Seen {
+  uintptr_t id;
+  uint64_t when, cycles;
+} Seen;
+
+static Seen seen[64];
+static unsigned seen_count;
+
+static void record(SM83 *cpu, void *data, uint64_t when) {
+  if (seen_count < 64) seen[seen_count++] = (Seen){ (uintptr_t)data, when, cpu->cycles };
+}
+
+static void every_64(SM83 *cpu, void *data, uint64_t when) {
+  record(cpu, data, when);
+  SM83_schedule(cpu, when + 64, every_64, data);
+}
+
+// Events run in order, on time (the slice is cut right at them), can be cancelled and can
+// schedule themselves again. Memory is all NOPs, 4 T-cycles each
+static void test_events(void) {
+  static const uint8_t program[] = { 0x00 };
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+
+  seen_count = 0;
+  CHECK(SM83_schedule(cpu, 300, record, (void *)3) == 0);
+  CHECK(SM83_schedule(cpu, 100, record, (void *)1) == 0);
+  CHECK(SM83_schedule(cpu, 202, record, (void *)2) == 0); // Halfway through a NOP
+  CHECK(SM83_schedule(cpu, 400, record, (void *)4) == 0);
+  CHECK(SM83_schedule(cpu, 150, record, (void *)5) == 0);
+  CHECK(SM83_schedule(cpu, 250, record, (void *)5) == 0);
+  SM83_cancel(cpu, record, (void *)5);
+
+  CHECK(SM83_run(cpu, 350) == 352);
+  CHECK(seen_count == 3);
+  CHECK(seen[0].id == 1 && seen[0].when == 100 && seen[0].cycles == 100);
+  CHECK(seen[1].id == 2 && seen[1].when == 202 && seen[1].cycles == 204);
+  CHECK(seen[2].id == 3 && seen[2].when == 300 && seen[2].cycles == 300);
+  CHECK(cpu->pc == 352 / 4);
+
+  // Still pending after the run, and one already due runs as the next one starts
+  CHECK(SM83_schedule(cpu, 10, record, (void *)6) == 0);
+  SM83_run(cpu, 4);
+  CHECK(seen_count == 4 && seen[3].id == 6 && seen[3].cycles == 352);
+  SM83_run(cpu, 100);
+  CHECK(seen_count == 5 && seen[4].id == 4 && seen[4].cycles == 400);
+
+  // Rescheduling itself: every 64 T-cycles from 512 on, up to 1024 included, then cancelled
+  seen_count = 0;
+  SM83_schedule(cpu, 512, every_64, (void *)7);
+  SM83_run(cpu, 1024 - cpu->cycles);
+  CHECK(seen_count == 9);
+  for (unsigned i = 0; i < seen_count; i++) CHECK(seen[i].when == 512 + 64 * i && seen[i].cycles == seen[i].when);
+  SM83_cancel(cpu, every_64, (void *)7);
+  CHECK(cpu->event_count == 0);
+  SM83_run(cpu, 1000);
+  CHECK(seen_count == 9);
+
+  // Full
+  for (unsigned i = 0; i < SM83_MAX_EVENTS; i++) CHECK(SM83_schedule(cpu, cpu->cycles + 1000 - i, record, NULL) == 0);
+  CHECK(SM83_schedule(cpu, cpu->cycles + 1, record, NULL) == -1);
+  seen_count = 0;
+  SM83_run(cpu, 2000);
+  CHECK(seen_count == SM83_MAX_EVENTS);
+  for (unsigned i = 1; i < seen_count; i++) CHECK(seen[i].when > seen[i - 1].when);
+  shutdown(machine);
+}
+
+// Code rewritten through another mapping of the same memory (echo RAM) doesn't run stale
+static void test_alias(void) {
+  static const uint8_t program[] = {
+    0xCD, 0x00, 0xC0, // CALL 0xC000
+    0x47,             // LD B, A
+    0x3E, 0x02,       // LD A, 2
+    0xEA, 0x01, 0xE0, // LD [0xE001], A
+    0xCD, 0x00, 0xC0, // CALL 0xC000
+    0x18, 0xFE,       // JR -2
+  };
+  static const uint8_t function[] = {
+    0x3E, 0x01, // LD A, 1
+    0xC9,       // RET
+  };
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+  memcpy(machine->memory + 0xC000, function, sizeof(function));
+  SM83_map(cpu, 0xE000, 0x1E00, machine->memory + 0xC000, machine->memory + 0xC000);
+
+  SM83_run(cpu, 200);
+  CHECK(cpu->b == 0x01);
+  CHECK(cpu->a == 0x02);
+  CHECK(machine->memory[0xC001] == 0x02);
+  shutdown(machine);
+}
+
+// Writes mark the pages they went through, whether mapped, behind the callbacks or an echo
+// of other memory (its own pages, not the memory's), and reading the bits clears them.
+// Without SM83_DIRTY_PAGES every page is reported dirty
+static void test_dirty_pages(void) {
+  static const uint8_t program[] = {
+    0x3E, 0x01,       // LD A, 1
+    0xEA, 0x10, 0xC0, // LD [0xC010], A
+    0xEA, 0x23, 0xE1, // LD [0xE123], A
+    0xE0, 0x80,       // LDH [0xFF80], A
+    0x08, 0xFF, 0xD0, // LD [0xD0FF], SP
+    0x18, 0xFE,       // JR -2
+  };
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+  SM83_map(cpu, 0xE000, 0x1E00, machine->memory + 0xC000, machine->memory + 0xC000);
+
+  uint8_t expected[0x20], pages[0x20];
+#ifdef SM83_DIRTY_PAGES
+  static const uint16_t written[] = { 0xC0, 0xE1, 0xFF, 0xD0, 0xD1 };
+  memset(expected, 0, sizeof(expected));
+  for (size_t i = 0; i < sizeof(written) / sizeof(written[0]); i++)
+    expected[written[i] >> 3] |= (uint8_t)(1 << (written[i] & 7));
+#else
+  memset(expected, 0xFF, sizeof(expected));
+#endif
+
+  SM83_run(cpu, 200);
+  CHECK(machine->memory[0xC123] == 0x01 && machine->memory[0xFF80] == 0x01);
+  SM83_dirty_pages(cpu, pages);
+  CHECK(!memcmp(pages, expected, sizeof(pages)));
+
+  // Nothing written since
+#ifdef SM83_DIRTY_PAGES
+  memset(expected, 0, sizeof(expected));
+#endif
+  SM83_run(cpu, 200);
+  SM83_dirty_pages(cpu, pages);
+  CHECK(!memcmp(pages, expected, sizeof(pages)));
+  shutdown(machine);
+}
+
+// Fills a page of WRAM over and over, turning its own INC B into DEC B after the first time
+static const uint8_t patching[] = {
+  0x21, 0x00, 0xC0, // LD HL, 0xC000
+  0x04,             // loop: INC B, then DEC B
+  0x78,             // LD A, B
+  0x86,             // ADD A, [HL]
+  0x77,             // LD [HL], A
+  0x2C,             // INC L
+  0x20, 0xF9,       // JR NZ, loop
+  0x3E, 0x05,       // LD A, 0x05
+  0xEA, 0x03, 0x00, // LD [0x0003], A
+  0x18, 0xF2,       // JR loop
+};
+
+// What SM83_load_state restores runs on exactly as it did, code that changed since included
+static void test_save_state(void) {
+  Machine *machine = boot(patching, sizeof(patching));
+  SM83 *cpu = &machine->cpu;
+  const SM83Region regions[] = { { machine->memory, 0x100 }, { machine->memory + 0xC000, 0x100 } };
+  const size_t size = SM83_state_size(regions, 2);
+  CHECK(size == sizeof(SM83State) + 0x200);
+
+  uint8_t *state = (uint8_t *)malloc(size + 1);
+  Machine *saved = (Machine *)malloc(sizeof(Machine));
+  Machine *later = (Machine *)malloc(sizeof(Machine));
+  if (!state || !saved || !later) { fprintf(stderr, "Out of memory\n"); exit(2); }
+
+  SM83_run(cpu, 500);
+  cpu->ie = SM83_INT_TIMER;
+  cpu->if_ = SM83_INT_SERIAL;
+  CHECK(SM83_save_state(cpu, state, size - 1, regions, 2) == 0);
+  CHECK(SM83_save_state(cpu, state, size + 1, regions, 2) == size);
+  memcpy(saved, machine, sizeof(Machine));
+
+  SM83_run(cpu, 12000);
+  memcpy(later, machine, sizeof(Machine));
+
+  // The INC B is a DEC B by now, the blocks made of it must go
+  CHECK(SM83_load_state(cpu, state, size, regions, 2) == 0);
+  CHECK(machine_equal(machine, saved));
+  SM83_run(cpu, 12000);
+  CHECK(machine_equal(machine, later));
+
+  // Anything that isn't that state is left alone
+  CHECK(SM83_load_state(cpu, state, size - 1, regions, 2) == -1);
+  CHECK(SM83_load_state(cpu, state, size, regions, 1) == -1);
+
+  const size_t version = offsetof(SM83State, version);
+  state[version] ^= 0xFF;
+  CHECK(SM83_load_state(cpu, state, size, regions, 2) == -1);
+  state[version] ^= 0xFF;
+
+  const size_t magic = offsetof(SM83State, magic);
+  state[magic] ^= 0xFF;
+  CHECK(SM83_load_state(cpu, state, size, regions, 2) == -1);
+  state[magic] ^= 0xFF;
+  CHECK(machine_equal(machine, later));
+
+  CHECK(SM83_load_state(cpu, state, size, regions, 2) == 0);
+  CHECK(machine_equal(machine, saved));
+
+  free(state);
+  free(saved);
+  free(later);
+  shutdown(machine);
+}
+
+// Pushes and random rewinds, checked against every state saved as is into a plain array.
+// `room` for the encoded frames decides how many are kept
+#define REWIND_PUSHES 1500
+
+static void rewind_against_history(size_t room, unsigned interval) {
+  Machine *machine = boot(patching, sizeof(patching));
+  SM83 *cpu = &machine->cpu;
+  const SM83Region regions[] = { { machine->memory, 0x100 }, { machine->memory + 0xC000, 0x100 } };
+  const size_t size = SM83_state_size(regions, 2);
+
+  static SM83Rewind rewind;
+  uint8_t *memory = (uint8_t *)malloc(2 * size + room);
+  uint8_t *history = (uint8_t *)malloc(REWIND_PUSHES * size);
+  uint8_t *state = (uint8_t *)malloc(size);
+  if (!memory || !history || !state) { fprintf(stderr, "Out of memory\n"); exit(2); }
+
+  CHECK(SM83_rewind_init(&rewind, memory, 2 * size - 1, regions, 2, interval) == -1);
+  CHECK(SM83_rewind_init(&rewind, memory, 2 * size + room, regions, 2, interval) == 0);
+
+  unsigned frames = 0, dropped = 0; // In the history, and dropped from the rewind for room
+  for (unsigned push = 0; push < REWIND_PUSHES; push++) {
+    SM83_run(cpu, 64 + machine_random(machine) % 256);
+    CHECK(SM83_rewind_push(&rewind, cpu) == 0);
+    SM83_save_state(cpu, history + frames++ * size, size, regions, 2);
+    if (rewind.length < frames - dropped) dropped = frames - rewind.length;
+
+    if (machine_random(machine) % 8) continue;
+
+    // Back to what the history has for the frame left newest
+    const unsigned back = machine_random(machine) % 6, kept = rewind.length;
+    CHECK(SM83_rewind(&rewind, cpu, back) == (back < kept ? back : kept - 1));
+    frames -= back < kept ? back : kept - 1;
+    SM83_save_state(cpu, state, size, regions, 2);
+    CHECK(!memcmp(state, history + (frames - 1) * size, size));
+  }
+
+  // All the way back to the oldest frame kept
+  const unsigned kept = rewind.length;
+  CHECK(kept == frames - dropped);
+  CHECK(SM83_rewind(&rewind, cpu, ~0u) == kept - 1);
+  frames -= kept - 1;
+  SM83_save_state(cpu, state, size, regions, 2);
+  CHECK(!memcmp(state, history + (frames - 1) * size, size));
+  CHECK(rewind.length == 1 && rewind_frame(&rewind, 0)->key);
+
+  free(memory);
+  free(history);
+  free(state);
+  shutdown(machine);
+  CHECK(dropped > 0);
+}
+
+static void test_rewind(void) {
+  // Out of frames (SM83_REWIND_FRAMES) long before running out of room
+  rewind_against_history(1 << 20, 8);
+
+  // Wrapping around the room many times over, a keyframe every 8 frames
+  rewind_against_history(2048, 8);
+
+  // Room for a single keyframe: dropping it drops the frames made from it, and the next
+  // frame has to be encoded again as a keyframe
+  rewind_against_history(1024, 1000);
+}
+
+// SM83_pool_run leaves every instance where SM83_run would have, one after the other. The
+// instances have to be side by side, so these keep their memory apart
+#define POOL_INSTANCES 24
+
+static uint8_t pool_read(void *userdata, uint16_t addr) {
+  return ((const uint8_t *)userdata)[addr];
+}
+
+static void pool_write(void *userdata, uint16_t addr, uint8_t value) {
+  ((uint8_t *)userdata)[addr] = value;
+}
+
+static void pool_interrupt(SM83 *cpu, void *data, uint64_t when) {
+  SM83_interrupt(cpu, SM83_INT_VBLANK);
+  SM83_schedule(cpu, when + 700, pool_interrupt, data);
+}
+
+// Random code taking interrupts, but every fourth instance halts for good right away
+static void pool_boot(SM83 *cpu, uint8_t *memory, uint32_t seed) {
+  uint32_t random = seed * 2654435761u | 1;
+  for (size_t i = 0; i < 0x10000; i++) {
+    random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+    memory[i] = (uint8_t)random;
+  }
+
+  SM83_init_userdata(cpu, pool_read, pool_write, memory);
+  SM83_map(cpu, 0x0000, 0xFF00, memory, memory);
+  SM83_reset(cpu);
+  cpu->pc = 0x0100;
+  cpu->sp = 0xDFFE;
+
+  if (seed % 4 == 0) {
+    memory[0x0100] = 0xF3; // DI
+    memory[0x0101] = 0x76; // HALT
+  } else {
+    cpu->ime = 1;
+    cpu->ie = SM83_INT_VBLANK;
+    SM83_schedule(cpu, 100 + seed * 37, pool_interrupt, NULL);
+  }
+}
+
+static int pool_equal(const SM83 *x, const uint8_t *a, const SM83 *y, const uint8_t *b) {
+  return x->af == y->af && x->bc == y->bc && x->de == y->de && x->hl == y->hl && x->sp == y->sp && x->pc == y->pc &&
+         x->ime == y->ime && x->ime_delay == y->ime_delay && x->halted == y->halted &&
+         x->ie == y->ie && x->if_ == y->if_ && x->cycles == y->cycles && memcmp(a, b, 0x10000) == 0;
+}
+
+static void test_pool(void) {
+  SM83 *pooled = (SM83 *)calloc(POOL_INSTANCES, sizeof(SM83));
+  SM83 *serial = (SM83 *)calloc(POOL_INSTANCES, sizeof(SM83));
+  uint8_t *memory = (uint8_t *)malloc(2 * POOL_INSTANCES * 0x10000);
+  if (!pooled || !serial || !memory) { fprintf(stderr, "Out of memory\n"); exit(2); }
+
+  for (uint32_t i = 0; i < POOL_INSTANCES; i++) {
+    pool_boot(&pooled[i], memory + i * 0x10000, i);
+    pool_boot(&serial[i], memory + (POOL_INSTANCES + i) * 0x10000, i);
+  }
+
+  // More threads than cores, then one per core without `ran`, then more than instances
+  static const unsigned threads[] = { 5, 0, POOL_INSTANCES * 2 };
+  for (unsigned run = 0; run < 3; run++) {
+    const uint64_t cycles = 20000 + run * 3333;
+    uint64_t ran[POOL_INSTANCES];
+    memset(ran, 0, sizeof(ran));
+    SM83_pool_run(pooled, POOL_INSTANCES, cycles, run == 1 ? NULL : ran, threads[run]);
+
+    for (size_t i = 0; i < POOL_INSTANCES; i++) {
+      const uint64_t expected = SM83_run(&serial[i], cycles);
+      CHECK(run == 1 ? ran[i] == 0 : ran[i] == expected);
+      CHECK(pool_equal(&pooled[i], memory + i * 0x10000, &serial[i], memory + (POOL_INSTANCES + i) * 0x10000));
+    }
+  }
+  CHECK(pooled[0].halted && pooled[0].cycles == serial[0].cycles);
+
+  for (size_t i = 0; i < POOL_INSTANCES; i++) {
+    SM83_free(&pooled[i]);
+    SM83_free(&serial[i]);
+  }
+  free(pooled);
+  free(serial);
+  free(memory);
+}
+
+// A known run of bytes, through both the text and the index, down to an instruction cut
+// short by the end of the buffer
+typedef struct Listing {
+  SM83Disassembly instructions[16];
+  size_t count;
+} Listing;
+
+static void list(void *data, const SM83Disassembly *instruction) {
+  Listing *listing = (Listing *)data;
+  if (listing->count < 16) listing->instructions[listing->count] = *instruction;
+  listing->count++;
+}
+
+static void test_disassemble(void) {
+  static const uint8_t code[] = {
+    0x01, 0x34, 0x12, // LD BC, 0x1234
+    0x3E, 0x7F,       // LD A, 0x7F
+    0xCB, 0x37,       // SWAP A
+    0x18, 0xFE,       // JR -2
+    0xD3,             // Invalid
+    0xE0, 0x80,       // LDH [0xFF80], A
+    0x01, 0x00,       // LD BC, nn with one byte of nn
+  };
+  static const struct { const char *text; uint16_t addr, opcode, operand; uint8_t length; } expected[] = {
+    { "LD BC, 0x1234", 0x0150, 0x01, 0x1234, 3 },
+    { "LD A, 0x7F", 0x0153, 0x3E, 0x7F, 2 },
+    { "SWAP A", 0x0155, 0xCB37, 0, 2 },
+    { "JR 0xFE", 0x0157, 0x18, 0xFE, 2 },
+    { "INVALID", 0x0159, 0xD3, 0, 1 },
+    { "LDH [0x80], A", 0x015A, 0xE0, 0x80, 2 },
+    { "DB 0x01", 0x015C, SM83_DISASSEMBLY_DATA, 0x01, 1 }, // Then the 0x00 on its own
+    { "NOP", 0x015D, 0x00, 0, 1 },
+  };
+  const size_t count = sizeof(expected) / sizeof(expected[0]);
+
+  Listing listing = { .count = 0 };
+  SM83_disassemble(code, sizeof(code), 0x0150, list, &listing);
+  CHECK(listing.count == count);
+
+  SM83IndexEntry index[sizeof(code)];
+  CHECK(SM83_disassemble_index(code, sizeof(code), index) == count);
+
+  for (size_t i = 0; i < count && i < listing.count; i++) {
+    const SM83Disassembly *instruction = &listing.instructions[i];
+    CHECK(!strcmp(instruction->text, expected[i].text));
+    CHECK(instruction->addr == expected[i].addr && instruction->offset == (size_t)(expected[i].addr - 0x0150));
+    CHECK(instruction->opcode == expected[i].opcode && instruction->operand == expected[i].operand);
+    CHECK(instruction->length == expected[i].length);
+    CHECK(index[i].offset == instruction->offset);
+    CHECK(index[i].opcode == instruction->opcode && index[i].operand == instruction->operand);
+  }
+}
+
+// SM83_pool_disassemble(_index) on a random ROM of four banks, against going through the
+// banks one after the other. LD BC, nn at 0x3FFF doesn't fit in bank 0, so it's data there
+// and bank 1 starts over at 0x4000
+#define DISASSEMBLY_ROM 0x10000
+
+typedef struct PoolListing {
+  SM83Disassembly *at; // By offset in the ROM
+  uint8_t *seen;
+  unsigned misplaced;
+} PoolListing;
+
+// Called from every thread, but each instruction has a slot of its own
+static void pool_list(void *data, size_t bank, const SM83Disassembly *instruction) {
+  PoolListing *listing = (PoolListing *)data;
+  if (instruction->offset >= DISASSEMBLY_ROM || instruction->offset / 0x4000 != bank) { listing->misplaced = 1; return; }
+  listing->at[instruction->offset] = *instruction;
+  listing->seen[instruction->offset] = 1;
+}
+
+static void test_pool_disassemble(void) {
+  uint8_t *rom = (uint8_t *)malloc(DISASSEMBLY_ROM);
+  SM83IndexEntry *pooled = (SM83IndexEntry *)malloc(DISASSEMBLY_ROM * sizeof(SM83IndexEntry));
+  SM83IndexEntry *serial = (SM83IndexEntry *)malloc(DISASSEMBLY_ROM * sizeof(SM83IndexEntry));
+  PoolListing listing = { (SM83Disassembly *)malloc(DISASSEMBLY_ROM * sizeof(SM83Disassembly)),
+                          (uint8_t *)calloc(DISASSEMBLY_ROM, 1), 0 };
+  if (!rom || !pooled || !serial || !listing.at || !listing.seen) { fprintf(stderr, "Out of memory\n"); exit(2); }
+
+  uint32_t random = 1;
+  for (size_t i = 0; i < DISASSEMBLY_ROM; i++) {
+    random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+    rom[i] = (uint8_t)random;
+  }
+  rom[0x3FFD] = rom[0x3FFE] = 0x00; // NOPs, so that whatever comes before, 0x3FFF starts one
+  rom[0x3FFF] = 0x01;
+
+  size_t count = 0;
+  for (size_t bank = 0; bank < DISASSEMBLY_ROM / 0x4000; bank++) {
+    const size_t found = SM83_disassemble_index(rom + bank * 0x4000, 0x4000, serial + count);
+    for (size_t i = count; i < count + found; i++) serial[i].offset += (uint32_t)(bank * 0x4000);
+    count += found;
+  }
+
+  CHECK(SM83_pool_disassemble_index(rom, DISASSEMBLY_ROM, pooled, 3) == count);
+  int same = 1;
+  for (size_t i = 0; i < count; i++) {
+    if (pooled[i].offset != serial[i].offset || pooled[i].opcode != serial[i].opcode ||
+        pooled[i].operand != serial[i].operand) same = 0;
+  }
+  CHECK(same);
+
+  // 0x3FFF cut short, 0x4000 the first of bank 1
+  size_t straddling = 0;
+  while (straddling < count && serial[straddling].offset < 0x3FFF) straddling++;
+  CHECK(straddling + 1 < count && serial[straddling].offset == 0x3FFF && serial[straddling + 1].offset == 0x4000);
+  CHECK(serial[straddling].opcode == SM83_DISASSEMBLY_DATA && serial[straddling].operand == 0x01);
+
+  // The same instructions with their text, at ROM offsets and where the CPU sees them
+  SM83_pool_disassemble(rom, DISASSEMBLY_ROM, pool_list, &listing, 3);
+  CHECK(!listing.misplaced);
+  size_t listed = 0;
+  for (size_t i = 0; i < DISASSEMBLY_ROM; i++) listed += listing.seen[i];
+  CHECK(listed == count);
+
+  same = 1;
+  for (size_t i = 0; i < count; i++) {
+    const SM83Disassembly *instruction = &listing.at[serial[i].offset];
+    const size_t bank = serial[i].offset / 0x4000;
+    if (!listing.seen[serial[i].offset] || instruction->opcode != serial[i].opcode ||
+        instruction->operand != serial[i].operand ||
+        instruction->addr != (uint16_t)((bank ? 0x4000 : 0) + serial[i].offset % 0x4000)) same = 0;
+  }
+  CHECK(same);
+  CHECK(!strcmp(listing.at[0x3FFF].text, "DB 0x01") && listing.at[0x3FFF].addr == 0x3FFF);
+  CHECK(listing.seen[0x4000] && listing.at[0x4000].addr == 0x4000);
+
+  free(rom);
+  free(pooled);
+  free(serial);
+  free(listing.at);
+  free(listing.seen);
+}
+
+// SM83_batch_run against every lane run on its own through SM83_run, on random code that's
+// mostly what the batch runs across lanes (LD r,r', ALU A,r, INC/DEC r). Every other seed
+// has nothing else, so that lanes with registers of their own stay in step throughout; the
+// rest branch on the flags and take interrupts, so that lanes go separate ways and get back
+// together. Each lane has RAM of its own, the ROM is the same for all
+#define BATCH_SEEDS 60
+#define BATCH_LANE_COUNT 16
+
+typedef struct BatchLane {
+  SM83 *cpu;
+  uint8_t memory[0x10000];
+} BatchLane;
+
+static uint8_t lane_read(void *userdata, uint16_t addr) {
+  const BatchLane *lane = (const BatchLane *)userdata;
+  if (addr == 0xFFFF) return lane->cpu->ie;
+  if (addr == 0xFF0F) return (uint8_t)(lane->cpu->if_ | 0xE0);
+  return lane->memory[addr];
+}
+
+static void lane_write(void *userdata, uint16_t addr, uint8_t value) {
+  BatchLane *lane = (BatchLane *)userdata;
+  if (addr == 0xFFFF) lane->cpu->ie = value;
+  else if (addr == 0xFF0F) lane->cpu->if_ = value & 0x1F;
+  else if (addr >= 0x8000) lane->memory[addr] = value;
+}
+
+static void lane_interrupt(SM83 *cpu, void *data, uint64_t when) {
+  SM83_interrupt(cpu, (uint8_t)(1 << (when % 5)));
+  SM83_schedule(cpu, when + 300 + (when * 7) % 900, lane_interrupt, data);
+}
+
+static void batch_program(uint8_t *rom, uint32_t random, int straight) {
+#define RANDOM() (random ^= random << 13, random ^= random >> 17, random ^= random << 5)
+  for (size_t at = 0; at < 0x7FFF;) { // A JR may end on the RST, which takes its place
+    const uint32_t r = RANDOM();
+    if (straight) {
+      rom[at] = (uint8_t)(r % 4 ? 0x40 + (r >> 8) % 0x80 : (r >> 8) % 8 << 3 | 4 | (r >> 12) % 2);
+      if (rom[at] == 0x76) rom[at] = 0x00; // No HALT
+      at++;
+      continue;
+    }
+    switch (r % 16) {
+      case 0: case 1: case 2: case 3: case 4: rom[at++] = (uint8_t)(0x80 + (r >> 8) % 0x40); break; // ALU A,r
+      case 5: case 6: case 7: rom[at++] = (uint8_t)(0x40 + (r >> 8) % 0x40); break; // LD r,r' (and HALT)
+      case 8: case 9: rom[at++] = (uint8_t)((r >> 8) % 8 << 3 | 4 | (r >> 12) % 2); break; // INC/DEC r
+      case 10: rom[at++] = 0x00; break; // NOP
+      case 11: rom[at++] = (uint8_t)(0x20 | (r >> 8) % 4 << 3); rom[at++] = (uint8_t)((r >> 16) % 16); break; // JR cc, e
+      case 12: rom[at++] = 0xFB; break; // EI
+      default: rom[at++] = (uint8_t)(r >> 8); break;
+    }
+  }
+#undef RANDOM
+  rom[0x7FFF] = 0xC7; // RST 0x00, past the end
+}
+
+static void batch_boot(SM83 *cpus, BatchLane *lanes, const uint8_t *rom, uint32_t seed, int straight) {
+  uint32_t random = seed * 2654435761u | 1;
+#define RANDOM() (random ^= random << 13, random ^= random >> 17, random ^= random << 5)
+  for (unsigned i = 0; i < BATCH_LANE_COUNT; i++) {
+    SM83 *cpu = &cpus[i];
+    BatchLane *lane = &lanes[i];
+    lane->cpu = cpu;
+    memset(lane->memory, 0, sizeof(lane->memory));
+
+    SM83_init_userdata(cpu, lane_read, lane_write, lane);
+    SM83_map(cpu, 0x0000, 0x8000, rom, NULL);
+    SM83_map(cpu, 0x8000, 0x7F00, lane->memory + 0x8000, lane->memory + 0x8000);
+    SM83_reset(cpu);
+
+    // Straight code keeps lanes in step whatever their registers, else half of them start
+    // out alike to stay so
+    const uint32_t r = straight || i % 2 ? RANDOM() : seed;
+    cpu->af = (uint16_t)(r & 0xFFF0);
+    cpu->bc = (uint16_t)(r >> 16);
+    cpu->de = (uint16_t)(r * 3);
+    cpu->hl = (uint16_t)(0x8000 | r >> 8);
+    cpu->sp = 0xDFF0;
+    cpu->pc = 0x0100;
+    cpu->ime = !straight && r & 1;
+    cpu->ie = (uint8_t)(r >> 3 & 0x1F);
+    SM83_schedule(cpu, 200 + (straight ? seed : r) % 1000, lane_interrupt, NULL);
+  }
+#undef RANDOM
+}
+
+static void test_batch(void) {
+  static uint8_t rom[0x8000];
+  SM83 *batched = (SM83 *)calloc(BATCH_LANE_COUNT, sizeof(SM83));
+  SM83 *alone = (SM83 *)calloc(BATCH_LANE_COUNT, sizeof(SM83));
+  BatchLane *lanes = (BatchLane *)malloc(2 * BATCH_LANE_COUNT * sizeof(BatchLane));
+  static SM83Batch batch;
+  if (!batched || !alone || !lanes) { fprintf(stderr, "Out of memory\n"); exit(2); }
+
+  for (uint32_t seed = 1; seed <= BATCH_SEEDS; seed++) {
+    const int straight = seed % 2;
+    batch_program(rom, seed, straight);
+    batch_boot(batched, lanes, rom, seed, straight);
+    batch_boot(alone, lanes + BATCH_LANE_COUNT, rom, seed, straight);
+    SM83_batch_init(&batch, batched, BATCH_LANE_COUNT);
+
+    int same = 1;
+    for (unsigned run = 0; run < 8 && same; run++) {
+      const uint64_t cycles = 500 + run * 250;
+      SM83_batch_run(&batch, cycles);
+      SM83_batch_sync(&batch);
+
+      for (unsigned i = 0; i < BATCH_LANE_COUNT; i++) {
+        SM83_run(&alone[i], cycles);
+        const SM83 *x = &batched[i], *y = &alone[i];
+        same &= x->af == y->af && x->bc == y->bc && x->de == y->de && x->hl == y->hl && x->sp == y->sp &&
+                x->pc == y->pc && x->ime == y->ime && x->halted == y->halted && x->ie == y->ie &&
+                x->if_ == y->if_ && x->cycles == y->cycles &&
+                !memcmp(lanes[i].memory, lanes[BATCH_LANE_COUNT + i].memory, sizeof(lanes[i].memory));
+      }
+    }
+    if (!same) fprintf(stderr, "batch: seed %u\n", seed);
+    CHECK(same);
+
+    for (unsigned i = 0; i < BATCH_LANE_COUNT; i++) {
+      SM83_free(&batched[i]);
+      SM83_free(&alone[i]);
+    }
+  }
+
+  free(batched);
+  free(alone);
+  free(lanes);
+}
+
+#ifdef SM83_JIT
+// Compiled code is never writable and executable at once
+static void test_jit_wx(void) {
+  static const uint8_t program[] = {
+    0x06, 0x10, // LD B, 0x10
+    0x05,       // loop: DEC B
+    0x20, 0xFD, // JR NZ, loop
+    0x18, 0xFE, // JR -2
+  };
+  Machine *machine = boot(program, sizeof(program));
+  SM83_run(&machine->cpu, 1000);
+  CHECK(machine->cpu.jit_code != NULL);
+
+  FILE *maps = fopen("/proc/self/maps", "r");
+  char line[512];
+  while (maps && fgets(line, sizeof(line), maps)) {
+    unsigned long first, last;
+    char permissions[5];
+    if (sscanf(line, "%lx-%lx %4s", &first, &last, permissions) != 3) continue;
+    if ((uintptr_t)machine->cpu.jit_code < first || (uintptr_t)machine->cpu.jit_code >= last) continue;
+    CHECK(strcmp(permissions, "r-xp") == 0);
+  }
+  if (maps) fclose(maps);
+  shutdown(machine);
+}
+
+// Compiled ALU code, with the registers in host registers and F out of x86's flags, agrees
+// with the interpreter at every stop. HL walks into the unmapped page too, where reads go
+// through the handlers
+static void test_jit_alu(void) {
+  static const uint8_t program[] = {
+    0x3E, 0x9A,       // loop: LD A, 0x9A
+    0x80,             // ADD A, B
+    0x89,             // ADC A, C
+    0x92,             // SUB D
+    0x9B,             // SBC A, E
+    0xCE, 0x0F,       // ADC A, 0x0F
+    0xDE, 0x80,       // SBC A, 0x80
+    0xA4,             // AND H
+    0xAD,             // XOR L
+    0xF6, 0x11,       // OR 0x11
+    0xBF,             // CP A
+    0xFE, 0x40,       // CP 0x40
+    0x47,             // LD B, A
+    0x0C,             // INC C
+    0x15,             // DEC D
+    0x23,             // INC HL
+    0x1B,             // DEC DE
+    0x27,             // DAA (a handler, in between)
+    0xCB, 0x37,       // SWAP A
+    0xCB, 0x23,       // SLA E
+    0xCB, 0x2A,       // SRA D
+    0xCB, 0x39,       // SRL C
+    0xCB, 0x7C,       // BIT 7, H
+    0xCB, 0x9B,       // RES 3, E
+    0xCB, 0xE0,       // SET 4, B
+    0x7E,             // LD A, [HL]
+    0xA6,             // AND [HL]
+    0x2C,             // INC L
+    0x20, 0xD6,       // JR NZ, loop
+    0x18, 0xD4,       // JR loop
+  };
+  Machine *run = boot(program, sizeof(program)), *step = boot(program, sizeof(program));
+  run->cpu.hl = step->cpu.hl = 0xFEF1;
+
+  for (unsigned stop = 0; stop < 200; stop++) {
+    const uint64_t cycles = 1 + machine_random(run) % 97;
+    SM83_run(&run->cpu, cycles);
+    uint64_t stepped = 0;
+    while (stepped < cycles) stepped += SM83_step(&step->cpu);
+    if (!machine_equal(run, step)) {
+      CHECK(machine_equal(run, step));
+      break;
+    }
+  }
+  CHECK(run->cpu.jit_code != NULL);
+
+  shutdown(run);
+  shutdown(step);
+}
+#endif
+
+#ifdef SM83_OPCODE_COUNTS
+// Every run of every opcode counted once, with the M-cycles it took, however it ran
+static void test_opcode_counts(void) {
+  static const uint8_t program[] = {
+    0x06, 0x0A,       // LD B, 10
+    0xAF,             // XOR A
+    0x3C,             // loop: INC A
+    0xCB, 0x37,       // SWAP A
+    0xCD, 0x10, 0x00, // CALL 0x0010
+    0x05,             // DEC B
+    0x20, 0xF7,       // JR NZ, loop
+    0x18, 0xFE,       // JR -2
+    0x00, 0x00,
+    0xC9,             // RET
+  };
+  // Most T-cycles first, then by opcode, with runs by M-cycles taken
+  static const struct { uint16_t opcode; uint64_t runs, cycles, histogram[7]; } expected[] = {
+    { 0xCD, 10, 240, { 0, 0, 0, 0, 0, 0, 10 } },
+    { 0xC9, 10, 160, { 0, 0, 0, 0, 10, 0, 0 } },
+    { 0x20, 10, 116, { 0, 0, 1, 9, 0, 0, 0 } }, // Taken but the last time
+    { 0xCB37, 10, 80, { 0, 0, 10, 0, 0, 0, 0 } },
+    { 0x05, 10, 40, { 0, 10, 0, 0, 0, 0, 0 } },
+    { 0x3C, 10, 40, { 0, 10, 0, 0, 0, 0, 0 } },
+    { 0x06, 1, 8, { 0, 0, 1, 0, 0, 0, 0 } },
+    { 0xAF, 1, 4, { 0, 1, 0, 0, 0, 0, 0 } },
+  };
+  const size_t count = sizeof(expected) / sizeof(expected[0]);
+
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+
+  // Up to the JR -2, in slices that don't line up with the loop
+  while (cpu->cycles < 688) {
+    const uint64_t left = 688 - cpu->cycles;
+    SM83_run(cpu, left < 50 ? left : 50);
+  }
+  CHECK(cpu->cycles == 688 && cpu->pc == 0x000C);
+
+  SM83OpcodeCount counts[0x200];
+  CHECK(SM83_opcode_counts(cpu, counts) == count);
+  for (size_t i = 0; i < count; i++) {
+    CHECK(counts[i].opcode == expected[i].opcode);
+    CHECK(counts[i].runs == expected[i].runs && counts[i].cycles == expected[i].cycles);
+    CHECK(!memcmp(counts[i].histogram, expected[i].histogram, sizeof(expected[i].histogram)));
+  }
+  CHECK(!strcmp(counts[3].mnemonic, "SWAP A"));
+
+  SM83_clear_opcode_counts(cpu);
+  CHECK(SM83_opcode_counts(cpu, counts) == 0);
+  shutdown(machine);
+}
+#endif
+
+#ifdef SM83_PROFILE
+// A sample every M-cycle, each one going to whatever the shadow stack says once the
+// instruction it landed in is done
+static void test_profile(void) {
+  static const uint8_t program[] = {
+    0xCD, 0x10, 0x00, // main: CALL outer
+    0x18, 0xFB,       // JR main
+  };
+  static const uint8_t outer[] = {
+    0x00,             // NOP
+    0xCD, 0x20, 0x00, // CALL inner
+    0xC9,             // RET
+  };
+  static const uint8_t inner[] = {
+    0x00, 0x00, // NOP, NOP
+    0xC9,       // RET
+  };
+  static const char symbols[] =
+    "; Symbols of the program above\n"
+    "00:0000 main\n"
+    "00:0010 outer ; The caller\r\n"
+    "not a symbol\n"
+    "00:0020\tinner\n";
+
+  // 104 T-cycles a loop: 7 samples after main's CALL and at the JR, 11 in outer (the CALL
+  // into it included, its RET not), 8 in inner
+  static const char folded[] = "root;outer 440\nroot;outer;inner 320\nroot;main 280\n";
+  static const struct { const char *name; uint64_t inclusive, exclusive; } expected[] = {
+    { "root", 1040, 0 },
+    { "outer", 760, 440 },
+    { "inner", 320, 320 },
+    { "main", 280, 280 },
+  };
+  const size_t count = sizeof(expected) / sizeof(expected[0]);
+
+  Machine *machine = boot(program, sizeof(program));
+  SM83 *cpu = &machine->cpu;
+  memcpy(machine->memory + 0x0010, outer, sizeof(outer));
+  memcpy(machine->memory + 0x0020, inner, sizeof(inner));
+
+  static SM83Profile profile;
+  SM83_profile_init(&profile, 4);
+  CHECK(SM83_profile_symbols(&profile, symbols, sizeof(symbols) - 1) == 3);
+  CHECK(SM83_profile_start(cpu, &profile) == 0);
+  CHECK(SM83_run(cpu, 104 * 10) == 104 * 10);
+  SM83_profile_stop(cpu);
+  CHECK(cpu->pc == 0x0000 && cpu->bus->event_count == 0);
+
+  char text[256];
+  CHECK(SM83_profile_folded(&profile, text, sizeof(text)) == sizeof(folded) - 1);
+  CHECK(!strcmp(text, folded));
+
+  // Cut short like snprintf
+  CHECK(SM83_profile_folded(&profile, text, 8) == sizeof(folded) - 1);
+  CHECK(!strcmp(text, "root;ou"));
+
+  static SM83ProfileFunction functions[SM83_PROFILE_NODES];
+  CHECK(SM83_profile_functions(&profile, functions) == count);
+  for (size_t i = 0; i < count; i++) {
+    CHECK(!strcmp(functions[i].name, expected[i].name));
+    CHECK(functions[i].inclusive == expected[i].inclusive && functions[i].exclusive == expected[i].exclusive);
+  }
+
+  // Without symbols, by address and under the root itself
+  SM83_profile_init(&profile, 4);
+  cpu->pc = 0;
+  CHECK(SM83_profile_start(cpu, &profile) == 0);
+  SM83_run(cpu, 104);
+  SM83_profile_stop(cpu);
+  CHECK(SM83_profile_folded(&profile, text, sizeof(text)) < sizeof(text));
+  CHECK(!strcmp(text, "root 28\nroot;00:0010 44\nroot;00:0010;00:0020 32\n"));
+  shutdown(machine);
+}
+#endif
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} tests[] = {
+  { "setup_threads", test_setup_threads }, // First, before anything fills the flag tables
+  { "reset", test_reset },
+  { "ei_delay", test_ei_delay },
+  { "interrupt_order", test_interrupt_order },
+  { "halt", test_halt },
+  { "events", test_events },
+  { "alias", test_alias },
+  { "dirty_pages", test_dirty_pages },
+  { "save_state", test_save_state },
+  { "rewind", test_rewind },
+  { "pool", test_pool },
+  { "disassemble", test_disassemble },
+  { "pool_disassemble", test_pool_disassemble },
+  { "batch", test_batch },
+#ifdef SM83_JIT
+  { "jit_wx", test_jit_wx },
+  { "jit_alu", test_jit_alu },
+#endif
+#ifdef SM83_OPCODE_COUNTS
+  { "opcode_counts", test_opcode_counts },
+#endif
+#ifdef SM83_PROFILE
+  { "profile", test_profile },
+#endif
+};
+
+int main(void) {
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    current = tests[i].name;
+    tests[i].run();
+  }
+
+  printf("%s: %zu tests, %u failed checks\n", MODE, sizeof(tests) / sizeof(tests[0]), failures);
+  return failures != 0;
+}
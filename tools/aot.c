@@ -0,0 +1,314 @@
+// Ahead-of-time recompiler: translates the code reachable in a ROM image into a C file
+// that replaces SM83_run's interpreter loop for that ROM.
+//
+//   ./aot rom.gb rom.c [entry...]
+//   cc -O2 -I path/to/SM83.h -c rom.c
+//
+// rom.c holds the SM83.h implementation (don't define SM83_IMPLEMENTATION anywhere else)
+// and SM83_run uses it transparently. Only 0x0000-0x7FFF is translated, as laid out in
+// the file (so bank 1 for 0x4000-0x7FFF), and it's assumed to be read-only. Bank 1 code
+// only runs translated while 0x4000 is mapped right after 0x0000 in host memory, as in the
+// file; other banks run through the interpreter. Every basic block becomes a label calling
+// the same handlers SM83.h runs, direct jumps become gotos, and anything else (RET, JP HL,
+// code outside the ROM) goes through a switch on PC, falling back to the interpreter when
+// it doesn't land on a block.
+// Entries default to 0x0100, the RST vectors and the interrupt vectors.
+#define SM83_DISPATCH_SWITCH // For the handler names
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROM_SIZE 0x8000
+
+#define NAME(opcode, handler) [opcode] = #handler,
+static const char *const names[0x100] = { SM83_OPCODES(NAME) [0xCB] = "cb" };
+static const char *const cb_names[0x100] = { SM83_CB_OPCODES(NAME) };
+#undef NAME
+
+static uint8_t rom[ROM_SIZE];
+static size_t rom_size;
+
+static uint8_t code[ROM_SIZE]; // Instruction starts found by the walk
+static uint8_t leaders[ROM_SIZE]; // Basic block starts
+
+// What an instruction does to control flow
+enum {
+  FLOW_NEXT, // Falls through
+  FLOW_JUMP, // Always goes to `target`
+  FLOW_BRANCH, // Goes to `target` or falls through (JR/JP cc)
+  FLOW_CALL, // Goes to `target`, comes back to the next one (CALL, CALL cc, RST)
+  FLOW_RETURN_CC, // Falls through or returns
+  FLOW_INDIRECT, // RET, RETI, JP HL
+  FLOW_BREAK, // Falls through, but has to go back to the run loop (HALT, STOP, EI, DI)
+  FLOW_INVALID,
+};
+
+typedef struct Decoded {
+  uint8_t opcode;
+  const SM83Instruction *instruction;
+  const char *handler;
+  unsigned size, length; // Opcode bytes, whole instruction
+  unsigned flow;
+  uint16_t target, next;
+} Decoded;
+
+static int decode(uint16_t addr, Decoded *out) {
+  if (addr >= rom_size) return 0;
+
+  const uint8_t opcode = rom[addr];
+  out->opcode = opcode;
+  out->instruction = &instructions[opcode];
+  out->handler = names[opcode];
+  out->size = 1;
+  out->length = out->instruction->length;
+
+  if (opcode == 0xCB) {
+    if (addr + 1u >= rom_size) return 0;
+    out->instruction = &cb_instructions[rom[addr + 1]];
+    out->handler = cb_names[rom[addr + 1]];
+    out->size = out->length = 2;
+  }
+
+  if (out->length > 3) {
+    out->flow = FLOW_INVALID;
+    out->length = 1;
+    out->next = (uint16_t)(addr + 1);
+    return 1;
+  }
+
+  if (addr + out->length > rom_size) return 0;
+
+  const uint16_t nn = out->length == 3 ? (uint16_t)(rom[addr + 2] << 8 | rom[addr + 1]) : 0;
+  out->next = (uint16_t)(addr + out->length);
+  out->target = 0;
+  out->flow = FLOW_NEXT;
+
+  if (out->size == 2) return 1;
+
+  switch (opcode) {
+    case 0x18: out->flow = FLOW_JUMP; out->target = (uint16_t)(out->next + (int8_t)rom[addr + 1]); break;
+    case 0x20: case 0x28: case 0x30: case 0x38:
+      out->flow = FLOW_BRANCH; out->target = (uint16_t)(out->next + (int8_t)rom[addr + 1]); break;
+    case 0xC3: out->flow = FLOW_JUMP; out->target = nn; break;
+    case 0xC2: case 0xCA: case 0xD2: case 0xDA: out->flow = FLOW_BRANCH; out->target = nn; break;
+    case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC: out->flow = FLOW_CALL; out->target = nn; break;
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+      out->flow = FLOW_CALL; out->target = opcode & 0x38; break;
+    case 0xC0: case 0xC8: case 0xD0: case 0xD8: out->flow = FLOW_RETURN_CC; break;
+    case 0xC9: case 0xD9: case 0xE9: out->flow = FLOW_INDIRECT; break;
+    case 0x10: out->flow = FLOW_BREAK; out->next = (uint16_t)(addr + 1); break; // STOP doesn't read its operand
+    case 0x76: case 0xF3: case 0xFB: out->flow = FLOW_BREAK; break;
+    default: break;
+  }
+
+  return 1;
+}
+
+// Marks every instruction reachable from `entry` and the blocks they start
+static void walk(uint16_t entry) {
+  static uint16_t stack[ROM_SIZE * 2];
+  size_t top = 0;
+
+  if (entry >= rom_size) return;
+  leaders[entry] = 1;
+  stack[top++] = entry;
+
+  while (top) {
+    uint16_t addr = stack[--top];
+
+    while (addr < rom_size && !code[addr]) {
+      Decoded d;
+      if (!decode(addr, &d)) break;
+      code[addr] = 1;
+
+      if (d.flow == FLOW_JUMP || d.flow == FLOW_BRANCH || d.flow == FLOW_CALL) {
+        if (d.target < rom_size) {
+          leaders[d.target] = 1;
+          stack[top++] = d.target;
+        }
+      }
+
+      if (d.flow == FLOW_JUMP || d.flow == FLOW_INDIRECT || d.flow == FLOW_INVALID) break;
+
+      // Whatever comes after a branch, call or break starts a block of its own
+      if (d.flow != FLOW_NEXT && d.next < rom_size) leaders[d.next] = 1;
+      addr = d.next;
+    }
+  }
+}
+
+// Where to go after reaching `addr` (a block of ours, or the run loop)
+static void go(FILE *out, uint16_t addr) {
+  if (addr < rom_size && leaders[addr]) {
+    fprintf(out, "JUMP(body_%04X);", addr);
+  } else {
+    fprintf(out, "goto dispatch;");
+  }
+}
+
+static void emit_block(FILE *out, uint16_t start) {
+  fprintf(out, "\nbody_%04X:\n", start);
+  if (start >= 0x4000) fprintf(out, "  if (!BANK_ONE()) goto interpret;\n");
+
+  uint16_t addr = start;
+  for (;;) {
+    Decoded d;
+    if (!decode(addr, &d) || d.flow == FLOW_INVALID) {
+      fprintf(out, "  cpu->pc = 0x%04X; goto dispatch;\n", addr);
+      return;
+    }
+
+    // The mnemonic, with its operand filled in
+    char text[32];
+    const unsigned operand = d.length - d.size == 2 ? (unsigned)(rom[addr + 2] << 8 | rom[addr + 1])
+                             : d.length - d.size == 1 ? rom[addr + 1] : 0;
+    snprintf(text, sizeof(text), d.instruction->mnemonic, operand);
+
+    const int conditional = d.flow == FLOW_BRANCH || d.flow == FLOW_RETURN_CC ||
+                            (d.flow == FLOW_CALL && d.opcode != 0xCD && (d.opcode & 0xC7) != 0xC7);
+    // Whatever touches memory may have written IE or IF, or switched banks, and has to be
+    // followed by the same checks as a jump. Only in the middle of a block: the end of one
+    // is a jump already
+    const int memory = d.flow == FLOW_NEXT && (strchr(text, '[') || !strncmp(text, "PUSH", 4) ||
+                                               !strncmp(text, "POP", 3));
+    fprintf(out, "  %s(0x%04X, %s, %u); // %04X: %s\n", conditional ? "STEP_CC" : memory ? "STEP_MEM" : "STEP",
+            (unsigned)(addr + d.size), d.handler, d.instruction->ticks, addr, text);
+
+    switch (d.flow) {
+      case FLOW_JUMP: fprintf(out, "  "); go(out, d.target); fprintf(out, "\n"); return;
+      case FLOW_CALL:
+        if (conditional) { fprintf(out, "  if (cpu->pc == 0x%04X) ", d.next); go(out, d.next); fprintf(out, "\n"); }
+        fprintf(out, "  "); go(out, d.target); fprintf(out, "\n");
+        return;
+      case FLOW_BRANCH:
+        fprintf(out, "  if (cpu->pc == 0x%04X) ", d.target); go(out, d.target); fprintf(out, "\n");
+        fprintf(out, "  "); go(out, d.next); fprintf(out, "\n");
+        return;
+      case FLOW_RETURN_CC:
+        fprintf(out, "  if (cpu->pc == 0x%04X) ", d.next); go(out, d.next); fprintf(out, "\n");
+        fprintf(out, "  goto dispatch;\n");
+        return;
+      case FLOW_INDIRECT: case FLOW_BREAK: fprintf(out, "  goto dispatch;\n"); return;
+      case FLOW_NEXT: break;
+      case FLOW_INVALID: default: return;
+    }
+
+    addr = d.next;
+    if (addr >= rom_size || leaders[addr]) {
+      fprintf(out, "  "); go(out, addr); fprintf(out, "\n");
+      return;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s rom.gb out.c [entry...]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *in = fopen(argv[1], "rb");
+  if (!in) { perror(argv[1]); return 1; }
+  rom_size = fread(rom, 1, sizeof(rom), in);
+  fclose(in);
+
+  if (argc > 3) {
+    for (int i = 3; i < argc; i++) walk((uint16_t)strtoul(argv[i], NULL, 0));
+  } else {
+    walk(0x0100);
+    for (uint16_t vector = 0x00; vector <= 0x60; vector += 8) walk(vector);
+  }
+
+  FILE *out = fopen(argv[2], "w");
+  if (!out) { perror(argv[2]); return 1; }
+
+  unsigned blocks = 0, instructions_found = 0;
+  for (size_t i = 0; i < rom_size; i++) { blocks += leaders[i]; instructions_found += code[i]; }
+
+  fprintf(out,
+    "// Generated by tools/aot from %s: %u instructions in %u blocks\n"
+    "#include \"SM83.h\"\n\n"
+    "static uint64_t aot_run_slice(SM83 *self, uint64_t cycles);\n"
+    "#define SM83_RUN_SLICE aot_run_slice\n"
+    "#define SM83_IMPLEMENTATION\n"
+    "#include \"SM83.h\"\n\n"
+    "#if defined(SM83_DISPATCH_SWITCH) || defined(SM83_DISPATCH_GOTO) || defined(SM83_BLOCK_CACHE)\n"
+    "#error \"The translated ROM replaces the other SM83_run cores\"\n"
+    "#endif\n\n"
+    "// Instructions set PC past their opcode and let the handler take it from there\n"
+    "#define STEP(pc_, handler, ticks) { \\\n"
+    "  cpu->pc = pc_; \\\n"
+    "  handler(cpu); \\\n"
+    "  elapsed += ticks; \\\n"
+    "  if (elapsed >= cycles) goto exit; \\\n"
+    "}\n"
+    "#define STEP_CC(pc_, handler, ticks) { \\\n"
+    "  cpu->pc = pc_; \\\n"
+    "  cpu->t = 0; \\\n"
+    "  handler(cpu); \\\n"
+    "  elapsed += ticks + cpu->t; \\\n"
+    "  if (elapsed >= cycles) goto exit; \\\n"
+    "}\n"
+    "// Writes may land on IE or IF, or switch the bank under the code\n"
+    "#define STEP_MEM(pc_, handler, ticks) { \\\n"
+    "  STEP(pc_, handler, ticks) \\\n"
+    "  if (needs_service(cpu) || (cpu->pc >= 0x4000 && cpu->pc < 0x8000 && !BANK_ONE())) goto dispatch; \\\n"
+    "}\n\n"
+    "// Between blocks, for interrupts the last one may have enabled or requested\n"
+    "#define JUMP(label) { \\\n"
+    "  if (needs_service(cpu)) goto dispatch; \\\n"
+    "  goto label; \\\n"
+    "}\n\n"
+    "// Whether 0x4000-0x7FFF holds the bank translated, the one right after 0x0000-0x3FFF\n"
+    "#define BANK_ONE() \\\n"
+    "  (cpu->bus->read_map[0x00] && cpu->bus->read_map[0x40] == cpu->bus->read_map[0x00] + 0x4000)\n\n"
+    "static uint64_t aot_run_slice(SM83 *self, uint64_t cycles) {\n"
+    "  SM83 local;\n"
+    "  memcpy(&local, self, offsetof(SM83, bus));\n"
+    "  local.bus = self->bus;\n\n"
+    "  SM83 *const cpu = &local;\n"
+    "  uint64_t elapsed = 0;\n\n"
+    "dispatch:\n"
+    "  if (elapsed >= cycles) goto exit;\n\n"
+    "  if (needs_service(cpu)) {\n"
+    "    const uint8_t ticks = service(cpu);\n"
+    "    if (ticks) {\n"
+    "      elapsed += cpu->halted ? halt_skip(elapsed, cycles) : ticks;\n"
+    "      goto dispatch;\n"
+    "    }\n"
+    "    // EI's delay just ran out: the one instruction after it, then the interrupt\n"
+    "    goto interpret;\n"
+    "  }\n\n"
+    "  switch (cpu->pc) {\n",
+    argv[1], instructions_found, blocks);
+
+  for (size_t i = 0; i < rom_size; i++) {
+    if (leaders[i]) fprintf(out, "    case 0x%04X: goto body_%04X;\n", (unsigned)i, (unsigned)i);
+  }
+
+  fprintf(out,
+    "    default: break;\n"
+    "  }\n\n"
+    "  // Not ours, one instruction through the interpreter\n"
+    "interpret:\n"
+    "  elapsed += execute(cpu);\n"
+    "  goto dispatch;\n");
+
+  for (size_t i = 0; i < rom_size; i++) {
+    if (leaders[i]) emit_block(out, (uint16_t)i);
+  }
+
+  fprintf(out,
+    "\nexit:\n"
+    "  flags_sync(cpu);\n"
+    "  memcpy(self, &local, offsetof(SM83, bus));\n"
+    "  return elapsed;\n"
+    "}\n");
+
+  fclose(out);
+  fprintf(stderr, "%s: %u instructions in %u blocks\n", argv[2], instructions_found, blocks);
+  return 0;
+}
@@ -0,0 +1,125 @@
+// Disassembles a whole ROM, one bank per thread, into a text listing or a binary index.
+//
+//   ./disasm [-i] [-j threads] game.gb game.asm
+//
+// The listing has one line per instruction, with its bank, address and bytes:
+//
+//   01:4000  FA 00 C0  LD A, [0xC000]
+//
+// With -i the output is the SM83IndexEntry array instead (offset in the ROM, opcode and
+// operand of each instruction, in host byte order). It's a linear sweep: data gets
+// disassembled as if it were code, and a bank that ends in the middle of an instruction
+// ends with DB lines. The ROM is mapped, each bank is listed into a buffer of its own, and
+// the buffers are written out in order
+#define _POSIX_C_SOURCE 200112L
+
+#define SM83_IMPLEMENTATION
+#include "SM83.h"
+#define SM83_POOL_IMPLEMENTATION
+#include "SM83_pool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LINE_SIZE 64
+
+typedef struct Listing {
+  char *text;
+  size_t size, capacity;
+} Listing;
+
+typedef struct Disassembly {
+  const uint8_t *rom;
+  Listing *banks;
+} Disassembly;
+
+static void list(void *data, size_t bank, const SM83Disassembly *instruction) {
+  const Disassembly *disassembly = (const Disassembly *)data;
+  Listing *listing = &disassembly->banks[bank];
+
+  // Grows rarely, the first guess fits most banks
+  if (listing->capacity - listing->size < LINE_SIZE) {
+    const size_t capacity = listing->capacity ? listing->capacity * 2 : 0x4000 * 16;
+    char *text = (char *)realloc(listing->text, capacity);
+    if (!text) { fprintf(stderr, "Out of memory\n"); exit(2); }
+    listing->text = text;
+    listing->capacity = capacity;
+  }
+
+  static const char digits[] = "0123456789ABCDEF";
+  char bytes[] = "        ";
+  for (uint8_t i = 0; i < instruction->length; i++) {
+    const uint8_t byte = disassembly->rom[instruction->offset + i];
+    bytes[i * 3] = digits[byte >> 4];
+    bytes[i * 3 + 1] = digits[byte & 0xF];
+  }
+
+  const int length = snprintf(listing->text + listing->size, LINE_SIZE, "%02X:%04X  %s  %s\n", (unsigned)bank,
+                              instruction->addr, bytes, instruction->text);
+  listing->size += (size_t)length;
+}
+
+int main(int argc, char **argv) {
+  int binary = 0;
+  unsigned threads = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ij:")) != -1) {
+    switch (opt) {
+    case 'i': binary = 1; break;
+    case 'j': threads = (unsigned)strtoul(optarg, NULL, 0); break;
+    default:
+      fprintf(stderr, "Usage: %s [-i] [-j threads] rom.gb out\n", argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 2) {
+    fprintf(stderr, "Usage: %s [-i] [-j threads] rom.gb out\n", argv[0]);
+    return 2;
+  }
+
+  const char *path = argv[optind];
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { perror(path); return 2; }
+
+  const size_t size = (size_t)st.st_size;
+  if (!size) { fprintf(stderr, "%s: empty\n", path); return 2; }
+
+  void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapped == MAP_FAILED) { perror(path); return 2; }
+  close(fd);
+  const uint8_t *rom = (const uint8_t *)mapped;
+
+  FILE *out = fopen(argv[optind + 1], "wb");
+  if (!out) { perror(argv[optind + 1]); return 2; }
+
+  if (binary) {
+    SM83IndexEntry *index = (SM83IndexEntry *)malloc(size * sizeof(SM83IndexEntry));
+    if (!index) { fprintf(stderr, "Out of memory\n"); return 2; }
+
+    const size_t count = SM83_pool_disassemble_index(rom, size, index, threads);
+    fwrite(index, sizeof(SM83IndexEntry), count, out);
+    free(index);
+  } else {
+    const size_t banks = (size + 0x3FFF) / 0x4000;
+    Disassembly disassembly = { rom, (Listing *)calloc(banks, sizeof(Listing)) };
+    if (!disassembly.banks) { fprintf(stderr, "Out of memory\n"); return 2; }
+
+    SM83_pool_disassemble(rom, size, list, &disassembly, threads);
+
+    for (size_t bank = 0; bank < banks; bank++) {
+      fwrite(disassembly.banks[bank].text, 1, disassembly.banks[bank].size, out);
+      free(disassembly.banks[bank].text);
+    }
+    free(disassembly.banks);
+  }
+
+  munmap(mapped, size);
+  if (fclose(out) != 0) { perror(argv[optind + 1]); return 2; }
+  return 0;
+}
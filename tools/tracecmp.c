@@ -0,0 +1,359 @@
+// Compares two execution traces record by record and stops at the first one that differs,
+// with the records leading up to it.
+//
+//   ./tracecmp [-c context] [-s skip] [-S skip] ours.log reference.log
+//
+// Either file may be a binary trace written through SM83_trace.h, or a text log with one
+// line per instruction made of KEY:HEX fields, as most emulators and gameboy-doctor print:
+//
+//   A:01 F:B0 B:00 C:13 D:00 E:D8 H:01 L:4D SP:FFFE PC:0100 PCMEM:00,C3,13,02
+//
+// Only the fields both sides have are compared (A, F, B, C, D, E, H, L, SP, PC and the
+// PCMEM bytes), anything else on the line is ignored, and two records with none of them in
+// common are an error. -s and -S skip that many records at the start of the first and
+// second file (e.g. the boot ROM). Both files are mapped, and lines that are byte for byte
+// the same aren't even parsed. Exits with 0 if the traces
+// match, 1 if they don't, 2 on errors
+#define _POSIX_C_SOURCE 200112L
+
+#define SM83_IMPLEMENTATION // For instruction lengths
+#include "SM83.h"
+#include "SM83_trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_CONTEXT 256
+
+enum { FIELD_A, FIELD_F, FIELD_B, FIELD_C, FIELD_D, FIELD_E, FIELD_H, FIELD_L, FIELD_SP, FIELD_PC, FIELDS };
+static const char *const field_names[FIELDS] = { "A", "F", "B", "C", "D", "E", "H", "L", "SP", "PC" };
+
+// One record, whatever it came from
+typedef struct Entry {
+  unsigned present; // 1 << FIELD_*
+  uint16_t values[FIELDS];
+  uint8_t memory[4];
+  uint8_t memory_count; // PCMEM bytes known
+} Entry;
+
+typedef struct Trace {
+  const char *path;
+  const char *data;
+  size_t size;
+  int binary;
+
+  size_t at; // Next record (or line)
+  uint64_t index; // Records read
+  uint64_t line; // Text only, lines read (blank ones included)
+
+  size_t history[MAX_CONTEXT]; // Offsets of the last records read, as a ring on `index`
+} Trace;
+
+static unsigned context = 8;
+
+static int trace_open(Trace *trace, const char *path) {
+  trace->path = path;
+
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { perror(path); return -1; }
+
+  trace->size = (size_t)st.st_size;
+  if (trace->size) {
+    void *data = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) { perror(path); close(fd); return -1; }
+    posix_madvise(data, trace->size, POSIX_MADV_SEQUENTIAL);
+    trace->data = (const char *)data;
+  }
+  close(fd);
+
+  SM83TraceHeader header;
+  if (trace->size >= sizeof(header)) {
+    memcpy(&header, trace->data, sizeof(header));
+    trace->binary = !memcmp(header.magic, SM83_TRACE_MAGIC, sizeof(header.magic));
+  }
+
+  if (trace->binary) {
+    if (header.version != SM83_TRACE_VERSION || header.record_size != sizeof(SM83TraceRecord)) {
+      fprintf(stderr, "%s: unsupported trace (version %u, %u byte records)\n", path, header.version, header.record_size);
+      return -1;
+    }
+    trace->at = sizeof(header);
+  }
+
+  return 0;
+}
+
+// Finds the next record, returns 0 at the end
+static int trace_next(Trace *trace, const char **record, size_t *length) {
+  if (trace->binary) {
+    if (trace->size - trace->at < sizeof(SM83TraceRecord)) return 0;
+    *record = trace->data + trace->at;
+    *length = sizeof(SM83TraceRecord);
+    trace->history[trace->index++ % MAX_CONTEXT] = trace->at;
+    trace->at += sizeof(SM83TraceRecord);
+    return 1;
+  }
+
+  while (trace->at < trace->size) {
+    const char *start = trace->data + trace->at;
+    const char *end = memchr(start, '\n', trace->size - trace->at);
+    const size_t next = end ? (size_t)(end - trace->data) + 1 : trace->size;
+    if (!end) end = trace->data + trace->size;
+    if (end > start && end[-1] == '\r') end--;
+
+    const size_t offset = trace->at;
+    trace->at = next;
+    trace->line++;
+
+    // Blank lines aren't records
+    const char *c = start;
+    while (c < end && (*c == ' ' || *c == '\t')) c++;
+    if (c == end) continue;
+
+    *record = start;
+    *length = (size_t)(end - start);
+    trace->history[trace->index++ % MAX_CONTEXT] = offset;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Hex digits at `*at` (at most 4), advanced past them. -1 if there are none
+static long parse_hex(const char **at, const char *end) {
+  long value = -1;
+  for (int digits = 0; *at < end && digits < 4; (*at)++, digits++) {
+    const int digit = hex_digit(**at);
+    if (digit < 0) break;
+    value = (value < 0 ? 0 : value << 4) | digit;
+  }
+  return value;
+}
+
+// FIELD_* named `key`, -1 if none
+static int field_index(const char *key, size_t length) {
+  if (length == 1) {
+    switch (*key) {
+      case 'A': return FIELD_A;
+      case 'F': return FIELD_F;
+      case 'B': return FIELD_B;
+      case 'C': return FIELD_C;
+      case 'D': return FIELD_D;
+      case 'E': return FIELD_E;
+      case 'H': return FIELD_H;
+      case 'L': return FIELD_L;
+      default: return -1;
+    }
+  }
+
+  if (length == 2 && key[0] == 'S' && key[1] == 'P') return FIELD_SP;
+  if (length == 2 && key[0] == 'P' && key[1] == 'C') return FIELD_PC;
+  return -1;
+}
+
+static void parse_text(const char *line, size_t length, Entry *entry) {
+  const char *at = line, *const end = line + length;
+  memset(entry, 0, sizeof(*entry));
+
+  while (at < end) {
+    // KEY:VALUE, KEY being letters
+    while (at < end && !((*at >= 'A' && *at <= 'Z') || (*at >= 'a' && *at <= 'z'))) at++;
+    const char *key = at;
+    while (at < end && ((*at >= 'A' && *at <= 'Z') || (*at >= 'a' && *at <= 'z'))) at++;
+    const size_t key_length = (size_t)(at - key);
+    if (at == end || *at != ':') continue;
+    at++;
+
+    if (key_length == 5 && !strncmp(key, "PCMEM", 5)) {
+      while (entry->memory_count < sizeof(entry->memory)) {
+        const long byte = parse_hex(&at, end);
+        if (byte < 0) break;
+        entry->memory[entry->memory_count++] = (uint8_t)byte;
+        if (at == end || *at != ',') break;
+        at++;
+      }
+      continue;
+    }
+
+    const int field = field_index(key, key_length);
+    if (field < 0) continue;
+
+    const long value = parse_hex(&at, end);
+    if (value >= 0) {
+      entry->values[field] = (uint16_t)value;
+      entry->present |= 1u << field;
+    }
+  }
+}
+
+static void parse_binary(const char *data, Entry *entry) {
+  SM83TraceRecord record;
+  memcpy(&record, data, sizeof(record));
+  memset(entry, 0, sizeof(*entry));
+
+  const uint16_t values[FIELDS] = {
+    (uint16_t)(record.af >> 8), record.af & 0xFF, (uint16_t)(record.bc >> 8), record.bc & 0xFF,
+    (uint16_t)(record.de >> 8), record.de & 0xFF, (uint16_t)(record.hl >> 8), record.hl & 0xFF,
+    record.sp, record.pc,
+  };
+  memcpy(entry->values, values, sizeof(values));
+  entry->present = (1u << FIELDS) - 1;
+
+  // Only the bytes of the instruction itself are in the record
+  const uint8_t length = record.opcode[0] == 0xCB ? 2 : instructions[record.opcode[0]].length;
+  entry->memory_count = length < 3 ? length : 3;
+  memcpy(entry->memory, record.opcode, entry->memory_count);
+}
+
+static void parse(const Trace *trace, const char *record, size_t length, Entry *entry) {
+  if (trace->binary) parse_binary(record, entry);
+  else parse_text(record, length, entry);
+}
+
+// Whether the two have anything at all to compare
+static int comparable(const Entry *a, const Entry *b) {
+  return (a->present & b->present) || (a->memory_count && b->memory_count);
+}
+
+// Fields both have and disagree on, as 1 << FIELD_*, and 1 << FIELDS for PCMEM
+static unsigned differences(const Entry *a, const Entry *b) {
+  unsigned different = 0;
+
+  for (unsigned field = 0; field < FIELDS; field++) {
+    const unsigned bit = 1u << field;
+    if ((a->present & b->present & bit) && a->values[field] != b->values[field]) different |= bit;
+  }
+
+  const uint8_t count = a->memory_count < b->memory_count ? a->memory_count : b->memory_count;
+  if (memcmp(a->memory, b->memory, count)) different |= 1u << FIELDS;
+
+  return different;
+}
+
+// Prints record `index` (which must still be in the history) as it is in the file
+static void print_record(const Trace *trace, uint64_t index, const char *marker) {
+  const char *record = trace->data + trace->history[index % MAX_CONTEXT];
+
+  if (trace->binary) {
+    SM83TraceRecord r;
+    memcpy(&r, record, sizeof(r));
+    Entry entry;
+    parse_binary(record, &entry);
+
+    printf("%s %10llu  A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:",
+           marker, (unsigned long long)index, r.af >> 8, r.af & 0xFF, r.bc >> 8, r.bc & 0xFF,
+           r.de >> 8, r.de & 0xFF, r.hl >> 8, r.hl & 0xFF, r.sp, r.pc);
+    for (uint8_t i = 0; i < entry.memory_count; i++) printf(i ? ",%02X" : "%02X", r.opcode[i]);
+    printf("  CY:%llu\n", (unsigned long long)r.cycles);
+    return;
+  }
+
+  const char *end = memchr(record, '\n', (size_t)(trace->data + trace->size - record));
+  if (!end) end = trace->data + trace->size;
+  if (end > record && end[-1] == '\r') end--;
+  printf("%s %10llu  %.*s\n", marker, (unsigned long long)index, (int)(end - record), record);
+}
+
+static void print_context(const Trace *trace) {
+  const uint64_t last = trace->index - 1;
+  const uint64_t first = last > context ? last - context : 0;
+
+  printf("%s:\n", trace->path);
+  for (uint64_t index = first; index <= last; index++) print_record(trace, index, index == last ? ">" : " ");
+}
+
+int main(int argc, char **argv) {
+  uint64_t skip[2] = { 0, 0 };
+  int arg = 1;
+
+  for (; arg < argc && argv[arg][0] == '-' && arg + 1 < argc; arg += 2) {
+    const unsigned long long value = strtoull(argv[arg + 1], NULL, 0);
+    if (!strcmp(argv[arg], "-c")) context = value < MAX_CONTEXT ? (unsigned)value : MAX_CONTEXT - 1;
+    else if (!strcmp(argv[arg], "-s")) skip[0] = value;
+    else if (!strcmp(argv[arg], "-S")) skip[1] = value;
+    else break;
+  }
+
+  if (argc - arg != 2) {
+    fprintf(stderr, "usage: %s [-c context] [-s skip] [-S skip] ours reference\n", argv[0]);
+    return 2;
+  }
+
+  Trace traces[2];
+  memset(traces, 0, sizeof(traces));
+  if (trace_open(&traces[0], argv[arg]) || trace_open(&traces[1], argv[arg + 1])) return 2;
+
+  const char *records[2];
+  size_t lengths[2];
+
+  for (int i = 0; i < 2; i++) {
+    while (traces[i].index < skip[i] && trace_next(&traces[i], &records[i], &lengths[i])) {}
+  }
+
+  for (;;) {
+    const int a = trace_next(&traces[0], &records[0], &lengths[0]);
+    const int b = trace_next(&traces[1], &records[1], &lengths[1]);
+
+    if (!a || !b) {
+      if (a == b) {
+        printf("Traces match (%llu records)\n", (unsigned long long)(traces[0].index - skip[0]));
+        return 0;
+      }
+
+      const Trace *longer = a ? &traces[0] : &traces[1];
+      printf("%s ends after %llu records, %s goes on\n\n", (a ? &traces[1] : &traces[0])->path,
+             (unsigned long long)((a ? traces[1].index - skip[1] : traces[0].index - skip[0])), longer->path);
+      print_context(longer);
+      return 1;
+    }
+
+    // Same bytes, same record
+    if (traces[0].binary == traces[1].binary && lengths[0] == lengths[1] && !memcmp(records[0], records[1], lengths[0])) continue;
+
+    Entry entries[2];
+    parse(&traces[0], records[0], lengths[0], &entries[0]);
+    parse(&traces[1], records[1], lengths[1], &entries[1]);
+
+    // Nothing in common is a format neither side understands, not a match
+    if (!comparable(&entries[0], &entries[1])) {
+      fprintf(stderr, "Record %llu: no fields in common\n", (unsigned long long)(traces[0].index - 1 - skip[0]));
+      for (int i = 0; i < 2; i++) {
+        if (!traces[i].binary) fprintf(stderr, "  %s, line %llu\n", traces[i].path, (unsigned long long)traces[i].line);
+      }
+      return 2;
+    }
+
+    const unsigned different = differences(&entries[0], &entries[1]);
+    if (!different) continue;
+
+    printf("Divergence at record %llu\n", (unsigned long long)(traces[0].index - 1 - skip[0]));
+    for (int i = 0; i < 2; i++) {
+      if (!traces[i].binary) printf("  %s, line %llu\n", traces[i].path, (unsigned long long)traces[i].line);
+    }
+
+    for (unsigned field = 0; field < FIELDS; field++) {
+      if (!(different & (1u << field))) continue;
+      const int width = field >= FIELD_SP ? 4 : 2;
+      printf("  %-5s %0*X != %0*X\n", field_names[field], width, entries[0].values[field], width, entries[1].values[field]);
+    }
+    if (different & (1u << FIELDS)) printf("  PCMEM differs\n");
+
+    printf("\n");
+    print_context(&traces[0]);
+    printf("\n");
+    print_context(&traces[1]);
+    return 1;
+  }
+}